@@ -0,0 +1,569 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <thread>
+#include <memory>
+#include <algorithm>
+
+#include "maths/vec.h"
+
+#include "renderer/Ray.h"
+#include "renderer/Scene.h"
+#include "renderer/Renderer.h"
+
+#include "scene_objects/SimpleObjects.h"
+#include "scene_objects/StaticHybridDE.h"
+
+#include "formulas/Mandelbulb.h"
+#include "formulas/MengerSponge.h"
+#include "formulas/MengerSpongeC.h"
+#include "formulas/Cubicbulb.h"
+#include "formulas/Amazingbox.h"
+#include "formulas/Octopus.h"
+#include "formulas/PseudoKleinian.h"
+#include "formulas/MandalayKIFS.h"
+#include "formulas/BenesiPine2.h"
+#include "formulas/RiemannSphere.h"
+#include "formulas/SphereTree.h"
+
+
+
+// Benchmarks for tracking performance regressions:
+//  - Single iterations of each formula and each DE formula variant, in evaluations per second on one thread
+//  - Camera rays through fixed reference scenes on one thread, in rays per second and DE evaluations (march steps) per ray
+//  - Full renders of the reference scenes with each render mode over increasing thread counts
+// Results are printed as they're measured, and optionally written as JSON with --json <file>.
+// Usage: FractalTracerBench [--quick] [--json <file>] [--max-threads <n>]
+
+static volatile real sink; // Results are summed into this so the compiler can't drop the work
+
+static double min_time = 0.25; // Seconds to repeat each micro-benchmark for
+
+
+double seconds(const std::chrono::steady_clock::time_point t1, const std::chrono::steady_clock::time_point t2)
+{
+	return std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+}
+
+// Call f repeatedly until min_time has passed, f does evals_per_call evaluations and returns a sum of their results
+template <typename Function>
+double evalsPerSecond(const int evals_per_call, const Function & f)
+{
+	f(); // Warm up caches
+
+	int64_t evals = 0;
+	const auto t1 = std::chrono::steady_clock::now();
+	auto t2 = t1;
+	real sum = 0;
+	do
+	{
+		sum += f();
+		evals += evals_per_call;
+		t2 = std::chrono::steady_clock::now();
+	}
+	while (seconds(t1, t2) < min_time);
+
+	sink = sum;
+	return evals / seconds(t1, t2);
+}
+
+
+// Fixed points spread through the typical formula bounding volume, from the Halton sequence so they're the same every run
+std::vector<vec3r> makeBenchPoints(const int num_points, const real half_size)
+{
+	std::vector<vec3r> points(num_points);
+	for (int i = 0; i < num_points; ++i)
+	{
+		points[i] = vec3r(
+			(real)RadicalInverseBase2(i + 1),
+			(real)RadicalInverse(i + 1, 3),
+			(real)RadicalInverse(i + 1, 5)) * (2 * half_size) - half_size;
+	}
+	return points;
+}
+
+inline DualVec3r makeDual3(const vec3r & p) noexcept { return DualVec3r(Dual3r(p.x(), 0), Dual3r(p.y(), 1), Dual3r(p.z(), 2)); }
+
+// Directional dual along a fixed direction, like when marching with directional_march
+inline Dual1Vec3r makeDual1(const vec3r & p) noexcept
+{
+	const vec3r d = normalise(vec3r(1, 2, 3));
+	Dual1Vec3r p_dir;
+	for (int i = 0; i < 3; ++i)
+	{
+		p_dir.e[i].v[0] = p.e[i];
+		p_dir.e[i].v[1] = d.e[i];
+	}
+	return p_dir;
+}
+
+
+struct IterationResult
+{
+	std::string name;
+	double dual3_evals_per_sec; // Full Jacobian
+	double dual1_evals_per_sec; // Directional derivative only
+	double batch_evals_per_sec; // Full Jacobian through the virtual evalBatch, a packet of points at a time
+};
+
+// Time a single iteration of formula f from each point, which is the inner loop of every DE evaluation
+template <typename Func>
+IterationResult benchIteration(const char * name, const Func & f, const std::vector<vec3r> & points)
+{
+	std::vector<DualVec3r> p3(points.size());
+	std::vector<Dual1Vec3r> p1(points.size());
+	for (size_t i = 0; i < points.size(); ++i)
+	{
+		p3[i] = makeDual3(points[i]);
+		p1[i] = makeDual1(points[i]);
+	}
+
+	IterationResult result;
+	result.name = name;
+	result.dual3_evals_per_sec = evalsPerSecond((int)points.size(), [&]()
+	{
+		real sum = 0;
+		for (const DualVec3r & p : p3)
+		{
+			const IterationContext ctx = { p, 0 };
+			DualVec3r p_out;
+			f.evalT(ctx, p, p_out);
+			sum += p_out.x().v[0] + p_out.y().v[1];
+		}
+		return sum;
+	});
+	result.dual1_evals_per_sec = evalsPerSecond((int)points.size(), [&]()
+	{
+		real sum = 0;
+		for (const Dual1Vec3r & p : p1)
+		{
+			const DirectionalIterationContext ctx = { p, 0 };
+			Dual1Vec3r p_out;
+			f.evalT(ctx, p, p_out);
+			sum += p_out.x().v[0] + p_out.y().v[1];
+		}
+		return sum;
+	});
+
+	std::vector<IterationContext> batch_ctx(p3.size());
+	std::vector<DualVec3r> batch_out(p3.size());
+	for (size_t i = 0; i < p3.size(); ++i)
+		batch_ctx[i] = { p3[i], 0 };
+	bool active[packet_size];
+	std::fill(active, active + packet_size, true);
+	const IterationFunction & f_virtual = f;
+	result.batch_evals_per_sec = evalsPerSecond((int)points.size(), [&]()
+	{
+		real sum = 0;
+		for (size_t i = 0; i < p3.size(); i += packet_size)
+		{
+			const int count = std::min(packet_size, (int)(p3.size() - i));
+			f_virtual.evalBatch(&batch_ctx[i], &p3[i], &batch_out[i], active, count);
+			sum += batch_out[i].x().v[0] + batch_out[i].y().v[1];
+		}
+		return sum;
+	});
+
+	printf("  %-24s %8.2f M/s  directional %8.2f M/s  batch %8.2f M/s\n", name,
+		result.dual3_evals_per_sec * 1e-6, result.dual1_evals_per_sec * 1e-6, result.batch_evals_per_sec * 1e-6);
+	return result;
+}
+
+
+struct DEVariantResult
+{
+	std::string name;
+	double evals_per_sec;
+};
+
+// Time the DE formulas on their own, from the escaped points of a Mandelbulb so they see realistic inputs
+std::vector<DEVariantResult> benchDEVariants(const std::vector<vec3r> & points)
+{
+	const int max_iters = 16;
+	DualMandelbulbIteration mbi;
+	const StaticHybridDE<HybridSequence<0>, DualMandelbulbIteration> bulb(max_iters, mbi);
+	const real p = bulb.power_products.front(); // Like StaticHybridDE::getDE with a single formula
+	const real max_pow = bulb.power_products.back();
+
+	// Iterate each point to bailout like the DE objects do
+	std::vector<DualVec3r> w3(points.size());
+	std::vector<Dual1Vec3r> w1(points.size());
+	for (size_t i = 0; i < points.size(); ++i)
+	{
+		const DualVec3r p3 = makeDual3(points[i]);
+		const Dual1Vec3r p1 = makeDual1(points[i]);
+		IterationContext ctx3 = { p3, 0 };
+		DirectionalIterationContext ctx1 = { p1, 0 };
+		w3[i] = p3;
+		w1[i] = p1;
+		for (int n = 0; n < max_iters && length2(w3[i]) <= bulb.bailout_radius2; ++n)
+		{
+			DualVec3r w3_new;
+			Dual1Vec3r w1_new;
+			mbi.evalT(ctx3, w3[i], w3_new);
+			mbi.evalT(ctx1, w1[i], w1_new);
+			w3[i] = w3_new;
+			w1[i] = w1_new;
+		}
+	}
+
+	const auto sumDE3 = [&](const auto & de)
+	{
+		return evalsPerSecond((int)points.size(), [&]()
+		{
+			real sum = 0;
+			vec3r normal;
+			for (const DualVec3r & w : w3)
+				sum += de(w, normal) + normal.x();
+			return sum;
+		});
+	};
+
+	std::vector<DEVariantResult> results;
+	results.push_back({ "getLinearDE",        sumDE3([&](const DualVec3r & w, vec3r & n) { return bulb.getLinearDE(w, n); }) });
+	results.push_back({ "getPolynomialDE",    sumDE3([&](const DualVec3r & w, vec3r & n) { return bulb.getPolynomialDE(w, n); }) });
+	results.push_back({ "getHybridDEClaude",  sumDE3([&](const DualVec3r & w, vec3r & n) { return bulb.getHybridDEClaude(1, 8, w, n); }) });
+	results.push_back({ "getHybridDEKnighty", sumDE3([&](const DualVec3r & w, vec3r & n) { return bulb.getHybridDEKnighty(p, max_pow, w, n); }) });
+	results.push_back({ "getHybridDEKnighty (directional)", evalsPerSecond((int)points.size(), [&]()
+	{
+		real sum = 0;
+		for (const Dual1Vec3r & w : w1)
+			sum += bulb.getHybridDEKnighty(p, max_pow, w);
+		return sum;
+	}) });
+
+	for (const DEVariantResult & r : results)
+		printf("  %-34s %8.2f M/s\n", r.name.c_str(), r.evals_per_sec * 1e-6);
+	return results;
+}
+
+
+// Forwards all DE evaluations to another object while counting them, to measure march steps without touching the renderer.
+// Points at the wrapped object and the counter, so they have to outlive the scene.
+struct CountingDE final : public DualDEObject
+{
+	const DualDEObject * const inner;
+	int64_t * const count;
+
+
+	CountingDE(const DualDEObject & inner_, int64_t * const count_) : DualDEObject(inner_), inner(&inner_), count(count_) { }
+
+	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept override final
+	{
+		(*count)++;
+		return inner->getDE(p_os, normal_os_out);
+	}
+
+	virtual real getDirectionalDE(const Dual1Vec3r & p_os) const noexcept override final
+	{
+		(*count)++;
+		return inner->getDirectionalDE(p_os);
+	}
+
+#if USE_DOUBLE
+	virtual real getDEFloat(const DualVec3f & p_os) const noexcept override final
+	{
+		(*count)++;
+		return inner->getDEFloat(p_os);
+	}
+
+	virtual real getDirectionalDEFloat(const Dual1Vec3f & p_os) const noexcept override final
+	{
+		(*count)++;
+		return inner->getDirectionalDEFloat(p_os);
+	}
+#endif
+
+	virtual SceneObject * clone() const override
+	{
+		return new CountingDE(*this);
+	}
+};
+
+
+// A reference scene is a ground sphere with a fractal on it, seen from the default camera
+struct BenchScene
+{
+	std::string name;
+	std::unique_ptr<DualDEObject> fractal;
+};
+
+void addGround(Scene & scene)
+{
+	Sphere ground;
+	const real bigrad = 128;
+	ground.centre = { 0, -bigrad - 1.5f, 0 };
+	ground.radius = bigrad;
+	ground.mat.albedo = vec3f{ 0.8f, 0.2f, 0.05f };
+	ground.mat.use_fresnel = true;
+	scene.objects.push_back(ground.clone());
+}
+
+std::vector<BenchScene> makeBenchScenes()
+{
+	const int max_iters = 64;
+	DualMandelbulbIteration mbi;
+	DualMengerSpongeCIteration msi;
+
+	std::vector<BenchScene> scenes;
+
+	// The demo scene
+	{
+		auto hybrid = std::make_unique<StaticHybridDE<HybridSequence<0, 1>, DualMandelbulbIteration, DualMengerSpongeCIteration>>(max_iters, mbi, msi);
+		hybrid->radius = 1.5f;
+		hybrid->step_scale = 0.25;
+		scenes.push_back({ "hybrid_static", std::move(hybrid) });
+	}
+
+	// Same formulas through the virtual iteration functions
+	{
+		auto hybrid = std::make_unique<GeneralDualDE>(max_iters, std::vector<IterationFunction *>{ mbi.clone(), msi.clone() }, std::vector<char>{ 0, 1 });
+		hybrid->radius = 1.5f;
+		hybrid->step_scale = 0.25;
+		scenes.push_back({ "hybrid_general", std::move(hybrid) });
+	}
+
+	{
+		auto bulb = std::make_unique<MandelbulbDual>();
+		bulb->radius = 1.25f;
+		bulb->step_scale = 1;
+		scenes.push_back({ "mandelbulb", std::move(bulb) });
+	}
+
+	{
+		auto sponge = std::make_unique<StaticHybridDE<HybridSequence<0>, DualMengerSpongeCIteration>>(max_iters, msi);
+		sponge->radius = 1.5f;
+		sponge->step_scale = 1;
+		scenes.push_back({ "menger_sponge", std::move(sponge) });
+	}
+
+	for (BenchScene & s : scenes)
+	{
+		s.fractal->mat.albedo = { 0.1f, 0.3f, 0.7f };
+		s.fractal->mat.use_fresnel = true;
+	}
+	return scenes;
+}
+
+
+struct RenderResult
+{
+	std::string mode;
+	int threads;
+	double seconds;
+	double samples_per_sec; // Camera samples, each one a whole path
+};
+
+struct SceneResult
+{
+	std::string name;
+	double primary_rays_per_sec;
+	double steps_per_primary_ray; // DE evaluations to intersect a camera ray against the fractal
+	double primary_hit_fraction;
+	std::vector<RenderResult> renders;
+};
+
+// Intersect the first pass of camera rays in packets like renderSpan, returns the number of rays that hit anything
+int64_t tracePrimaryRays(const Scene & scene, const int xres, const int yres, const PassSamples & pass_samples)
+{
+	int64_t num_hits = 0;
+	for (int y = 0; y < yres; ++y)
+	for (int x = 0; x < xres; x += packet_size)
+	{
+		RayPacket packet;
+		packet.num_rays = std::min(packet_size, xres - x);
+		for (int i = 0; i < packet.num_rays; ++i)
+		{
+			PixelSampler sampler = getPixelSampler(x + i, y, 0, xres, yres, pass_samples);
+			const Ray r = generateCameraRay(scene.camera, x + i, y, 0, 0, xres, yres, sampler);
+			packet.o[i] = r.o;
+			packet.d[i] = r.d;
+			packet.t_start[i] = 0;
+			packet.cone_spread[i] = r.cone_spread;
+		}
+
+		std::pair<const SceneObject *, real> hits[packet_size];
+		scene.nearestIntersectionPacket(packet, hits);
+		for (int i = 0; i < packet.num_rays; ++i)
+			num_hits += (hits[i].first != nullptr);
+	}
+	return num_hits;
+}
+
+SceneResult benchScene(const BenchScene & bench_scene, const int xres, const int yres, const int passes, const std::vector<int> & thread_counts)
+{
+	SceneResult result;
+	result.name = bench_scene.name;
+	printf("  %s\n", bench_scene.name.c_str());
+
+	Scene scene;
+	addGround(scene);
+	scene.objects.push_back(bench_scene.fractal->clone());
+	scene.buildBVH();
+
+	// Camera rays on one thread, first without and then with counting
+	HaltonSampler halton;
+	SampleTable samples;
+	samples.build(halton, 0, 1);
+	int64_t num_hits = 0;
+	result.primary_rays_per_sec = evalsPerSecond(xres * yres, [&]() { num_hits = tracePrimaryRays(scene, xres, yres, samples.getPass(0)); return (real)num_hits; });
+	result.primary_hit_fraction = num_hits / (double)(xres * yres);
+
+	int64_t num_evals = 0;
+	Scene counting_scene;
+	addGround(counting_scene);
+	counting_scene.objects.push_back(new CountingDE(*bench_scene.fractal, &num_evals));
+	counting_scene.buildBVH();
+	tracePrimaryRays(counting_scene, xres, yres, samples.getPass(0));
+	result.steps_per_primary_ray = num_evals / (double)(xres * yres);
+
+	printf("    camera rays: %.3f M/s, %.1f steps per ray, %.1f%% hit\n",
+		result.primary_rays_per_sec * 1e-6, result.steps_per_primary_ray, result.primary_hit_fraction * 100);
+
+	// Whole renders in each mode, scaling over the thread counts
+	for (const bool use_wavefront : { false, true })
+	for (const int num_threads : thread_counts)
+	{
+		RenderThreadPool thread_pool(num_threads, scene);
+		thread_pool.use_wavefront = use_wavefront;
+		RenderOutput output(xres, yres);
+		output.clear();
+
+		const auto t1 = std::chrono::steady_clock::now();
+		thread_pool.renderPasses(output, 0, 0, passes, 0);
+		const auto t2 = std::chrono::steady_clock::now();
+
+		RenderResult r;
+		r.mode = use_wavefront ? "wavefront" : "packet";
+		r.threads = num_threads;
+		r.seconds = seconds(t1, t2);
+		r.samples_per_sec = (double)xres * yres * passes / r.seconds;
+		result.renders.push_back(r);
+
+		const double speedup = r.samples_per_sec / result.renders[use_wavefront ? thread_counts.size() : 0].samples_per_sec;
+		printf("    %-9s %3d threads: %7.3f s, %.3f M samples/s, %.2fx\n", r.mode.c_str(), num_threads, r.seconds, r.samples_per_sec * 1e-6, speedup);
+	}
+
+	return result;
+}
+
+
+bool writeJSON(const char * filename, const int xres, const int yres, const int passes,
+	const std::vector<IterationResult> & iterations, const std::vector<DEVariantResult> & de_variants, const std::vector<SceneResult> & scenes)
+{
+	FILE * const f = (strcmp(filename, "-") == 0) ? stdout : fopen(filename, "w");
+	if (f == nullptr)
+		return false;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+	fprintf(f, "  \"use_double\": %s,\n", USE_DOUBLE ? "true" : "false");
+	fprintf(f, "  \"iterations\": [\n");
+	for (size_t i = 0; i < iterations.size(); ++i)
+		fprintf(f, "    { \"name\": \"%s\", \"evals_per_sec\": %.6g, \"directional_evals_per_sec\": %.6g, \"batch_evals_per_sec\": %.6g }%s\n",
+			iterations[i].name.c_str(), iterations[i].dual3_evals_per_sec, iterations[i].dual1_evals_per_sec, iterations[i].batch_evals_per_sec,
+			(i + 1 < iterations.size()) ? "," : "");
+	fprintf(f, "  ],\n");
+	fprintf(f, "  \"de_variants\": [\n");
+	for (size_t i = 0; i < de_variants.size(); ++i)
+		fprintf(f, "    { \"name\": \"%s\", \"evals_per_sec\": %.6g }%s\n",
+			de_variants[i].name.c_str(), de_variants[i].evals_per_sec, (i + 1 < de_variants.size()) ? "," : "");
+	fprintf(f, "  ],\n");
+	fprintf(f, "  \"scenes\": [\n");
+	for (size_t i = 0; i < scenes.size(); ++i)
+	{
+		const SceneResult & s = scenes[i];
+		fprintf(f, "    {\n");
+		fprintf(f, "      \"name\": \"%s\", \"xres\": %d, \"yres\": %d, \"passes\": %d,\n", s.name.c_str(), xres, yres, passes);
+		fprintf(f, "      \"primary_rays_per_sec\": %.6g, \"steps_per_primary_ray\": %.6g, \"primary_hit_fraction\": %.6g,\n",
+			s.primary_rays_per_sec, s.steps_per_primary_ray, s.primary_hit_fraction);
+		fprintf(f, "      \"renders\": [\n");
+		for (size_t j = 0; j < s.renders.size(); ++j)
+		{
+			const RenderResult & r = s.renders[j];
+			fprintf(f, "        { \"mode\": \"%s\", \"threads\": %d, \"seconds\": %.6g, \"samples_per_sec\": %.6g }%s\n",
+				r.mode.c_str(), r.threads, r.seconds, r.samples_per_sec, (j + 1 < s.renders.size()) ? "," : "");
+		}
+		fprintf(f, "      ]\n");
+		fprintf(f, "    }%s\n", (i + 1 < scenes.size()) ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+
+	if (f != stdout)
+		fclose(f);
+	return true;
+}
+
+
+int main(int argc, char ** argv)
+{
+	bool quick = false; // Smaller and shorter runs, e.g. for CI
+	std::string json_filename;
+	int max_threads = (int)std::thread::hardware_concurrency();
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--quick")
+			quick = true;
+		else if (arg == "--json" && i + 1 < argc)
+			json_filename = argv[++i];
+		else if (arg == "--max-threads" && i + 1 < argc)
+			max_threads = atoi(argv[++i]);
+	}
+	max_threads = std::max(1, max_threads);
+
+	if (quick)
+		min_time = 0.05;
+	const int num_points = 4096;
+	const int xres   = quick ? 64 : 160;
+	const int yres   = xres * 9 / 16;
+	const int passes = quick ? 2 : 8;
+
+	// Powers of two up to the maximum, and the maximum itself
+	std::vector<int> thread_counts;
+	for (int n = 1; n < max_threads; n *= 2)
+		thread_counts.push_back(n);
+	thread_counts.push_back(max_threads);
+
+	const std::vector<vec3r> points = makeBenchPoints(num_points, 1.5f);
+
+	printf("Iterations:\n");
+	std::vector<IterationResult> iterations;
+	iterations.push_back(benchIteration("Mandelbulb",        DualMandelbulbIteration(),        points));
+	iterations.push_back(benchIteration("TriplexMandelbulb", DualTriplexMandelbulbIteration(), points));
+	iterations.push_back(benchIteration("MengerSponge",      DualMengerSpongeIteration(),      points));
+	iterations.push_back(benchIteration("MengerSpongeC",     DualMengerSpongeCIteration(),     points));
+	iterations.push_back(benchIteration("Cubicbulb",         DualCubicbulbIteration(),         points));
+	iterations.push_back(benchIteration("Amazingbox",        DualAmazingboxIteration(),        points));
+	iterations.push_back(benchIteration("Octopus",           DualOctopusIteration(),           points));
+	iterations.push_back(benchIteration("PseudoKleinian",    DualPseudoKleinianIteration(),    points));
+	iterations.push_back(benchIteration("MandalayKIFS",      DualMandalayKIFSIteration(),      points));
+	iterations.push_back(benchIteration("BenesiPine2",       DualBenesiPine2Iteration(),       points));
+	iterations.push_back(benchIteration("RiemannSphere",     DualRiemannSphereIteration(),     points));
+	iterations.push_back(benchIteration("SphereTree",        DualSphereTreeIteration(),        points));
+
+	printf("DE variants:\n");
+	const std::vector<DEVariantResult> de_variants = benchDEVariants(points);
+
+	printf("Scenes at %d x %d with %d passes:\n", xres, yres, passes);
+	std::vector<SceneResult> scenes;
+	for (const BenchScene & s : makeBenchScenes())
+		scenes.push_back(benchScene(s, xres, yres, passes, thread_counts));
+
+	if (!json_filename.empty() && !writeJSON(json_filename.c_str(), xres, yres, passes, iterations, de_variants, scenes))
+	{
+		printf("Failed to write %s\n", json_filename.c_str());
+		return 1;
+	}
+
+	return 0;
+}
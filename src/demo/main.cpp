@@ -8,12 +8,13 @@
 #include <chrono> // For timing
 #include <vector>
 #include <string>
+#include <map>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <algorithm> // For std::pair and std::min and max
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "../util/stb_image_write.h"
-
 #if _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
@@ -25,8 +26,14 @@
 #include "renderer/Ray.h"
 #include "renderer/Scene.h"
 #include "renderer/Renderer.h"
+#include "renderer/FrameEncoder.h"
+#include "renderer/Reproject.h"
+#include "renderer/SceneFile.h"
+
+#include "util/PngStreamWriter.h"
 
 #include "scene_objects/SimpleObjects.h"
+#include "scene_objects/StaticHybridDE.h"
 
 #include "formulas/Mandelbulb.h"
 #include "formulas/QuadraticJuliabulb.h"
@@ -41,46 +48,11 @@
 #include "formulas/RiemannSphere.h"
 #include "formulas/SphereTree.h"
 
+// The renderer headers only include the stb declarations, so the implementation has to come after them
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../util/stb_image_write.h"
 
 
-struct sRGBPixel
-{
-	uint8_t r;
-	uint8_t g;
-	uint8_t b;
-};
-
-
-void renderPasses(std::vector<std::thread> & threads, RenderOutput & output, int frame, int base_pass, int num_passes, int frames, Scene & scene) noexcept
-{
-	ThreadControl thread_control = { num_passes };
-
-	for (std::thread & t : threads) t = std::thread(renderThreadFunction, &thread_control, &output, frame, base_pass, frames, &scene);
-	for (std::thread & t : threads) t.join();
-}
-
-
-void tonemap(std::vector<sRGBPixel> & image_LDR, const std::vector<vec3f> & image_HDR, const int passes, const int xres, const int yres) noexcept
-{
-	const auto sRGB = [](float u) -> float { return (u <= 0.0031308f) ? 12.92f * u : 1.055f * std::pow(u, 0.416667f) - 0.055f; };
-	const float scale = 1.0f / passes;
-
-	#pragma omp parallel for
-	for (int y = 0; y < yres; y++)
-	for (int x = 0; x < xres; x++)
-	{
-		const int pixel_idx = y * xres + x;
-		const vec3f pixel_colour = image_HDR[pixel_idx];
-
-		image_LDR[pixel_idx] =
-		{
-			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.x() * scale) * 256)),
-			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.y() * scale) * 256)),
-			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.z() * scale) * 256))
-		};
-	}
-}
-
 
 int main(int argc, char ** argv)
 {
@@ -95,14 +67,99 @@ int main(int argc, char ** argv)
 	const bool print_timing = true;
 
 	// Parse command line arguments
-	enum { mode_progressive, mode_animation } mode = mode_progressive;
-	if (argc > 1)
+	enum { mode_progressive, mode_animation, mode_merge, mode_preview, mode_batch, mode_strips } mode = mode_progressive;
+	const int image_multi  = 80;
+	int image_width  = image_multi * 16;
+	int image_height = image_multi * 9;
+	bool use_wavefront = false;
+	bool use_adaptive = false;
+	bool use_cone_prepass = false;
+	real lod_footprint = 0; // Camera ray footprint radius in pixels for the level of detail hit threshold, 0 for exact hits
+	bool save_exr = false;
+	bool save_steps_heatmap = false;
+	std::string checkpoint_filename; // Progressive mode saves its state here after each doubling or chunk of passes
+	std::string resume_filename;
+	std::string de_cache_filename; // Precompute distance bounds for the fractal to skip empty space, reusing the file if it's valid
+	std::string scene_filename; // Load the scene from this file instead of using the built-in one, see SceneLoader
+	std::string batch_filename; // Render the scene files listed in this file one after the other
+	SceneLoader scene_loader;
+	scene_loader.num_threads = num_threads;
+	int range_first = 0, range_count = -1; // Only render this range of passes, or frames or strips in those modes, e.g. on one node of a farm
+	int strip_height = 0, strip_passes = 0; // Strip mode renders a band of this many rows at a time with all passes
+	std::vector<std::string> merge_filenames;
+	for (int i = 1; i < argc; ++i)
 	{
-		if (std::string(argv[1]) == "--animation")
+		const std::string arg = argv[i];
+		if (arg == "--animation")
 			mode = mode_animation;
+		else if (arg == "--preview")
+			mode = mode_preview;
+		else if (arg == "--wavefront")
+			use_wavefront = true;
+		else if (arg == "--adaptive")
+			use_adaptive = true;
+		else if (arg == "--cone-prepass")
+			use_cone_prepass = true;
+		else if (arg == "--lod" && i + 1 < argc)
+			lod_footprint = std::max(0.0, atof(argv[++i]));
+		else if (arg == "--exr")
+			save_exr = true;
+		else if (arg == "--steps-heatmap")
+			save_steps_heatmap = true;
+		else if (arg == "--checkpoint" && i + 1 < argc)
+			checkpoint_filename = argv[++i];
+		else if (arg == "--resume" && i + 1 < argc)
+			resume_filename = argv[++i];
+		else if (arg == "--de-cache" && i + 1 < argc)
+			de_cache_filename = argv[++i];
+		else if (arg == "--scene" && i + 1 < argc)
+			scene_filename = argv[++i];
+		else if (arg == "--set" && i + 2 < argc)
+		{
+			const std::string name = argv[++i];
+			scene_loader.variables[name] = argv[++i];
+		}
+		else if (arg == "--batch" && i + 1 < argc)
+		{
+			mode = mode_batch;
+			batch_filename = argv[++i];
+		}
+		else if (arg == "--resolution" && i + 2 < argc)
+		{
+			image_width  = std::max(1, atoi(argv[++i]));
+			image_height = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--strips" && i + 2 < argc)
+		{
+			// Whole buckets, so that the cost estimates of one strip fit the next
+			mode = mode_strips;
+			strip_height = std::max(1, (atoi(argv[++i]) + bucket_size - 1) / bucket_size) * bucket_size;
+			strip_passes = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--render-range" && i + 2 < argc)
+		{
+			range_first = std::max(0, atoi(argv[++i]));
+			range_count = std::max(0, atoi(argv[++i]));
+		}
+		else if (arg == "--merge")
+		{
+			// Sum the partial renders in all remaining arguments
+			mode = mode_merge;
+			while (i + 1 < argc)
+				merge_filenames.push_back(argv[++i]);
+		}
 	}
 
 	Scene scene;
+	if (!scene_filename.empty())
+	{
+		if (!scene_loader.load(scene_filename.c_str(), scene))
+		{
+			printf("Couldn't load %s: %s\n", scene_filename.c_str(), scene_loader.error.c_str());
+			return 1;
+		}
+	}
+	else
 	{
 		const real main_sphere_rad = 1.5f;
 
@@ -142,6 +199,11 @@ int main(int argc, char ** argv)
 		DualMandalayKIFSIteration dki;
 		DualSphereTreeIteration sti;
 
+		const int max_iters = 64;
+#if 1
+		// Compile-time hybrid with the sequence unrolled and the formulas inlined, use GeneralDualDE below to experiment
+		StaticHybridDE<HybridSequence<0, 1>, DualMandelbulbIteration, DualMengerSpongeCIteration> hybrid(max_iters, mbi, msi);
+#else
 		std::vector<IterationFunction *> iter_funcs;
 		//iter_funcs.push_back(oi.clone());
 		//iter_funcs.push_back(pki.clone());
@@ -157,14 +219,26 @@ int main(int argc, char ** argv)
 
 		const std::vector<char> iter_seq = { 0, 1 };
 
-		const int max_iters = 64;
 		GeneralDualDE hybrid(max_iters, iter_funcs, iter_seq);
+#endif
 
 		hybrid.radius = main_sphere_rad; // For Mandelbulb p8, bounding sphere has approximate radius of 1.2 or so
 		hybrid.step_scale = 0.25; //1;
+		//hybrid.directional_march = true; // Cheaper marching with derivatives along the ray only
+		//hybrid.over_relaxation = 1.2f; // Longer steps while the unbounding spheres overlap, ~15% faster here
+		//hybrid.adaptive_precision = true; // March in float until close to the surface
 		hybrid.mat.albedo = { 0.1f, 0.3f, 0.7f };
 		hybrid.mat.use_fresnel = true;
 
+		if (!de_cache_filename.empty())
+		{
+			const auto t1 = std::chrono::steady_clock::now();
+			hybrid.buildDECache(num_threads, de_cache_filename.c_str());
+			const auto t2 = std::chrono::steady_clock::now();
+			printf("DE cache with %d bricks took %.2f seconds\n", (int)(hybrid.de_cache->brick_values.size() / DECache::brick_cells),
+				std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count());
+		}
+
 		scene.objects.push_back(hybrid.clone());
 #endif
 		// Test adding sphere lights
@@ -193,30 +267,36 @@ int main(int argc, char ** argv)
 			sp.mat.emission = 4;
 			scene.objects.push_back(sp.clone());
 		}
+
+		scene.buildBVH(num_threads);
 	}
 
-	const int image_multi  = 80;
-	const int image_width  = image_multi * 16;
-	const int image_height = image_multi * 9;
 	const bool save_normal = false;
 	const bool save_albedo = false;
 
-	std::vector<sRGBPixel> image_LDR(image_width * image_height);
-	RenderOutput output(image_width, image_height);
-
-	std::vector<std::thread> threads(num_threads);
-
-	const auto save_tonemapped_buffer = [&](const char * channel_name, const int frame, const int passes, const std::vector<vec3f> & buffer)
-	{
-		// Tonemap and convert to LDR sRGB
-		tonemap(image_LDR, buffer, passes, image_width, image_height);
+	RenderThreadPool thread_pool(num_threads, scene);
+	thread_pool.use_wavefront = use_wavefront;
+	thread_pool.use_cone_prepass = use_cone_prepass;
+	thread_pool.lod_footprint = lod_footprint;
+
+	// Frames are tonemapped and saved in the background while the next one renders
+	FrameEncoder encoder(image_width, image_height);
+	encoder.save_normal = save_normal;
+	encoder.save_albedo = save_albedo;
+	encoder.save_exr = save_exr;
+	encoder.save_steps_heatmap = save_steps_heatmap;
+#if !ENABLE_RENDER_STATS
+	if (save_steps_heatmap)
+		printf("The steps heatmap needs a build with ENABLE_RENDER_STATS\n");
+#endif
 
-		// Save frame
-		char filename[128];
-		snprintf(filename, 128, "%s_frame_%08d.png", channel_name, frame);
-		stbi_write_png(filename, image_width, image_height, 3, &image_LDR[0], image_width * 3);
-		printf("Saved %s with %d passes\n", filename, passes);
-	};
+	// Resuming keeps checkpointing to the same file unless told otherwise
+	if (checkpoint_filename.empty())
+		checkpoint_filename = resume_filename;
+	const uint64_t fingerprint = scene.fingerprint() ^ (use_adaptive ? 0x9E3779B97F4A7C15ull : 0) ^ (!de_cache_filename.empty() ? 0xC2B2AE3D27D4EB4Full : 0) ^
+		(use_cone_prepass ? 0x165667B19E3779F9ull : 0) ^ (uint64_t)(lod_footprint * 1000) * 0x27D4EB2F165667C5ull;
+	encoder.checkpoint_filename = checkpoint_filename;
+	encoder.checkpoint_fingerprint = fingerprint;
 
 	switch (mode)
 	{
@@ -224,26 +304,30 @@ int main(int argc, char ** argv)
 		{
 			const int frames = 30 * 4;
 			const int passes = 2 * 3 * 5 * 7;
-			printf("Rendering %d frames at resolution %d x %d with %d passes\n", frames, image_width, image_height, passes);
+			const int frame_begin = std::min(range_first, frames);
+			const int frame_end = (range_count < 0) ? frames : std::min(range_first + range_count, frames);
+			printf("Rendering frames %d to %d of %d at resolution %d x %d with %d passes\n", frame_begin, frame_end, frames, image_width, image_height, passes);
 
-			for (int frame = 0; frame < frames; ++frame)
+			for (int frame = frame_begin; frame < frame_end; ++frame)
 			{
+				RenderOutput & output = encoder.acquire();
 				output.clear();
 
 				const auto t1 = std::chrono::steady_clock::now();
 
-				renderPasses(threads, output, frame, 0, passes, frames, scene);
+				thread_pool.renderPasses(output, frame, 0, passes, frames);
 
 				if (print_timing)
 				{
 					const auto t2 = std::chrono::steady_clock::now();
 					const auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-					printf("Frame took %.2f seconds to render.\n", time_span.count());
+					printf("Frame took %.2f seconds to render (tail latency %.3f seconds).\n", time_span.count(), thread_pool.tailLatency());
+#if ENABLE_RENDER_STATS
+					thread_pool.stats.print();
+#endif
 				}
 
-				save_tonemapped_buffer("beauty", frame, passes, output.beauty);
-				if (save_normal) save_tonemapped_buffer("normal", frame, passes, output.normal);
-				if (save_albedo) save_tonemapped_buffer("albedo", frame, passes, output.albedo);
+				encoder.submit(output, frame, passes);
 			}
 
 			break;
@@ -252,34 +336,431 @@ int main(int argc, char ** argv)
 		case mode_progressive:
 		{
 			const int max_passes = 2 * 3 * 5 * 7 * 11; // Set a reasonable max number of passes instead of going forever
+			const int max_chunk_passes = 128; // Longer doublings are split into chunks of this many passes, with a checkpoint after each
 			printf("Progressive rendering at resolution %d x %d with doubling passes to max %d\n", image_width, image_height, max_passes);
+			RenderOutput output(image_width, image_height);
 			output.clear();
 
+			// Render one range of passes in a single go and save the raw buffers, to be summed with the other ranges using --merge.
+			// Every sample is indexed by its pass, so the ranges can be rendered in separate processes on different machines.
+			if (range_count >= 0)
+			{
+				const int first_pass = range_first;
+				const int end_pass = range_first + range_count;
+				const std::string filename = !checkpoint_filename.empty() ? checkpoint_filename :
+					"passes_" + std::to_string(first_pass) + "_" + std::to_string(end_pass) + ".ftck";
+				printf("Rendering passes %d to %d into %s\n", first_pass, end_pass, filename.c_str());
+				if (use_adaptive)
+					printf("Adaptive sampling needs all passes and is disabled for pass ranges\n");
+
+				const auto t1 = std::chrono::steady_clock::now();
+
+				thread_pool.renderPasses(output, 0, first_pass, range_count, 0);
+
+				if (print_timing)
+				{
+					const auto t2 = std::chrono::steady_clock::now();
+					const auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+					printf("%d passes took %.2f seconds (tail latency %.3f seconds).\n", range_count, time_span.count(), thread_pool.tailLatency());
+#if ENABLE_RENDER_STATS
+					thread_pool.stats.print();
+#endif
+				}
+
+				if (!Checkpoint::save(filename.c_str(), output, first_pass, end_pass, fingerprint))
+					printf("Failed to save %s\n", filename.c_str());
+				break;
+			}
+
+			// With adaptive sampling, each chunk of passes only goes to the buckets that haven't converged yet
+			AdaptiveSampler adaptive(image_width, image_height);
+
 			int pass = 0;
 			int target_passes = 1;
-			while (pass < max_passes)
+			int first_pass = 0;
+
+			// Continue the same sequence of pass ranges from a checkpoint, which gives a bit-identical result to an uninterrupted render
+			if (!resume_filename.empty())
+			{
+				if (Checkpoint::load(resume_filename.c_str(), output, first_pass, pass, fingerprint) && first_pass == 0)
+				{
+					printf("Resuming from %s at %d passes\n", resume_filename.c_str(), pass);
+					while (target_passes <= pass)
+						target_passes <<= 1;
+					target_passes = std::min(target_passes, max_passes);
+					if (use_adaptive)
+						adaptive.update(output);
+				}
+				else
+				{
+					printf("Couldn't resume from %s, starting from scratch\n", resume_filename.c_str());
+					output.clear();
+					pass = 0;
+				}
+			}
+			while (pass < max_passes && !adaptive.converged())
 			{
 				const auto t1 = std::chrono::steady_clock::now();
 
 				// Note that we force num_frames to be zero since we usually don't want motion blur for stills
-				const int num_passes = target_passes - pass;
-				renderPasses(threads, output, 0, pass, num_passes, 0, scene);
+				const int num_passes = std::min(target_passes - pass, max_chunk_passes);
+				thread_pool.renderPasses(output, 0, pass, num_passes, 0, use_adaptive ? &adaptive.active_buckets : nullptr);
+
+				if (print_timing)
+				{
+					const auto t2 = std::chrono::steady_clock::now();
+					const auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+					printf("%d passes took %.2f seconds (%.2f seconds per pass, tail latency %.3f seconds).\n", num_passes, time_span.count(), time_span.count() / num_passes, thread_pool.tailLatency());
+#if ENABLE_RENDER_STATS
+					thread_pool.stats.print();
+#endif
+				}
+
+				if (use_adaptive)
+				{
+					adaptive.update(output);
+					printf("%d buckets still need more passes\n", (int)adaptive.active_buckets.size());
+				}
+
+				// Keep accumulating into the same buffer and save a copy of it at each doubling and checkpoint
+				pass += num_passes;
+				const bool doubled = (pass == target_passes);
+				if (doubled || !checkpoint_filename.empty())
+				{
+					RenderOutput & snapshot = encoder.acquire();
+					snapshot.copyFrom(output);
+					encoder.submit(snapshot, 0, pass, !checkpoint_filename.empty());
+				}
+
+				if (doubled)
+					target_passes = std::min(target_passes << 1, max_passes);
+			}
+
+			break;
+		}
+
+		case mode_preview:
+		{
+			// Interactive preview along the animation's camera orbit, controlled from stdin and shown in preview.png:
+			// a and d move a step, A and D move an eighth of a turn, q quits.
+			// Each view starts with coarse single pass images for a fast first look, then refines at full preview resolution.
+			// Small moves instead start from the last image warped to the new camera, which fills in most of the view right away.
+			const int preview_width  = std::max(1, image_width / 2);
+			const int preview_height = std::max(1, image_height / 2);
+			const int preview_steps = 120 * 8; // Camera positions around the orbit
+			const int max_preview_passes = 64;
+			const int max_reproject_steps = 4; // Further moves disocclude too much to be worth warping
+			const int max_reprojected_passes = 4; // Weight of the warped image, so that new passes replace it quickly
+			const char * const preview_filename = "preview.png";
+
+			// Cheap paths and footprint sized hits, both of which are hardly visible at this resolution
+			thread_pool.max_bounces = 1;
+			thread_pool.lod_footprint = std::max(lod_footprint, (real)1);
+
+			std::mutex input_mutex;
+			std::condition_variable input_cv;
+			std::atomic<bool> restart(false); // Cancels the current render when the view changes
+			int target_step = 0;
+			bool quit = false, input_closed = false;
+			std::thread input_thread([&]()
+			{
+				int c;
+				while ((c = getchar()) != EOF)
+				{
+					const int step =
+						(c == 'a') ? -1 : (c == 'd') ? 1 :
+						(c == 'A') ? -preview_steps / 8 : (c == 'D') ? preview_steps / 8 : 0;
+					if (step == 0 && c != 'q')
+						continue;
+
+					{
+						// Under the lock, so that the main thread can't miss it between checking and waiting
+						std::lock_guard<std::mutex> lock(input_mutex);
+						target_step += step;
+						quit = (c == 'q');
+						restart = true;
+					}
+					input_cv.notify_one();
+					if (c == 'q')
+						return;
+				}
+
+				std::lock_guard<std::mutex> lock(input_mutex);
+				input_closed = true;
+				input_cv.notify_one();
+			});
+
+			// Tonemap at the output's resolution and scale it up to the preview size with nearest neighbour filtering
+			std::vector<sRGBPixel> image_LDR(preview_width * preview_height), preview_LDR(preview_width * preview_height);
+			const auto savePreview = [&](const RenderOutput & output)
+			{
+				tonemap(image_LDR, output.beauty, output.pixel_passes, output.xres, output.yres);
+				for (int y = 0; y < preview_height; ++y)
+				for (int x = 0; x < preview_width; ++x)
+					preview_LDR[y * preview_width + x] = image_LDR[(y * output.yres / preview_height) * output.xres + x * output.xres / preview_width];
+				stbi_write_png(preview_filename, preview_width, preview_height, 3, &preview_LDR[0], preview_width * 3);
+			};
+
+			// At least a pixel each way even for tiny previews
+			RenderOutput coarse_outputs[3] =
+			{
+				{ std::max(1, preview_width / 8), std::max(1, preview_height / 8) },
+				{ std::max(1, preview_width / 4), std::max(1, preview_height / 4) },
+				{ std::max(1, preview_width / 2), std::max(1, preview_height / 2) }
+			};
+			RenderOutput output(preview_width, preview_height);
+			RenderOutput prev_output(preview_width, preview_height); // Last full resolution image, for warping
+			Camera prev_cam = {};
+			int prev_step = 0;
+			bool have_prev = false, refined = false;
+			printf("Preview at resolution %d x %d in %s, keys: a/d step, A/D turn, q quit\n", preview_width, preview_height, preview_filename);
+
+			while (true)
+			{
+				int step;
+				{
+					// Wait for the view to change once it's fully refined, quitting if it can't change anymore
+					std::unique_lock<std::mutex> lock(input_mutex);
+					input_cv.wait(lock, [&]() { return !refined || quit || restart || input_closed; });
+					if (quit || (refined && !restart && input_closed))
+						break;
+					restart = false;
+					step = target_step;
+				}
+
+				const int frame = ((step % preview_steps) + preview_steps) % preview_steps;
+				const Camera cam = getCamera(scene.camera, two_pi * frame / preview_steps, preview_width, preview_height);
+				const auto t1 = std::chrono::steady_clock::now();
+				const auto printTime = [&](const char * what)
+				{
+					const auto t2 = std::chrono::steady_clock::now();
+					printf("Step %d: %s after %.3f seconds\n", step, what, std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count());
+				};
+
+				bool cancelled = false;
+				output.clear();
+				if (have_prev && step != prev_step && std::abs(step - prev_step) <= max_reproject_steps)
+				{
+					reproject(prev_output, prev_cam, cam, max_reprojected_passes, output);
+					savePreview(output);
+					printTime("reprojected image");
+				}
+				else
+				{
+					for (int level = 0; level < 3 && !cancelled; ++level)
+					{
+						RenderOutput & coarse = coarse_outputs[level];
+						coarse.clear();
+						cancelled = !thread_pool.renderPasses(coarse, frame, 0, 1, preview_steps, nullptr, &restart);
+						if (!cancelled)
+						{
+							savePreview(coarse);
+							if (level == 0)
+								printTime("coarse image");
+						}
+					}
+				}
+
+				// Keep accumulating into the same buffer with doubling passes until the view changes
+				int pass = 0;
+				for (int target_passes = 1; pass < max_preview_passes && !cancelled; target_passes = std::min(target_passes << 1, max_preview_passes))
+				{
+					cancelled = !thread_pool.renderPasses(output, frame, pass, target_passes - pass, preview_steps, nullptr, &restart);
+					if (cancelled)
+						break;
+					pass = target_passes;
+					savePreview(output);
+
+					prev_output.copyFrom(output);
+					prev_cam = cam;
+					prev_step = step;
+					have_prev = true;
+				}
+
+				refined = !cancelled;
+				if (refined)
+					printTime("refined image");
+			}
+
+			input_thread.join();
+			break;
+		}
+
+		case mode_batch:
+		{
+			// Each line of the batch file is a scene file followed by any number of variable=value, with commas between the words
+			// of a value, e.g. "sponge.scene scale=2.8 centre=1,1,0.5". The thread pool and DE caches are reused for all of them,
+			// and job i is saved as frame i.
+			FILE * const f = fopen(batch_filename.c_str(), "rb");
+			if (f == nullptr)
+			{
+				printf("Couldn't open %s\n", batch_filename.c_str());
+				break;
+			}
+
+			std::vector<std::string> jobs(1);
+			for (int c = fgetc(f); c != EOF; c = fgetc(f))
+			{
+				if (c == '\n')
+					jobs.emplace_back();
+				else if (c != '\r')
+					jobs.back() += (char)c;
+			}
+			fclose(f);
+
+			const int passes = 2 * 3 * 5 * 7;
+			const std::map<std::string, std::string> base_variables = scene_loader.variables;
+			int job_idx = 0;
+			for (const std::string & job : jobs)
+			{
+				std::vector<std::string> words;
+				size_t start = job.find_first_not_of(" \t");
+				while (start != std::string::npos && job[start] != '#')
+				{
+					const size_t end = job.find_first_of(" \t", start);
+					words.push_back(job.substr(start, end - start));
+					start = job.find_first_not_of(" \t", end);
+				}
+				if (words.empty())
+					continue;
+
+				scene_loader.variables = base_variables;
+				for (size_t w = 1; w < words.size(); ++w)
+				{
+					const size_t eq = words[w].find('=');
+					if (eq == std::string::npos)
+						continue;
+					std::string value = words[w].substr(eq + 1);
+					std::replace(value.begin(), value.end(), ',', ' ');
+					scene_loader.variables[words[w].substr(0, eq)] = value;
+				}
+
+				Scene job_scene;
+				if (!scene_loader.load(words[0].c_str(), job_scene))
+				{
+					printf("Couldn't load %s: %s\n", words[0].c_str(), scene_loader.error.c_str());
+					continue;
+				}
+				printf("Rendering %s as frame %d with %d passes\n", job.c_str(), job_idx, passes);
+
+				RenderOutput & output = encoder.acquire();
+				output.clear();
+
+				const auto t1 = std::chrono::steady_clock::now();
+
+				thread_pool.setScene(job_scene);
+				thread_pool.renderPasses(output, 0, 0, passes, 0);
 
 				if (print_timing)
 				{
 					const auto t2 = std::chrono::steady_clock::now();
 					const auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-					printf("%d passes took %.2f seconds (%.2f seconds per pass).\n", num_passes, time_span.count(), time_span.count() / num_passes);
+					printf("Job took %.2f seconds to render (tail latency %.3f seconds).\n", time_span.count(), thread_pool.tailLatency());
 				}
 
-				save_tonemapped_buffer("beauty", 0, target_passes, output.beauty);
-				if (save_normal) save_tonemapped_buffer("normal", 0, target_passes, output.normal);
-				if (save_albedo) save_tonemapped_buffer("albedo", 0, target_passes, output.albedo);
+				encoder.submit(output, job_idx++, passes);
+			}
+
+			thread_pool.setScene(scene);
+			break;
+		}
+
+		case mode_strips:
+		{
+			// Render a large still a band of rows at a time with all passes, and stream each band into the PNG once it's done,
+			// so memory only scales with the strip size. On a farm each node can render a range of strips, and their PNGs
+			// stack up into the whole image.
+			const int num_strips = (image_height + strip_height - 1) / strip_height;
+			const int strip_begin = std::min(range_first, num_strips);
+			const int strip_end = (range_count < 0) ? num_strips : std::min(range_first + range_count, num_strips);
+			if (strip_begin >= strip_end)
+			{
+				printf("No strips to render, the image has %d\n", num_strips);
+				break;
+			}
+
+			const int y_begin = strip_begin * strip_height;
+			const int y_end = std::min(strip_end * strip_height, image_height);
+			char filename[128];
+			snprintf(filename, 128, "beauty_strips_%04d_%04d.png", strip_begin, strip_end);
+			printf("Rendering strips %d to %d of %d (rows %d to %d) at resolution %d x %d with %d passes into %s\n",
+				strip_begin, strip_end, num_strips, y_begin, y_end, image_width, image_height, strip_passes, filename);
+
+			PngStreamWriter png;
+			if (!png.open(filename, image_width, y_end - y_begin))
+			{
+				printf("Couldn't create %s\n", filename);
+				break;
+			}
+
+			std::vector<sRGBPixel> strip_LDR;
+			for (int strip = strip_begin; strip < strip_end; ++strip)
+			{
+				const int y0 = strip * strip_height;
+				const int rows = std::min(strip_height, image_height - y0);
+				const auto t1 = std::chrono::steady_clock::now();
 
-				pass = target_passes;
-				target_passes = std::min(target_passes << 1, max_passes);
+				// The buffers only cover the strip, the pixels keep their place in the whole image for the camera and samples
+				RenderOutput output(image_width, rows, image_width, image_height, 0, y0);
+				output.clear();
+				thread_pool.renderPasses(output, 0, 0, strip_passes, 0);
+
+				if (print_timing)
+				{
+					const auto t2 = std::chrono::steady_clock::now();
+					const auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+					printf("Strip %d took %.2f seconds to render (tail latency %.3f seconds).\n", strip, time_span.count(), thread_pool.tailLatency());
+#if ENABLE_RENDER_STATS
+					thread_pool.stats.print();
+#endif
+				}
+
+				strip_LDR.resize(image_width * rows);
+				tonemap(strip_LDR, output.beauty, output.pixel_passes, image_width, rows);
+				png.writeRows((const uint8_t *)&strip_LDR[0], rows);
+			}
+
+			if (png.close())
+				printf("Saved %s\n", filename);
+			else
+				printf("Failed to save %s\n", filename);
+			break;
+		}
+
+		case mode_merge:
+		{
+			RenderOutput & output = encoder.acquire();
+			output.clear();
+
+			// Sum all the partial outputs, which only makes sense if they cover disjoint pass ranges of the same scene
+			RenderOutput part(image_width, image_height);
+			std::vector<std::pair<int, int>> ranges;
+			for (const std::string & filename : merge_filenames)
+			{
+				int first_pass, end_pass;
+				if (!Checkpoint::load(filename.c_str(), part, first_pass, end_pass, fingerprint))
+				{
+					printf("Couldn't load %s or it's from a different scene, skipping\n", filename.c_str());
+					continue;
+				}
+
+				output.accumulate(part);
+				ranges.push_back({ first_pass, end_pass });
+				printf("Merged %s with passes %d to %d\n", filename.c_str(), first_pass, end_pass);
+			}
+
+			std::sort(ranges.begin(), ranges.end());
+			int total_passes = 0;
+			for (size_t i = 0; i < ranges.size(); ++i)
+			{
+				total_passes += ranges[i].second - ranges[i].first;
+				if (i > 0 && ranges[i].first < ranges[i - 1].second)
+					printf("Warning: pass ranges %d to %d and %d to %d overlap\n", ranges[i - 1].first, ranges[i - 1].second, ranges[i].first, ranges[i].second);
+				else if (i > 0 && ranges[i].first > ranges[i - 1].second)
+					printf("Note: passes %d to %d are missing\n", ranges[i - 1].second, ranges[i].first);
 			}
 
+			encoder.submit(output, 0, total_passes);
 			break;
 		}
 	}
@@ -6,51 +6,112 @@
 
 // Amazingbox (aka Mandelbox) formula by Tglad
 // Ref: http://www.fractalforums.com/amazing-box-amazing-surf-and-variations/amazing-fractal/
-struct DualAmazingboxIteration final : public IterationFunction
+struct DualAmazingboxIteration final : public IterationFunctionT<DualAmazingboxIteration>
 {
 	real scale = -2;
 	real min_r2 = 0.25f;
 	real fix_r2 = 1;
 	real fold_limit = 1;
-	DualVec3r c = { 0.0f, 0.0f, 0.0f };
+	vec3r c = { 0.0f, 0.0f, 0.0f };
 	bool julia_mode = false;
 
 
-	virtual void init(const DualVec3r & p_0) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		if (!julia_mode)
-			c = p_0;
-	}
+		using dual_vec = vec<3, dual>;
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
-		DualVec3r p = p_in;
+		const dual_vec c_val = (julia_mode) ? dual_vec(c.x(), c.y(), c.z()) : ctx.p_0;
+
+		dual_vec p = p_in;
 		p = boxFold(p);
 		p = sphereFold(p);
-		p = p * scale + c;
+		p = p * scale + c_val;
 
 		p_out = p;
 	}
 
-	virtual real getPower() const noexcept override final { return 1; } // Knighty: Well... the DE formula for this fractal doesn't have a log()
-
-	virtual IterationFunction * clone() const override final
+	// Same as evalT over blocks of points, with the folds written as selects
+	template <typename dual>
+	inline void evalBatchT(const IterationContextT<dual> * ctx, const vec<3, dual> * p_in, vec<3, dual> * p_out, const bool * active, const int count) const noexcept
 	{
-		return new DualAmazingboxIteration(*this);
+		using block = DualVec3Block<dual>;
+		using real_type = typename dual::scalar_type;
+		using dual_vec = vec<3, dual>;
+
+		const real_type limit = (real_type)fold_limit;
+		const real_type min_r2_ = (real_type)min_r2;
+		const real_type fix_r2_ = (real_type)fix_r2;
+		const real_type inner_scale = (real_type)(fix_r2 / min_r2);
+
+		for (int k0 = 0; k0 < count; k0 += block::size)
+		{
+			const int n = std::min(block::size, count - k0);
+			block p, p_0;
+			p.load(p_in + k0, n);
+			if (!julia_mode)
+			{
+				dual_vec ctx_p_0[block::size];
+				for (int k = 0; k < n; ++k)
+					ctx_p_0[k] = ctx[k0 + k].p_0;
+				p_0.load(ctx_p_0, n);
+			}
+
+			for (int k = 0; k < block::size; ++k)
+			{
+				// Box fold, the clamp is a select of either the input or the bound like clamp() on duals
+				const auto boxFold = [&](const int i)
+				{
+					const real_type x = p.e[i][0][k];
+					const real_type x_max = (x > limit) ? x : limit;
+					const bool keep_x = x > limit && x_max < -limit;
+					const real_type x_clamped = (x_max < -limit) ? x_max : -limit;
+
+					p.e[i][0][k] = x_clamped * 2 - x;
+					for (int j = 1; j < block::comps; ++j)
+						p.e[i][j][k] = (keep_x ? p.e[i][j][k] * 2 : 0) - p.e[i][j][k];
+				};
+				boxFold(0);
+				boxFold(1);
+				boxFold(2);
+
+				// Sphere fold, with the inversion computed for all lanes so that it's a select too
+				const real_type r2 = p.e[0][0][k] * p.e[0][0][k] + p.e[1][0][k] * p.e[1][0][k] + p.e[2][0][k] * p.e[2][0][k];
+				const real_type inv_r2 = 1 / (r2 * fix_r2_);
+				const real_type sphere_scale = (r2 < fix_r2_) ? inv_r2 : 1;
+				const real_type fold_scale = (r2 < min_r2_) ? inner_scale : sphere_scale;
+
+				for (int i = 0; i < 3; ++i)
+					for (int j = 0; j < block::comps; ++j)
+						p.e[i][j][k] = p.e[i][j][k] * fold_scale * (real_type)scale;
+			}
+
+			// Add c, which is a constant in Julia mode
+			for (int i = 0; i < 3; ++i)
+				for (int j = 0; j < block::comps; ++j)
+					for (int k = 0; k < block::size; ++k)
+						p.e[i][j][k] += (julia_mode) ? ((j == 0) ? (real_type)c.e[i] : 0) : p_0.e[i][j][k];
+
+			p.store(p_out + k0, active + k0, n);
+		}
 	}
 
+	virtual real getPower() const noexcept override final { return 1; } // Knighty: Well... the DE formula for this fractal doesn't have a log()
+
 protected:
-	inline DualVec3r boxFold(const DualVec3r & p_in) const
+	template <typename dual_vec>
+	inline dual_vec boxFold(const dual_vec & p_in) const
 	{
-		return DualVec3r(
+		return dual_vec(
 			clamp(p_in.x(), -fold_limit, fold_limit) * 2 - p_in.x(),
 			clamp(p_in.y(), -fold_limit, fold_limit) * 2 - p_in.y(),
 			clamp(p_in.z(), -fold_limit, fold_limit) * 2 - p_in.z());
 	}
 
-	inline DualVec3r sphereFold(const DualVec3r & p_in) const
+	template <typename dual_vec>
+	inline dual_vec sphereFold(const dual_vec & p_in) const
 	{
-		const Dual3r r2 = p_in.x() * p_in.x() + p_in.y() * p_in.y() + p_in.z() * p_in.z();
+		const auto r2 = p_in.x() * p_in.x() + p_in.y() * p_in.y() + p_in.z() * p_in.z();
 		return
 			(r2.v[0] < min_r2) ? p_in * (fix_r2 / min_r2) : // linear inner scaling
 			(r2.v[0] < fix_r2) ? p_in / (r2.v[0] * fix_r2) : // this is the actual sphere inversion
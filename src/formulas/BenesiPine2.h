@@ -6,31 +6,30 @@
 
 // BenesiPine2 formula by M Benesi
 // Based on Mandelbulb3D and Fragmentarium implementations
-struct DualBenesiPine2Iteration final : public IterationFunction
+struct DualBenesiPine2Iteration final : public IterationFunctionT<DualBenesiPine2Iteration>
 {
 	real scale = 2.5f;
 	real offset = 0.75f;
-	DualVec3r c = { 0.0f, 0.0f, 0.0f };
+	vec3r c = { 0.0f, 0.0f, 0.0f };
 	bool julia_mode = true;
 
 
-	virtual void init(const DualVec3r & p_0) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		if (!julia_mode)
-			c = p_0;
-	}
+		using dual_vec = vec<3, dual>;
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
-		DualVec3r p = p_in;
+		const dual_vec c_val = (julia_mode) ? dual_vec(c.x(), c.y(), c.z()) : ctx.p_0;
+
+		dual_vec p = p_in;
 
 		// Benesi fold transform 2
-		Dual3r tx = p.x() * sqrt_2_3 - p.z() * sqrt_1_3;
+		dual tx = p.x() * sqrt_2_3 - p.z() * sqrt_1_3;
 		p.z() = p.x()     * sqrt_1_3 + p.z() * sqrt_2_3;
 		p.x() = tx        * sqrt_1_2 - p.y() * sqrt_1_2;
 		p.y() = tx        * sqrt_1_2 + p.y() * sqrt_1_2;
 
-		p = DualVec3r(
+		p = dual_vec(
 			fabs(sqrt(p.y() * p.y() + p.z() * p.z()) - offset),
 			fabs(sqrt(p.x() * p.x() + p.z() * p.z()) - offset),
 			fabs(sqrt(p.x() * p.x() + p.y() * p.y()) - offset)
@@ -43,23 +42,18 @@ struct DualBenesiPine2Iteration final : public IterationFunction
 		p.z() = -tx    * sqrt_1_3 + p.z() * sqrt_2_3;
 
 		// Benesi pinetree
-		Dual3r xt = p.x() * p.x(); 
-		Dual3r yt = p.y() * p.y(); 
-		Dual3r zt = p.z() * p.z();
-		Dual3r t  = p.x() / sqrt(yt + zt) * 2;
-		p_out = DualVec3r(
-			c.x() + xt - yt - zt,
-			c.y() + t * (yt - zt),
-			c.z() + t * p.y() * p.z() * 2);
+		dual xt = p.x() * p.x(); 
+		dual yt = p.y() * p.y(); 
+		dual zt = p.z() * p.z();
+		dual t  = p.x() / sqrt(yt + zt) * 2;
+		p_out = dual_vec(
+			c_val.x() + xt - yt - zt,
+			c_val.y() + t * (yt - zt),
+			c_val.z() + t * p.y() * p.z() * 2);
 	}
 
 	virtual real getPower() const noexcept override final { return 2; }
 
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualBenesiPine2Iteration(*this);
-	}
-
 protected:
 	const real sqrt_2_3 = (real)0.81649658092; // sqrt(2/3)
 	const real sqrt_1_3 = (real)0.57735026919; // sqrt(1/3)
@@ -7,33 +7,27 @@
 // Cubicbulb formula
 // Based on implementations by quasihedron and dark-beam 
 // Ref: https://www.deviantart.com/quasihedron/art/JIT-QH2017-CubicBulb-20170210-662776379
-struct DualCubicbulbIteration final : public IterationFunction
+struct DualCubicbulbIteration final : public IterationFunctionT<DualCubicbulbIteration>
 {
 	real y_mul = 3;
 	real z_mul = 3;
 	real aux_mul = 1;
-	DualVec3r c = { -0.5f, -0.5f, -0.25f };
+	vec3r c = { -0.5f, -0.5f, -0.25f };
 	bool julia_mode = true;
 
 
-	virtual void init(const DualVec3r & p_0) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		if (!julia_mode)
-			c = p_0;
-	}
+		using dual_vec = vec<3, dual>;
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
-		p_out = DualVec3r(
-			 c.x() + p_in.x() * p_in.x() * p_in.x() - p_in.x() * p_in.y() * p_in.y() * y_mul - p_in.x() * p_in.z() * p_in.z() * z_mul,
-			 c.y() - p_in.y() * p_in.y() * p_in.y() + p_in.y() * p_in.x() * p_in.x() * y_mul - p_in.y() * p_in.z() * p_in.z() * aux_mul,
-			 c.z() + p_in.z() * p_in.z() * p_in.z() - p_in.z() * p_in.x() * p_in.x() * z_mul + p_in.z() * p_in.y() * p_in.y() * aux_mul);
+		const dual_vec c_val = (julia_mode) ? dual_vec(c.x(), c.y(), c.z()) : ctx.p_0;
+
+		p_out = dual_vec(
+			 c_val.x() + p_in.x() * p_in.x() * p_in.x() - p_in.x() * p_in.y() * p_in.y() * y_mul - p_in.x() * p_in.z() * p_in.z() * z_mul,
+			 c_val.y() - p_in.y() * p_in.y() * p_in.y() + p_in.y() * p_in.x() * p_in.x() * y_mul - p_in.y() * p_in.z() * p_in.z() * aux_mul,
+			 c_val.z() + p_in.z() * p_in.z() * p_in.z() - p_in.z() * p_in.x() * p_in.x() * z_mul + p_in.z() * p_in.y() * p_in.y() * aux_mul);
 	}
 
 	virtual real getPower() const noexcept override final { return 3; }
-
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualCubicbulbIteration(*this);
-	}
 };
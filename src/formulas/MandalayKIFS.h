@@ -7,7 +7,7 @@
 // Mandalay-KIFS formula
 // There are multiple mandalay variations, this one is based on dark-beam's kifs mandalay from mandelbulb3d.
 // Ref: http://www.fractalforums.com/amazing-box-amazing-surf-and-variations/'new'-fractal-type-mandalay/msg81434/#msg81434
-struct DualMandalayKIFSIteration final : public IterationFunction
+struct DualMandalayKIFSIteration final : public IterationFunctionT<DualMandalayKIFSIteration>
 {
 	real scale = 2;
 	real min_r2 = 0;
@@ -18,44 +18,43 @@ struct DualMandalayKIFSIteration final : public IterationFunction
 	vec3r rot_m1 = { 1, 0, 0 };
 	vec3r rot_m2 = { 0, 1, 0 };
 	vec3r rot_m3 = { 0, 0, 1 };
-	DualVec3r c  = { 0, 0, 0 };
+	vec3r c = { 0, 0, 0 };
 	bool julia_mode = true;
 
 
-	virtual void init(const DualVec3r & p_0) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		if (!julia_mode)
-			c = p_0;
-	}
+		using dual_vec = vec<3, dual>;
+
+		const dual_vec c_val = (julia_mode) ? dual_vec(c.x(), c.y(), c.z()) : ctx.p_0;
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
 		// Rotate
-		DualVec3r p = DualVec3r(
+		dual_vec p = dual_vec(
 			dot(p_in, rot_m1),
 			dot(p_in, rot_m2),
 			dot(p_in, rot_m3));
 
-		p = DualVec3r(fabs(p.x()), fabs(p.y()), fabs(p.z()));
+		p = dual_vec(fabs(p.x()), fabs(p.y()), fabs(p.z()));
 
 		// Octahedral fold
-		if (p.y().v[0] > p.x().v[0]) p = DualVec3r(p.y(), p.x(), p.z());
-		if (p.z().v[0] > p.y().v[0]) p = DualVec3r(p.x(), p.z(), p.y());
-		if (p.y().v[0] > p.x().v[0]) p = DualVec3r(p.y(), p.x(), p.z());
+		if (p.y().v[0] > p.x().v[0]) p = dual_vec(p.y(), p.x(), p.z());
+		if (p.z().v[0] > p.y().v[0]) p = dual_vec(p.x(), p.z(), p.y());
+		if (p.y().v[0] > p.x().v[0]) p = dual_vec(p.y(), p.x(), p.z());
 
 		// ABoxKali-like abs folding
-		const Dual3r fx = p.x() + fold * -2;
+		const dual fx = p.x() + fold * -2;
 
 		// Edges
-		const DualVec3r q0(
+		const dual_vec q0(
 			-fabs(p.x() - fold) + fold,
 			-fabs(p.y() - fold) + fold,
 			((z_tower > 0) ? -fabs(p.z() - fold) : p.z()) + z_tower);
 
-		const Dual3r g  = xy_tower;
-		const Dual3r gy = g + p.y();
+		const dual g  = xy_tower;
+		const dual gy = g + p.y();
 
-		DualVec3r q = q0;
+		dual_vec q = q0;
 		if (fx.v[0] > 0 && fx.v[0] > p.y().v[0])
 		{
 			if (fx.v[0] > gy.v[0])
@@ -75,20 +74,16 @@ struct DualMandalayKIFSIteration final : public IterationFunction
 
 		sphereFold(p);
 
-		p = p * scale + c;
+		p = p * scale + c_val;
 
 		p_out = p;
 	}
 
 	virtual real getPower() const noexcept override final { return 1; }
 
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualMandalayKIFSIteration(*this);
-	}
-
 private:
-	inline DualVec3r sphereFold(const DualVec3r & p_in) const
+	template <typename dual_vec>
+	inline dual_vec sphereFold(const dual_vec & p_in) const
 	{
 		const real r2 = length2(p_in);
 		return
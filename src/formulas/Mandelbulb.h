@@ -11,7 +11,7 @@
 // Ref: https://www.iquilezles.org/www/articles/mandelbulb/mandelbulb.htm
 struct MandelbulbAnalytic final : public AnalyticDEObject
 {
-	virtual real getDE(const vec3r & p_os) noexcept override final
+	virtual real getDE(const vec3r & p_os) const noexcept override final
 	{
 		vec3r w = p_os;
 		real m = dot(w, w);
@@ -53,7 +53,7 @@ struct MandelbulbAnalytic final : public AnalyticDEObject
 
 struct MandelbulbDual final : public DualDEObject
 {
-	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) noexcept override final
+	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept override final
 	{
 		DualVec3r w = p_os;
 
@@ -64,7 +64,7 @@ struct MandelbulbDual final : public DualDEObject
 			const Dual3r z = w.z(), z2 = z*z, z4 = z2*z2;
 
 			const Dual3r k3 = x2 + z2;
-			const Dual3r k2 = Dual3r(1) / sqrt(k3*k3*k3*k3*k3*k3*k3);
+			const Dual3r k2 = 1 / sqrt(k3*k3*k3*k3*k3*k3*k3);
 			const Dual3r k1 = x4 + y4 + z4 - y2*z2 * 6 - x2*y2 * 6 + z2*x2 * 2;
 			const Dual3r k4 = x2 - y2 + z2;
 
@@ -91,70 +91,48 @@ struct MandelbulbDual final : public DualDEObject
 };
 
 
-struct DualMandelbulbIteration final : public IterationFunction
+struct DualMandelbulbIteration final : public IterationFunctionT<DualMandelbulbIteration>
 {
-	virtual void init(const DualVec3r & p_0) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		c = p_0;
-	}
+		using dual_vec = vec<3, dual>;
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
-		const Dual3r x = p_in.x(), x2 = x*x, x4 = x2*x2;
-		const Dual3r y = p_in.y(), y2 = y*y, y4 = y2*y2;
-		const Dual3r z = p_in.z(), z2 = z*z, z4 = z2*z2;
+		const dual_vec & c = ctx.p_0;
 
-		const Dual3r k3 = x2 + z2;
-		const Dual3r k2 = Dual3r(1) / sqrt(k3*k3*k3*k3*k3*k3*k3);
-		const Dual3r k1 = x4 + y4 + z4 - y2*z2 * 6 - x2*y2 * 6 + z2*x2 * 2;
-		const Dual3r k4 = x2 - y2 + z2;
+		const dual x = p_in.x(), x2 = x*x, x4 = x2*x2;
+		const dual y = p_in.y(), y2 = y*y, y4 = y2*y2;
+		const dual z = p_in.z(), z2 = z*z, z4 = z2*z2;
 
-		p_out = DualVec3r(
+		const dual k3 = x2 + z2;
+		const dual k2 = 1 / sqrt(k3*k3*k3*k3*k3*k3*k3);
+		const dual k1 = x4 + y4 + z4 - y2*z2 * 6 - x2*y2 * 6 + z2*x2 * 2;
+		const dual k4 = x2 - y2 + z2;
+
+		p_out = dual_vec(
 			c.x() + x*y*z * 64 * (x2 - z2) * k4 * (x4 - x2*z2 * 6 + z4) * k1*k2,
 			c.y() + y2*k3*k4*k4 * -16 + k1*k1,
 			c.z() + y*k4 * (x4*x4 - x4*x2*z2 * 28 + x4*z4 * 70 - x2*z2*z4 * 28 + z4*z4) * k1*k2 * -8);
 	}
 
 	virtual real getPower() const noexcept override final { return 8; }
-
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualMandelbulbIteration(*this);
-	}
-
-private:
-	DualVec3r c;
 };
 
 
-struct DualTriplexMandelbulbIteration final : public IterationFunction
+struct DualTriplexMandelbulbIteration final : public IterationFunctionT<DualTriplexMandelbulbIteration>
 {
-	virtual void init(const DualVec3r & p_0) noexcept override final
-	{
-		// Change of coordinate system to Z+ up
-		const DualTriplex3r z(p_0.x(), p_0.z(), p_0.y());
-
-		c = z;
-	}
-
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
 		// Change of coordinate system to Z+ up
-		const DualTriplex3r z(p_in.x(), p_in.z(), p_in.y());
+		const triplex<dual> c(ctx.p_0.x(), ctx.p_0.z(), ctx.p_0.y());
+		const triplex<dual> z(p_in.x(), p_in.z(), p_in.y());
 
-		const DualTriplex3r z_ = sqr(sqr(sqr(z))) + c;
+		const triplex<dual> z_ = sqr(sqr(sqr(z))) + c;
 
 		// Un-rotate back to Y+ up
 		p_out = { z_.x(), z_.z(), z_.y() };
 	}
 
 	virtual real getPower() const noexcept override final { return 8; }
-
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualTriplexMandelbulbIteration(*this);
-	}
-
-private:
-	DualTriplex3r c;
 };
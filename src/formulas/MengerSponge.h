@@ -11,7 +11,7 @@
 // https://github.com/buddhi1980/mandelbulber2/blob/517423cc5b9ac960464cbcde612a0d8c61df3375/mandelbulber2/formula/definition/fractal_menger_sponge.cpp
 struct MengerSpongeAnalytic final : public AnalyticDEObject
 {
-	virtual real getDE(const vec3r & p_os) noexcept override final
+	virtual real getDE(const vec3r & p_os) const noexcept override final
 	{
 		vec3r z = p_os;
 		real m2 = dot(z, z);
@@ -52,7 +52,7 @@ struct MengerSpongeAnalytic final : public AnalyticDEObject
 
 struct MengerSpongeDual final : public DualDEObject
 {
-	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) noexcept override final
+	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept override final
 	{
 		DualVec3r z(p_os);
 
@@ -91,11 +91,14 @@ struct MengerSpongeDual final : public DualDEObject
 };
 
 
-struct DualMengerSpongeIteration final : public IterationFunction
+struct DualMengerSpongeIteration final : public IterationFunctionT<DualMengerSpongeIteration>
 {
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> &, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		DualVec3r z(
+		using dual_vec = vec<3, dual>;
+
+		dual_vec z(
 			fabs(p_in.x()),
 			fabs(p_in.y()),
 			fabs(p_in.z()));
@@ -114,9 +117,4 @@ struct DualMengerSpongeIteration final : public IterationFunction
 	}
 
 	virtual real getPower() const noexcept override final { return 1; }
-
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualMengerSpongeIteration(*this);
-	}
 };
@@ -15,7 +15,7 @@ struct MengerSpongeCAnalytic final : public AnalyticDEObject
 	vec3r scale_centre = { 1.0f, 1.0f, 1.0f };
 
 
-	virtual real getDE(const vec3r & p_os) noexcept override final
+	virtual real getDE(const vec3r & p_os) const noexcept override final
 	{
 		vec3r z = p_os;
 		real m  = dot(z, z);
@@ -62,7 +62,7 @@ struct MengerSpongeCDual final : public DualDEObject
 	vec3r scale_centre = { 1.0f, 1.0f, 1.0f };
 
 
-	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) noexcept override final
+	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept override final
 	{
 		DualVec3r z(p_os);
 
@@ -102,15 +102,18 @@ struct MengerSpongeCDual final : public DualDEObject
 };
 
 
-struct DualMengerSpongeCIteration final : public IterationFunction
+struct DualMengerSpongeCIteration final : public IterationFunctionT<DualMengerSpongeCIteration>
 {
 	real  scale = 3;
 	vec3r scale_centre = { 1.0f, 1.0f, 1.0f };
 
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> &, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		DualVec3r z(
+		using dual_vec = vec<3, dual>;
+
+		dual_vec z(
 			fabs(p_in.x()),
 			fabs(p_in.y()),
 			fabs(p_in.z()));
@@ -119,7 +122,7 @@ struct DualMengerSpongeCIteration final : public IterationFunction
 		if (z.x().v[0] < z.z().v[0]) std::swap(z.x(), z.z());
 		if (z.y().v[0] < z.z().v[0]) std::swap(z.y(), z.z());
 
-		Dual3r t = min(Dual3r(0), (Dual3r)(0.5f * scale_centre.y() * (scale - 1) / scale) - z.z());
+		dual t = min(dual(0), (dual)(0.5f * scale_centre.y() * (scale - 1) / scale) - z.z());
 		z.z() = z.z() + t * 2;
 
 		z.x() *= scale; z.x() -= scale_centre.x() * (scale - 1);
@@ -129,10 +132,62 @@ struct DualMengerSpongeCIteration final : public IterationFunction
 		p_out = z;
 	}
 
-	virtual real getPower() const noexcept override final { return 1; }
-
-	virtual IterationFunction * clone() const override final
+	// Same as evalT over blocks of points, the sorting network swaps all components of a coordinate with selects
+	template <typename dual>
+	inline void evalBatchT(const IterationContextT<dual> *, const vec<3, dual> * p_in, vec<3, dual> * p_out, const bool * active, const int count) const noexcept
 	{
-		return new DualMengerSpongeCIteration(*this);
+		using block = DualVec3Block<dual>;
+		using real_type = typename dual::scalar_type;
+
+		const real_type fold = (real_type)(0.5f * scale_centre.y() * (scale - 1) / scale);
+		const real_type offset[3] = { (real_type)(scale_centre.x() * (scale - 1)), (real_type)(scale_centre.y() * (scale - 1)), 0 };
+
+		for (int k0 = 0; k0 < count; k0 += block::size)
+		{
+			const int n = std::min(block::size, count - k0);
+			block z;
+			z.load(p_in + k0, n);
+
+			for (int k = 0; k < block::size; ++k)
+			{
+				for (int i = 0; i < 3; ++i)
+				{
+					const bool negative = z.e[i][0][k] < 0;
+					for (int c = 0; c < block::comps; ++c)
+						z.e[i][c][k] = negative ? -z.e[i][c][k] : z.e[i][c][k];
+				}
+
+				const auto sortPair = [&](const int a, const int b)
+				{
+					const bool swap = z.e[a][0][k] < z.e[b][0][k];
+					for (int c = 0; c < block::comps; ++c)
+					{
+						const real_type za = z.e[a][c][k], zb = z.e[b][c][k];
+						z.e[a][c][k] = swap ? zb : za;
+						z.e[b][c][k] = swap ? za : zb;
+					}
+				};
+				sortPair(0, 1);
+				sortPair(0, 2);
+				sortPair(1, 2);
+
+				// Fold z with the min against 0 like in evalT, derivatives are kept where fold - z is the smaller
+				const bool fold_z = !(0 < fold - z.e[2][0][k]);
+				z.e[2][0][k] = z.e[2][0][k] + (fold_z ? fold - z.e[2][0][k] : 0) * 2;
+				for (int c = 1; c < block::comps; ++c)
+					z.e[2][c][k] = z.e[2][c][k] + (fold_z ? 0 - z.e[2][c][k] : 0) * 2;
+
+				for (int i = 0; i < 3; ++i)
+				{
+					z.e[i][0][k] = z.e[i][0][k] * (real_type)scale - offset[i];
+					for (int c = 1; c < block::comps; ++c)
+						z.e[i][c][k] *= (real_type)scale;
+				}
+			}
+
+			z.store(p_out + k0, active + k0, n);
+		}
 	}
+
+	virtual real getPower() const noexcept override final { return 1; }
 };
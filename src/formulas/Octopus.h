@@ -6,31 +6,25 @@
 
 // Octopus formula by Aexion (September 15, 2013)
 // Ref: http://www.fractalforums.com/mandelbulb-3d/custom-formulas-and-transforms-release-t17106/msg65751/#msg65751
-struct DualOctopusIteration final : public IterationFunction
+struct DualOctopusIteration final : public IterationFunctionT<DualOctopusIteration>
 {
 	real xz_mul = 1.25f;
 	real sq_mul = 1;
-	DualVec3r c = { 0.0f, 0.0f, 0.0f };
+	vec3r c = { 0.0f, 0.0f, 0.0f };
 	bool julia_mode = true;
 
-	virtual void init(const DualVec3r & p_0) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		if (!julia_mode)
-			c = p_0;
-	}
+		using dual_vec = vec<3, dual>;
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
-		p_out = DualVec3r(
-			c.x() - p_in.x() * p_in.z() * xz_mul,
-			c.y() - (p_in.x() * p_in.x() - p_in.z() * p_in.z()) * sq_mul,
-			c.z() + p_in.y());
+		const dual_vec c_val = (julia_mode) ? dual_vec(c.x(), c.y(), c.z()) : ctx.p_0;
+
+		p_out = dual_vec(
+			c_val.x() - p_in.x() * p_in.z() * xz_mul,
+			c_val.y() - (p_in.x() * p_in.x() - p_in.z() * p_in.z()) * sq_mul,
+			c_val.z() + p_in.y());
 	}
 
 	virtual real getPower() const noexcept override final { return 2; }
-
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualOctopusIteration(*this);
-	}
 };
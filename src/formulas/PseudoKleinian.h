@@ -5,25 +5,63 @@
 
 
 // Pseudo-Kleinian DE by Knighty
-struct DualPseudoKleinianIteration final : public IterationFunction
+struct DualPseudoKleinianIteration final : public IterationFunctionT<DualPseudoKleinianIteration>
 {
     real mins[4] = { -0.8323f, -0.694f, -0.5045f, 0.8067f };
     real maxs[4] = {  0.8579f,  1.0883f, 0.8937f, 0.9411f };
 
-    virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
+    template <typename dual>
+    inline void evalT(const IterationContextT<dual> &, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
     {
-        const Dual3r px = clamp(p_in.x(), mins[0], maxs[0]) * 2 - p_in.x();
-        const Dual3r py = clamp(p_in.y(), mins[1], maxs[1]) * 2 - p_in.y();
-        const Dual3r pz = clamp(p_in.z(), mins[2], maxs[2]) * 2 - p_in.z();
+        using dual_vec = vec<3, dual>;
 
-        const real k = std::max(mins[3] / length2(DualVec3r{ px, py, pz }), (real)1);
-        p_out = DualVec3r(px, py, pz) * k;
-    }
+        const dual px = clamp(p_in.x(), mins[0], maxs[0]) * 2 - p_in.x();
+        const dual py = clamp(p_in.y(), mins[1], maxs[1]) * 2 - p_in.y();
+        const dual pz = clamp(p_in.z(), mins[2], maxs[2]) * 2 - p_in.z();
 
-    virtual real getPower() const noexcept override final { return 1; }
+        const real k = std::max(mins[3] / length2(dual_vec{ px, py, pz }), (real)1);
+        p_out = dual_vec(px, py, pz) * k;
+    }
 
-    virtual IterationFunction * clone() const override final
+    // Same as evalT over blocks of points, the clamp is a select of either the input or the bound like clamp() on duals
+    template <typename dual>
+    inline void evalBatchT(const IterationContextT<dual> *, const vec<3, dual> * p_in, vec<3, dual> * p_out, const bool * active, const int count) const noexcept
     {
-        return new DualPseudoKleinianIteration(*this);
+        using block = DualVec3Block<dual>;
+        using real_type = typename dual::scalar_type;
+
+        for (int k0 = 0; k0 < count; k0 += block::size)
+        {
+            const int n = std::min(block::size, count - k0);
+            block p;
+            p.load(p_in + k0, n);
+
+            for (int k = 0; k < block::size; ++k)
+            {
+                real_type r2 = 0;
+                for (int i = 0; i < 3; ++i)
+                {
+                    const real_type x = p.e[i][0][k];
+                    const real_type x_max = (x > (real_type)maxs[i]) ? x : (real_type)maxs[i];
+                    const bool keep_x = x > (real_type)maxs[i] && x_max < (real_type)mins[i];
+                    const real_type x_clamped = (x_max < (real_type)mins[i]) ? x_max : (real_type)mins[i];
+
+                    p.e[i][0][k] = x_clamped * 2 - x;
+                    for (int c = 1; c < block::comps; ++c)
+                        p.e[i][c][k] = (keep_x ? p.e[i][c][k] * 2 : 0) - p.e[i][c][k];
+
+                    r2 += p.e[i][0][k] * p.e[i][0][k];
+                }
+
+                const real_type s = (real_type)std::max(mins[3] / r2, (real)1);
+                for (int i = 0; i < 3; ++i)
+                    for (int c = 0; c < block::comps; ++c)
+                        p.e[i][c][k] *= s;
+            }
+
+            p.store(p_out + k0, active + k0, n);
+        }
     }
+
+    virtual real getPower() const noexcept override final { return 1; }
 };
@@ -7,7 +7,7 @@
 // Riemann Sphere formula by Msltoe
 // Based on implementations in Mandelbulber and Mandelbulb3D
 // Ref: http://www.fractalforums.com/theory/choosing-the-squaring-formula-by-location/
-struct DualRiemannSphereIteration final : public IterationFunction
+struct DualRiemannSphereIteration final : public IterationFunctionT<DualRiemannSphereIteration>
 {
 	real scale = 1;
 	real s_shift = 0;
@@ -15,7 +15,7 @@ struct DualRiemannSphereIteration final : public IterationFunction
 	real x_shift = 1;
 	real r_shift = -0.25f;
 	real r_pow = 2;
-	DualVec3r c = { 0, 0, 0 };
+	vec3r c = { 0, 0, 0 };
 	//bool julia_mode = false;
 
 	vec3r rot_m1 = { 1, 0, 0 };
@@ -23,16 +23,13 @@ struct DualRiemannSphereIteration final : public IterationFunction
 	vec3r rot_m3 = { 0, 0, 1 };
 
 
-	virtual void init(const DualVec3r &) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> &, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		//if (!julia_mode)
-		//	c = p_0;
-	}
+		using dual_vec = vec<3, dual>;
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
 		// Rotate
-		DualVec3r p = DualVec3r(
+		dual_vec p = dual_vec(
 			dot(p_in, rot_m1),
 			dot(p_in, rot_m2),
 			dot(p_in, rot_m3));
@@ -41,10 +38,10 @@ struct DualRiemannSphereIteration final : public IterationFunction
 		p *= (scale / r);
 
 		const real one_my = fabs(-p.y().v[0] + 1);
-		Dual3r s, t;
+		dual s, t;
 		if (one_my > real(1e-5)) // TODO maybe different constant for double precision
 		{
-			const Dual3r q = Dual3r(1) / (-p.y() + 1);
+			const dual q = 1 / (-p.y() + 1);
 			s = p.x() * q;
 			t = p.z() * q;
 		}
@@ -54,26 +51,21 @@ struct DualRiemannSphereIteration final : public IterationFunction
 			t = p.z();
 		}
 
-		const Dual3r d = s * s + t * t + 1;
+		const dual d = s * s + t * t + 1;
 		s = fabs(sin(s * pi + s_shift));
 		t = fabs(sin(t * pi + t_shift));
 		s = fabs(s + x_shift);
 		t = fabs(t + x_shift);
 
-		const Dual3r r_ = Dual3r(-0.25f + r_shift) + pow(r, d.v[0] * r_pow);
-		const Dual3r d_ = Dual3r(2) / d;
+		const dual r_ = dual(-0.25f + r_shift) + pow(r, d.v[0] * r_pow);
+		const dual d_ = 2 / d;
 
-		p_out = DualVec3r(
-			c.x() + r_ * s * d_,
-			c.y() + r_ * (-d_ + 1),
-			c.z() + r_ * t * d_
+		p_out = dual_vec(
+			r_ * s * d_ + c.x(),
+			r_ * (-d_ + 1) + c.y(),
+			r_ * t * d_ + c.z()
 		);
 	}
 
 	virtual real getPower() const noexcept override final { return r_pow; }
-
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualRiemannSphereIteration(*this);
-	}
 };
@@ -6,32 +6,33 @@
 
 // Sphere Tree formula (WIP, doesn't work yet) by Tglad
 // Ref: https://fractalforums.org/fractal-mathematics-and-new-theories/28/new-sphere-tree/3557/
-struct DualSphereTreeIteration final : public IterationFunction
+struct DualSphereTreeIteration final : public IterationFunctionT<DualSphereTreeIteration>
 {
 	// These should be static / constexpr...
 	const real rad = 0.5f;
-	const DualVec3r s0 = DualVec3r(0, 1, rad);
-	const DualVec3r s1 = DualVec3r( sqrt(3.0) / 2, -0.5, rad);
-	const DualVec3r s2 = DualVec3r(-sqrt(3.0) / 2, -0.5, rad);
-	const DualVec3r t0 = DualVec3r(0, 1, 0);
-	const DualVec3r t1 = DualVec3r( sqrt(3.0) / 2, -0.5, 0);
-	const DualVec3r t2 = DualVec3r(-sqrt(3.0) / 2, -0.5, 0);
-	const DualVec3r n0 = DualVec3r(1.0,0.0,0.0);
-	const DualVec3r n1 = DualVec3r(-0.5, -sqrt(3.0) / 2, 0);
-	const DualVec3r n2 = DualVec3r(-0.5,  sqrt(3.0) / 2, 0);
+	const vec3r s0 = vec3r(0, 1, rad);
+	const vec3r s1 = vec3r( sqrt(3.0) / 2, -0.5, rad);
+	const vec3r s2 = vec3r(-sqrt(3.0) / 2, -0.5, rad);
+	const vec3r t0 = vec3r(0, 1, 0);
+	const vec3r t1 = vec3r( sqrt(3.0) / 2, -0.5, 0);
+	const vec3r t2 = vec3r(-sqrt(3.0) / 2, -0.5, 0);
+	const vec3r n0 = vec3r(1.0,0.0,0.0);
+	const vec3r n1 = vec3r(-0.5, -sqrt(3.0) / 2, 0);
+	const vec3r n2 = vec3r(-0.5,  sqrt(3.0) / 2, 0);
 	const real inner_scale = sqrt(3.0) / (1 + sqrt(3.0));
 
-	DualVec3r p0;
 
-	virtual void init(const DualVec3r & p_0) noexcept override final
+	template <typename dual>
+	inline void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
 	{
-		p0 = p_0;
-	}
+		using dual_vec = vec<3, dual>;
+		const dual_vec t1_(t1.x(), t1.y(), t1.z());
+		const dual_vec t2_(t2.x(), t2.y(), t2.z());
+		const dual_vec n1_(n1.x(), n1.y(), n1.z());
+		const dual_vec n2_(n2.x(), n2.y(), n2.z());
 
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
-	{
 		// Change of coordinate system to Z+ up
-		DualVec3r p(p_in.x(), p_in.z(), p_in.y());
+		dual_vec p(p_in.x(), p_in.z(), p_in.y());
 
 		// Get a vector without the derivatives for faster distance computations
 		const vec3r p_vec3 = vec3r(p.x().v[0], p.y().v[0], p.z().v[0]);
@@ -43,11 +44,7 @@ struct DualSphereTreeIteration final : public IterationFunction
 			return; // Definitely inside
 		}
 
-		// Since we don't have access to the iteration count, we compare the input point to the first point (from init)
-		const bool first_iter =
-			p_in.x().v[0] == p0.x().v[0] &&
-			p_in.y().v[0] == p0.y().v[0] &&
-			p_in.z().v[0] == p0.z().v[0];
+		const bool first_iter = ctx.iteration == 0;
 		const real maxH = (first_iter) ? -100 : 0.4;
 
 		if (p_vec3.z() > maxH && length(p_vec3 - vec3r(0, 0, 0.5 * 1.1)) > 0.5 * 1.1)
@@ -68,31 +65,31 @@ struct DualSphereTreeIteration final : public IterationFunction
 
 			// Rotate it a twelfth of a revolution
 			constexpr real a = pi / 6;
-			const Dual3r xx = p.x() *  cos(a) + p.y() * sin(a);
-			const Dual3r yy = p.x() * -sin(a) + p.y() * cos(a);
+			const dual xx = p.x() *  cos(a) + p.y() * sin(a);
+			const dual yy = p.x() * -sin(a) + p.y() * cos(a);
 			p.x() = xx; 
 			p.y() = yy;
 		}
 
 		// Now modolu the space so we move to being in just the central hexagon, inner radius 0.5
-		const Dual3r h = p.z();
-		Dual3r x = dot(p, -n2) * 2 / sqrt(3.0);
-		Dual3r y = dot(p, -n1) * 2 / sqrt(3.0);
+		const dual h = p.z();
+		dual x = dot(p, -n2_) * 2 / sqrt(3.0);
+		dual y = dot(p, -n1_) * 2 / sqrt(3.0);
 		x = fmod(x, real(1));
 		y = fmod(y, real(1));
 		if (x.v[0] + y.v[0] > 1)
 		{
-			x = Dual3r(1) - x;
-			y = Dual3r(1) - y;
+			x = 1 - x;
+			y = 1 - y;
 		}
-		p = t1 * x - t2 * y;
+		p = t1_ * x - t2_ * y;
 
 		// Fold the space to be in a kite
-		const Dual3r l0 = dot(p, p);
-		const Dual3r l1 = dot(p - t1, p - t1);
-		const Dual3r l2 = dot(p + t2, p + t2);
-		     if (l1.v[0] < l0.v[0] && l1.v[0] < l2.v[0]) p -= t1 * (dot(t1, p) * 2 - 1);
-		else if (l2.v[0] < l0.v[0] && l2.v[0] < l1.v[0]) p -= t2 * (dot(p, t2) * 2 + 1);
+		const dual l0 = dot(p, p);
+		const dual l1 = dot(p - t1_, p - t1_);
+		const dual l2 = dot(p + t2_, p + t2_);
+		     if (l1.v[0] < l0.v[0] && l1.v[0] < l2.v[0]) p -= t1_ * (dot(t1_, p) * 2 - 1);
+		else if (l2.v[0] < l0.v[0] && l2.v[0] < l1.v[0]) p -= t2_ * (dot(p, t2_) * 2 + 1);
 		p.z() = h;
 
 		// Un-rotate back to Y+ up
@@ -100,9 +97,4 @@ struct DualSphereTreeIteration final : public IterationFunction
 	}
 
 	virtual real getPower() const noexcept override final { return 1; } // Knighty: Well... the DE formula for this fractal doesn't have a log()
-
-	virtual IterationFunction * clone() const override final
-	{
-		return new DualSphereTreeIteration(*this);
-	}
 };
@@ -6,17 +6,33 @@ target_sources(TracerLib INTERFACE
     maths/triplex.h
     maths/vec.h
 
+    util/MappedFile.h
+    util/PngStreamWriter.h
     util/stb_image_write.h
 
+    renderer/BVH.h
+    renderer/Checkpoint.h
+    renderer/ExrOutput.h
+    renderer/FrameEncoder.h
+    renderer/Lights.h
     renderer/Material.h
     renderer/Ray.h
     renderer/Renderer.h
+    renderer/RenderStats.h
+    renderer/Reproject.h
+    renderer/Sampler.h
     renderer/Scene.h
+    renderer/SceneFile.h
+    renderer/TileScheduler.h
+    renderer/Tonemap.h
 
     scene_objects/AnalyticDEObject.h
+    scene_objects/DECache.h
     scene_objects/DualDEObject.h
+    scene_objects/MarchStepper.h
     scene_objects/SceneObject.h
     scene_objects/SimpleObjects.h
+    scene_objects/StaticHybridDE.h
 
     formulas/Amazingbox.h
     formulas/BenesiPine2.h
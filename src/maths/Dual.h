@@ -2,15 +2,28 @@
 
 #include "real.h"
 
+// 3-variable duals are vectorised explicitly when a whole one fits a register, define DUAL_SIMD as 0 to use the generic version
+#ifndef DUAL_SIMD
+#if defined(__AVX__)
+#define DUAL_SIMD 1
+#else
+#define DUAL_SIMD 0
+#endif
+#endif
+
+#if DUAL_SIMD
+#include <immintrin.h>
+#endif
+
 
 
-// TODO: Add specialised functions for +-*/ with scalar (to avoid promotion to Dual)
-// TODO: Add more functions (e.g. asin, acos, atan)
 // Note that this is slightly suboptimal for single variable derivatives
 template <typename real_type, int vars>
 class Dual final
 {
 public:
+	using scalar_type = real_type; // For scalar arguments to the free functions below, so they don't take part in type deduction
+
 	real_type v[vars + 1];
 
 
@@ -114,6 +127,153 @@ public:
 	}
 };
 
+
+#if DUAL_SIMD
+// Register operations for the 3-variable specialisation, the value and 3 derivatives are 4 doubles for AVX or 4 floats for SSE
+template <typename real_type>
+struct DualLanes;
+
+template <>
+struct DualLanes<double>
+{
+	using reg = __m256d;
+
+	static inline reg load(const double * p) noexcept { return _mm256_load_pd(p); }
+	static inline void store(double * p, const reg a) noexcept { _mm256_store_pd(p, a); }
+	static inline reg set1(const double s) noexcept { return _mm256_set1_pd(s); }
+	static inline reg add(const reg a, const reg b) noexcept { return _mm256_add_pd(a, b); }
+	static inline reg sub(const reg a, const reg b) noexcept { return _mm256_sub_pd(a, b); }
+	static inline reg mul(const reg a, const reg b) noexcept { return _mm256_mul_pd(a, b); }
+	static inline reg neg(const reg a) noexcept { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+	static inline reg derivs(const reg a) noexcept { return _mm256_blend_pd(a, _mm256_setzero_pd(), 1); } // Zero the value lane
+	static inline reg withValue(const reg a, const reg b) noexcept { return _mm256_blend_pd(a, b, 1); } // Value lane from b
+	static inline reg set(const double s0, const double s1, const double s2, const double s3) noexcept { return _mm256_set_pd(s3, s2, s1, s0); }
+
+	// 4x4 transpose, e.g. between 4 duals and their components in structure of arrays layout
+	static inline void transpose(reg & a, reg & b, reg & c, reg & d) noexcept
+	{
+		const reg t0 = _mm256_unpacklo_pd(a, b), t1 = _mm256_unpackhi_pd(a, b);
+		const reg t2 = _mm256_unpacklo_pd(c, d), t3 = _mm256_unpackhi_pd(c, d);
+		a = _mm256_permute2f128_pd(t0, t2, 0x20);
+		b = _mm256_permute2f128_pd(t1, t3, 0x20);
+		c = _mm256_permute2f128_pd(t0, t2, 0x31);
+		d = _mm256_permute2f128_pd(t1, t3, 0x31);
+	}
+};
+
+template <>
+struct DualLanes<float>
+{
+	using reg = __m128;
+
+	static inline reg load(const float * p) noexcept { return _mm_load_ps(p); }
+	static inline void store(float * p, const reg a) noexcept { _mm_store_ps(p, a); }
+	static inline reg set1(const float s) noexcept { return _mm_set1_ps(s); }
+	static inline reg add(const reg a, const reg b) noexcept { return _mm_add_ps(a, b); }
+	static inline reg sub(const reg a, const reg b) noexcept { return _mm_sub_ps(a, b); }
+	static inline reg mul(const reg a, const reg b) noexcept { return _mm_mul_ps(a, b); }
+	static inline reg neg(const reg a) noexcept { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+	static inline reg derivs(const reg a) noexcept { return _mm_blend_ps(a, _mm_setzero_ps(), 1); } // Zero the value lane
+	static inline reg withValue(const reg a, const reg b) noexcept { return _mm_blend_ps(a, b, 1); } // Value lane from b
+	static inline reg set(const float s0, const float s1, const float s2, const float s3) noexcept { return _mm_set_ps(s3, s2, s1, s0); }
+
+	static inline void transpose(reg & a, reg & b, reg & c, reg & d) noexcept { _MM_TRANSPOSE4_PS(a, b, c, d); }
+};
+
+
+// Specialisation for 3 variables (e.g. the full Jacobian of a 3D point), where the value and derivatives fill exactly one register.
+// The storage is aligned for it and all arithmetic is done on whole registers, with the same interface as the generic version.
+// Lanes are never written one at a time, as a scalar store followed by a register load of the same value stalls store forwarding.
+template <typename real_type>
+class Dual<real_type, 3> final
+{
+public:
+	using scalar_type = real_type;
+	using lanes = DualLanes<real_type>;
+
+	alignas(4 * sizeof(real_type)) real_type v[4];
+
+
+	inline Dual() noexcept { }
+
+	// Constant constructor
+	inline Dual(const real_type s) noexcept { lanes::store(v, lanes::set(s, 0, 0, 0)); }
+
+	// Constructor with derivative for var_idx'th variable
+	inline Dual(const real_type s, const int var_idx) noexcept
+	{
+		lanes::store(v, lanes::set(s, (real_type)(var_idx == 0), (real_type)(var_idx == 1), (real_type)(var_idx == 2)));
+	}
+
+	inline Dual(const Dual &) noexcept = default;
+
+	inline const Dual & operator=(const Dual & rhs) noexcept { lanes::store(v, lanes::load(rhs.v)); return *this; }
+
+	inline Dual operator-() const noexcept { Dual r; lanes::store(r.v, lanes::neg(lanes::load(v))); return r; }
+
+	inline Dual operator+(const Dual & rhs) const noexcept { Dual r; lanes::store(r.v, lanes::add(lanes::load(v), lanes::load(rhs.v))); return r; }
+	inline Dual operator-(const Dual & rhs) const noexcept { Dual r; lanes::store(r.v, lanes::sub(lanes::load(v), lanes::load(rhs.v))); return r; }
+
+	inline Dual operator+(const real_type rhs) const noexcept
+	{
+		const typename lanes::reg a = lanes::load(v);
+		Dual r;
+		lanes::store(r.v, lanes::withValue(a, lanes::add(a, lanes::set1(rhs))));
+		return r;
+	}
+
+	inline Dual operator-(const real_type rhs) const noexcept
+	{
+		const typename lanes::reg a = lanes::load(v);
+		Dual r;
+		lanes::store(r.v, lanes::withValue(a, lanes::sub(a, lanes::set1(rhs))));
+		return r;
+	}
+
+	inline const Dual & operator+=(const Dual &    rhs) noexcept { *this = *this + rhs; return *this; }
+	inline const Dual & operator+=(const real_type rhs) noexcept { *this = *this + rhs; return *this; }
+	inline const Dual & operator-=(const Dual &    rhs) noexcept { *this = *this - rhs; return *this; }
+	inline const Dual & operator-=(const real_type rhs) noexcept { *this = *this - rhs; return *this; }
+
+	inline Dual operator*(const real_type rhs) const noexcept { Dual r; lanes::store(r.v, lanes::mul(lanes::load(v), lanes::set1(rhs))); return r; }
+	inline Dual operator/(const real_type rhs) const noexcept { return *this * (1 / rhs); }
+
+	inline const Dual & operator*=(const Dual &    rhs) noexcept { *this = *this * rhs; return *this; }
+	inline const Dual & operator*=(const real_type rhs) noexcept { *this = *this * rhs; return *this; }
+	inline const Dual & operator/=(const Dual &    rhs) noexcept { *this = *this / rhs; return *this; }
+	inline const Dual & operator/=(const real_type rhs) noexcept { *this = *this * (1 / rhs); return *this; }
+
+	// Product rule, the value lane only gets v0 * rhs0 from the first product
+	inline Dual operator*(const Dual & rhs) const noexcept
+	{
+		const typename lanes::reg a = lanes::load(v);
+		const typename lanes::reg b = lanes::load(rhs.v);
+
+		Dual r;
+		lanes::store(r.v, lanes::add(lanes::mul(lanes::set1(v[0]), b), lanes::derivs(lanes::mul(a, lanes::set1(rhs.v[0])))));
+		return r;
+	}
+
+	// Quotient rule on the derivative lanes, the value lane is replaced
+	inline Dual operator/(const Dual & rhs) const noexcept
+	{
+		const real_type inv_v0 = 1 / rhs.v[0];
+		const real_type scale = inv_v0 * inv_v0;
+		const typename lanes::reg a = lanes::load(v);
+		const typename lanes::reg b = lanes::load(rhs.v);
+		const typename lanes::reg derivs = lanes::mul(lanes::sub(lanes::mul(a, lanes::set1(rhs.v[0])), lanes::mul(lanes::set1(v[0]), b)), lanes::set1(scale));
+
+		Dual r;
+		lanes::store(r.v, lanes::withValue(derivs, lanes::set1(v[0] * inv_v0)));
+		return r;
+	}
+};
+#endif
+
+using Dual1r = Dual<real, 1>;
+using Dual1f = Dual<float, 1>;
+using Dual1d = Dual<double, 1>;
+
 using Dual2r = Dual<real, 2>;
 using Dual2f = Dual<float, 2>;
 using Dual2d = Dual<double, 2>;
@@ -123,57 +283,135 @@ using Dual3f = Dual<float, 3>;
 using Dual3d = Dual<double, 3>;
 
 
+// Chain rule for a function of one variable, with value f and derivative df at d
 template <typename real_type, int vars>
-inline constexpr Dual<real_type, vars> pow(const Dual<real_type, vars> & d, const real_type e) noexcept
+inline constexpr Dual<real_type, vars> chain(const Dual<real_type, vars> & d, const real_type f, const real_type df) noexcept
 {
-	const real_type scale = std::pow(d.v[0], e - 1) * e;
+	Dual<real_type, vars> r;
+	r.v[0] = f;
+	for (int i = 0; i < vars; ++i)
+		r.v[i + 1] = d.v[i + 1] * df;
+	return r;
+}
+
 
+// Chain rule for a function of two variables, with value f and partial derivatives da and db at a and b
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> chain(const Dual<real_type, vars> & a, const Dual<real_type, vars> & b, const real_type f, const real_type da, const real_type db) noexcept
+{
 	Dual<real_type, vars> r;
-	r.v[0] = std::pow(d.v[0], e);
+	r.v[0] = f;
 	for (int i = 0; i < vars; ++i)
-		r.v[i + 1] = d.v[i + 1] * scale;
+		r.v[i + 1] = a.v[i + 1] * da + b.v[i + 1] * db;
 	return r;
 }
 
 
+#if DUAL_SIMD
+template <typename real_type>
+inline Dual<real_type, 3> chain(const Dual<real_type, 3> & d, const real_type f, const real_type df) noexcept
+{
+	using lanes = DualLanes<real_type>;
+
+	Dual<real_type, 3> r;
+	lanes::store(r.v, lanes::withValue(lanes::mul(lanes::load(d.v), lanes::set1(df)), lanes::set1(f)));
+	return r;
+}
+
+
+template <typename real_type>
+inline Dual<real_type, 3> chain(const Dual<real_type, 3> & a, const Dual<real_type, 3> & b, const real_type f, const real_type da, const real_type db) noexcept
+{
+	using lanes = DualLanes<real_type>;
+
+	Dual<real_type, 3> r;
+	lanes::store(r.v, lanes::withValue(lanes::add(lanes::mul(lanes::load(a.v), lanes::set1(da)), lanes::mul(lanes::load(b.v), lanes::set1(db))), lanes::set1(f)));
+	return r;
+}
+#endif
+
+
+// Scalar on the left hand side, to avoid promoting it to Dual
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> operator+(const typename Dual<real_type, vars>::scalar_type lhs, const Dual<real_type, vars> & rhs) noexcept
+{
+	return rhs + lhs;
+}
+
+
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> operator-(const typename Dual<real_type, vars>::scalar_type lhs, const Dual<real_type, vars> & rhs) noexcept
+{
+	return -rhs + lhs;
+}
+
+
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> operator*(const typename Dual<real_type, vars>::scalar_type lhs, const Dual<real_type, vars> & rhs) noexcept
+{
+	return rhs * lhs;
+}
+
+
+// Only needs the derivative of 1 / x, instead of the full quotient rule
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> operator/(const typename Dual<real_type, vars>::scalar_type lhs, const Dual<real_type, vars> & rhs) noexcept
+{
+	const real_type inv = 1 / rhs.v[0];
+	return chain(rhs, lhs * inv, -lhs * inv * inv);
+}
+
+
+// Fused: x^e is computed once and reused for the derivative e * x^(e - 1), except at 0
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> pow(const Dual<real_type, vars> & d, const typename Dual<real_type, vars>::scalar_type e) noexcept
+{
+	const real_type p = std::pow(d.v[0], e);
+	const real_type scale = (d.v[0] != 0) ? p / d.v[0] * e : std::pow(d.v[0], e - 1) * e;
+	return chain(d, p, scale);
+}
+
+
+// Both the base and the exponent varying, for a positive base: d(x^y) = x^y * (y' * log(x) + y * x' / x)
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> pow(const Dual<real_type, vars> & x, const Dual<real_type, vars> & y) noexcept
+{
+	const real_type p = std::pow(x.v[0], y.v[0]);
+	return chain(x, y, p, p * y.v[0] / x.v[0], p * std::log(x.v[0]));
+}
+
+
 // Optimised version of pow for square root
 template <typename real_type, int vars>
 inline constexpr Dual<real_type, vars> sqrt(const Dual<real_type, vars> & d) noexcept
 {
 	const real_type sqrt_v0 = std::sqrt(d.v[0]);
-	const real_type scale = static_cast<real_type>(0.5) / sqrt_v0;
-
-	Dual<real_type, vars> r;
-	r.v[0] = sqrt_v0;
-	for (int i = 0; i < vars; ++i)
-		r.v[i + 1] = d.v[i + 1] * scale;
-	return r;
+	return chain(d, sqrt_v0, static_cast<real_type>(0.5) / sqrt_v0);
 }
 
 
 template <typename real_type, int vars>
 inline constexpr Dual<real_type, vars> sin(const Dual<real_type, vars> & d) noexcept
 {
-	const real_type scale = std::cos(d.v[0]);
-
-	Dual<real_type, vars> r;
-	r.v[0] = std::sin(d.v[0]);
-	for (int i = 0; i < vars; ++i)
-		r.v[i + 1] = d.v[i + 1] * scale;
-	return r;
+	return chain(d, std::sin(d.v[0]), std::cos(d.v[0]));
 }
 
 
 template <typename real_type, int vars>
 inline constexpr Dual<real_type, vars> cos(const Dual<real_type, vars> & d) noexcept
 {
-	const real_type scale = -std::sin(d.v[0]);
+	return chain(d, std::cos(d.v[0]), -std::sin(d.v[0]));
+}
 
-	Dual<real_type, vars> r;
-	r.v[0] = std::cos(d.v[0]);
-	for (int i = 0; i < vars; ++i)
-		r.v[i + 1] = d.v[i + 1] * scale;
-	return r;
+
+// Fused sine and cosine, each is the other's derivative so they're only evaluated once
+template <typename real_type, int vars>
+inline constexpr void sincos(const Dual<real_type, vars> & d, Dual<real_type, vars> & sin_out, Dual<real_type, vars> & cos_out) noexcept
+{
+	const real_type s = std::sin(d.v[0]);
+	const real_type c = std::cos(d.v[0]);
+	sin_out = chain(d, s, c);
+	cos_out = chain(d, c, -s);
 }
 
 
@@ -181,13 +419,37 @@ template <typename real_type, int vars>
 inline constexpr Dual<real_type, vars> tan(const Dual<real_type, vars> & d) noexcept
 {
 	const real_type cos_v0 = std::cos(d.v[0]);
-	const real_type scale = 1 / (cos_v0 * cos_v0);
+	return chain(d, std::tan(d.v[0]), 1 / (cos_v0 * cos_v0));
+}
 
-	Dual<real_type, vars> r;
-	r.v[0] = std::tan(d.v[0]);
-	for (int i = 0; i < vars; ++i)
-		r.v[i + 1] = d.v[i + 1] * scale;
-	return r;
+
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> asin(const Dual<real_type, vars> & d) noexcept
+{
+	return chain(d, std::asin(d.v[0]), 1 / std::sqrt(1 - d.v[0] * d.v[0]));
+}
+
+
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> acos(const Dual<real_type, vars> & d) noexcept
+{
+	return chain(d, std::acos(d.v[0]), -1 / std::sqrt(1 - d.v[0] * d.v[0]));
+}
+
+
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> atan(const Dual<real_type, vars> & d) noexcept
+{
+	return chain(d, std::atan(d.v[0]), 1 / (1 + d.v[0] * d.v[0]));
+}
+
+
+// Fused: d atan2(y, x) = (x * y' - y * x') / (x^2 + y^2)
+template <typename real_type, int vars>
+inline constexpr Dual<real_type, vars> atan2(const Dual<real_type, vars> & y, const Dual<real_type, vars> & x) noexcept
+{
+	const real_type inv_r2 = 1 / (x.v[0] * x.v[0] + y.v[0] * y.v[0]);
+	return chain(y, x, std::atan2(y.v[0], x.v[0]), x.v[0] * inv_r2, -y.v[0] * inv_r2);
 }
 
 
@@ -206,7 +468,7 @@ inline constexpr Dual<real_type, vars> clamp(const Dual<real_type, vars> & p, co
 
 
 template <typename real_type, int vars>
-inline constexpr Dual<real_type, vars> clamp(const Dual<real_type, vars> & p, const real_type min_val, const real_type max_val) noexcept
+inline constexpr Dual<real_type, vars> clamp(const Dual<real_type, vars> & p, const typename Dual<real_type, vars>::scalar_type min_val, const typename Dual<real_type, vars>::scalar_type max_val) noexcept
 {
 	return min(max(p, max_val), min_val);
 }
@@ -220,7 +482,7 @@ inline constexpr Dual<real_type, vars> min(const Dual<real_type, vars> & p, cons
 
 
 template <typename real_type, int vars>
-inline constexpr Dual<real_type, vars> min(const Dual<real_type, vars> & p, const real_type & min_val) noexcept
+inline constexpr Dual<real_type, vars> min(const Dual<real_type, vars> & p, const typename Dual<real_type, vars>::scalar_type & min_val) noexcept
 {
 	return (p.v[0] < min_val) ? p : min_val; // Note: zero derivs left of min_val
 }
@@ -234,7 +496,7 @@ inline constexpr Dual<real_type, vars> max(const Dual<real_type, vars> & p, cons
 
 
 template <typename real_type, int vars>
-inline constexpr Dual<real_type, vars> max(const Dual<real_type, vars> & p, const real_type & max_val) noexcept
+inline constexpr Dual<real_type, vars> max(const Dual<real_type, vars> & p, const typename Dual<real_type, vars>::scalar_type & max_val) noexcept
 {
 	return (p.v[0] > max_val) ? p : max_val; // Note: zero derivs right of max_val
 }
@@ -255,7 +517,7 @@ inline constexpr Dual<real_type, vars> ceil(const Dual<real_type, vars> & p) noe
 
 
 template <typename real_type, int vars>
-inline constexpr Dual<real_type, vars> fmod(const Dual<real_type, vars> & p, const real_type & modulo) noexcept
+inline constexpr Dual<real_type, vars> fmod(const Dual<real_type, vars> & p, const typename Dual<real_type, vars>::scalar_type & modulo) noexcept
 {
 	return p - floor(p.v[0] / modulo) * modulo;
 }
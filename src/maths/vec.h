@@ -69,13 +69,13 @@ inline real_type dot(const vec<n, real_type> & lhs, const vec<n, real_type> & rh
 }
 
 
-// Optimised method for Dual dot product with real-vector RHS
-template<int n, typename real_type>
-inline real dot(const vec<n, Dual<real_type, n>> & lhs, const vec<n, real> & rhs)
+// Optimised method for Dual dot product with real-vector RHS, which may be of a different precision
+template<int n, typename real_type, int vars, typename rhs_real_type, std::enable_if_t<std::is_arithmetic_v<rhs_real_type>, int> = 0>
+inline real_type dot(const vec<n, Dual<real_type, vars>> & lhs, const vec<n, rhs_real_type> & rhs)
 {
-	real d = 0;
+	real_type d = 0;
 	for (int i = 0; i < n; ++i)
-		d += lhs.e[i].v[0] * rhs.e[i];
+		d += lhs.e[i].v[0] * static_cast<real_type>(rhs.e[i]);
 	return d;
 }
 
@@ -90,8 +90,8 @@ inline real_type length2(const vec<n, real_type> & v)
 }
 
 
-template<int n, typename real_type>
-inline real_type length2(const vec<n, Dual<real_type, 3>> & v)
+template<int n, typename real_type, int vars>
+inline real_type length2(const vec<n, Dual<real_type, vars>> & v)
 {
 	real_type d = 0;
 	for (int i = 0; i < n; ++i)
@@ -104,8 +104,8 @@ template<int n, typename real_type>
 inline real_type length(const vec<n, real_type> & v) { return std::sqrt(length2(v)); }
 
 
-template<int n, typename real_type>
-inline real_type length(const vec<n, Dual<real_type, 3>> & v) { return std::sqrt(length2(v)); }
+template<int n, typename real_type, int vars>
+inline real_type length(const vec<n, Dual<real_type, vars>> & v) { return std::sqrt(length2(v)); }
 
 
 template<int n, typename real_type>
@@ -140,3 +140,8 @@ using vec3d = vec<3, double>;
 using DualVec3r = vec<3, Dual3r>;
 using DualVec3f = vec<3, Dual3f>;
 using DualVec3d = vec<3, Dual3d>;
+
+// Single variable duals, e.g. for derivatives along a ray direction
+using Dual1Vec3r = vec<3, Dual1r>;
+using Dual1Vec3f = vec<3, Dual1f>;
+using Dual1Vec3d = vec<3, Dual1d>;
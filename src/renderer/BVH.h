@@ -0,0 +1,428 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#include "scene_objects/SceneObject.h"
+
+
+
+// Bounding volume hierarchy over the bounding spheres of the scene objects, built with the binned surface area heuristic (SAH).
+// The BVH doesn't own the objects, it has to be rebuilt if the object list changes.
+struct BVH
+{
+	struct Node
+	{
+		vec3r box_min, box_max;
+		int first; // Index of the first of the two child nodes for interior nodes, or of the first object for leaves
+		int count; // Number of objects in a leaf, 0 for interior nodes
+	};
+
+	std::vector<Node> nodes; // Root is at index 0
+	std::vector<const SceneObject *> leaf_objects; // Objects in leaf order
+
+
+	void build(const std::vector<SceneObject *> & objects, const int num_threads = 1)
+	{
+		nodes.clear();
+		leaf_objects.clear();
+		if (objects.empty())
+			return;
+
+		std::vector<BuildObject> build_objs(objects.size());
+		for (size_t i = 0; i < objects.size(); ++i)
+		{
+			vec3r centre;
+			real radius;
+			objects[i]->getBoundingSphere(centre, radius);
+
+			build_objs[i].box_min = centre - vec3r(radius);
+			build_objs[i].box_max = centre + vec3r(radius);
+			build_objs[i].centroid = centre;
+			build_objs[i].obj_idx = (int)i;
+		}
+
+		nodes.resize(1);
+		buildRecursive(nodes, 0, build_objs, 0, (int)build_objs.size(), std::max(1, num_threads));
+
+		leaf_objects.resize(build_objs.size());
+		for (size_t i = 0; i < build_objs.size(); ++i)
+			leaf_objects[i] = objects[build_objs[i].obj_idx];
+	}
+
+	std::pair<const SceneObject *, real> nearestIntersection(const Ray & r) const noexcept
+	{
+		const SceneObject * nearest_obj = nullptr;
+		real nearest_t = real_inf;
+		if (nodes.empty())
+			return { nearest_obj, nearest_t };
+
+		const vec3r inv_d = inverseDir(r.d);
+
+		int stack[max_depth];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0)
+		{
+			const Node & node = nodes[stack[--stack_size]];
+			if (intersectBox(node, r.o, inv_d, nearest_t) == real_inf)
+				continue;
+
+			if (node.count > 0)
+			{
+				for (int i = node.first; i < node.first + node.count; ++i)
+				{
+					const real hit_t = leaf_objects[i]->intersect(r);
+					if (hit_t > ray_epsilon && hit_t < nearest_t)
+					{
+						nearest_obj = leaf_objects[i];
+						nearest_t = hit_t;
+					}
+				}
+			}
+			else
+			{
+				// Visit the nearer child first, so that further subtrees can be culled by the nearest hit
+				const real t_a = intersectBox(nodes[node.first    ], r.o, inv_d, nearest_t);
+				const real t_b = intersectBox(nodes[node.first + 1], r.o, inv_d, nearest_t);
+				const int near_idx = (t_a <= t_b) ? node.first : node.first + 1;
+				const int far_idx  = (t_a <= t_b) ? node.first + 1 : node.first;
+				if (std::max(t_a, t_b) != real_inf) stack[stack_size++] = far_idx;
+				if (std::min(t_a, t_b) != real_inf) stack[stack_size++] = near_idx;
+			}
+		}
+
+		return { nearest_obj, nearest_t };
+	}
+
+	// Any-hit query, returns true as soon as an intersection closer than max_t is found
+	bool occluded(const Ray & r, const real max_t) const noexcept
+	{
+		if (nodes.empty())
+			return false;
+
+		const vec3r inv_d = inverseDir(r.d);
+
+		int stack[max_depth];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0)
+		{
+			const Node & node = nodes[stack[--stack_size]];
+			if (intersectBox(node, r.o, inv_d, max_t) == real_inf)
+				continue;
+
+			if (node.count > 0)
+			{
+				for (int i = node.first; i < node.first + node.count; ++i)
+					if (leaf_objects[i]->occluded(r, max_t))
+						return true;
+			}
+			else
+			{
+				stack[stack_size++] = node.first + 1;
+				stack[stack_size++] = node.first;
+			}
+		}
+
+		return false;
+	}
+
+	// Any-hit query for a packet, rays that are found to be occluded are left out of further object tests
+	void occludedPacket(const RayPacket & packet, const real * max_t, bool * occluded_out) const noexcept
+	{
+		for (int i = 0; i < packet.num_rays; ++i)
+			occluded_out[i] = false;
+		if (nodes.empty())
+			return;
+
+		vec3r inv_d[packet_size];
+		for (int i = 0; i < packet.num_rays; ++i)
+			inv_d[i] = inverseDir(packet.d[i]);
+
+		int stack[max_depth];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0)
+		{
+			const Node & node = nodes[stack[--stack_size]];
+
+			// Gather the rays that can still be occluded within this node
+			RayPacket sub_packet;
+			real sub_max_t[packet_size];
+			int sub_idx[packet_size];
+			sub_packet.num_rays = 0;
+			for (int i = 0; i < packet.num_rays; ++i)
+				if (!occluded_out[i] && intersectBox(node, packet.o[i], inv_d[i], max_t[i]) != real_inf)
+				{
+					const int j = sub_packet.num_rays++;
+					sub_packet.o[j] = packet.o[i];
+					sub_packet.d[j] = packet.d[i];
+					sub_packet.t_start[j] = packet.t_start[i];
+					sub_packet.cone_spread[j] = packet.cone_spread[i];
+					sub_max_t[j] = max_t[i];
+					sub_idx[j] = i;
+				}
+			if (sub_packet.num_rays == 0)
+				continue;
+
+			if (node.count > 0)
+			{
+				for (int k = node.first; k < node.first + node.count; ++k)
+				{
+					bool sub_occluded[packet_size];
+					leaf_objects[k]->occludedPacket(sub_packet, sub_max_t, sub_occluded);
+
+					// Compact the rays that are still unoccluded for the next object
+					int num_remaining = 0;
+					for (int j = 0; j < sub_packet.num_rays; ++j)
+					{
+						if (sub_occluded[j])
+						{
+							occluded_out[sub_idx[j]] = true;
+							continue;
+						}
+
+						sub_packet.o[num_remaining] = sub_packet.o[j];
+						sub_packet.d[num_remaining] = sub_packet.d[j];
+						sub_packet.t_start[num_remaining] = sub_packet.t_start[j];
+						sub_packet.cone_spread[num_remaining] = sub_packet.cone_spread[j];
+						sub_max_t[num_remaining] = sub_max_t[j];
+						sub_idx[num_remaining] = sub_idx[j];
+						num_remaining++;
+					}
+					sub_packet.num_rays = num_remaining;
+					if (num_remaining == 0)
+						break;
+				}
+			}
+			else
+			{
+				stack[stack_size++] = node.first + 1;
+				stack[stack_size++] = node.first;
+			}
+		}
+	}
+
+	// Traverse with a whole packet, visiting each node that any of the rays could still hit closer than its nearest hit
+	void nearestIntersectionPacket(const RayPacket & packet, std::pair<const SceneObject *, real> * hits_out) const noexcept
+	{
+		for (int i = 0; i < packet.num_rays; ++i)
+			hits_out[i] = { nullptr, real_inf };
+		if (nodes.empty())
+			return;
+
+		vec3r inv_d[packet_size];
+		for (int i = 0; i < packet.num_rays; ++i)
+			inv_d[i] = inverseDir(packet.d[i]);
+
+		int stack[max_depth];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0)
+		{
+			const Node & node = nodes[stack[--stack_size]];
+
+			bool any_hit = false;
+			for (int i = 0; i < packet.num_rays && !any_hit; ++i)
+				any_hit = intersectBox(node, packet.o[i], inv_d[i], hits_out[i].second) != real_inf;
+			if (!any_hit)
+				continue;
+
+			if (node.count > 0)
+			{
+				for (int j = node.first; j < node.first + node.count; ++j)
+				{
+					real hit_t[packet_size];
+					leaf_objects[j]->intersectPacket(packet, hit_t);
+
+					for (int i = 0; i < packet.num_rays; ++i)
+						if (hit_t[i] > ray_epsilon && hit_t[i] < hits_out[i].second)
+							hits_out[i] = { leaf_objects[j], hit_t[i] };
+				}
+			}
+			else
+			{
+				stack[stack_size++] = node.first + 1;
+				stack[stack_size++] = node.first;
+			}
+		}
+	}
+
+private:
+	constexpr static int max_depth = 64; // Traversal stack size, which also limits the depth of the tree
+	constexpr static int max_leaf_objects = 4;
+	constexpr static int num_bins = 16;
+	constexpr static int parallel_build_objects = 1024; // Only build subtrees in separate threads when they are big enough
+	constexpr static real traversal_cost = 0.125f; // Cost of a node traversal relative to an object intersection
+
+	struct BuildObject
+	{
+		vec3r box_min, box_max;
+		vec3r centroid;
+		int obj_idx;
+	};
+
+	struct Bin
+	{
+		vec3r box_min = real_inf, box_max = -real_inf;
+		int count = 0;
+	};
+
+
+	static vec3r inverseDir(const vec3r & d) noexcept
+	{
+		return { 1 / d.x(), 1 / d.y(), 1 / d.z() };
+	}
+
+	// Slab test, returns the entry distance if the box is hit within [0, max_t], otherwise infinity
+	static real intersectBox(const Node & node, const vec3r & o, const vec3r & inv_d, const real max_t) noexcept
+	{
+		real t0 = 0, t1 = max_t;
+		for (int a = 0; a < 3; ++a)
+		{
+			const real t_near = (node.box_min.e[a] - o.e[a]) * inv_d.e[a];
+			const real t_far  = (node.box_max.e[a] - o.e[a]) * inv_d.e[a];
+			t0 = std::max(t0, std::min(t_near, t_far));
+			t1 = std::min(t1, std::max(t_near, t_far));
+		}
+		return (t0 <= t1) ? t0 : real_inf;
+	}
+
+	static real surfaceArea(const vec3r & box_min, const vec3r & box_max) noexcept
+	{
+		const vec3r e = box_max - box_min;
+		return 2 * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+	}
+
+	// Build the subtree for objects [begin, end) into nodes[node_idx], appending any child nodes to nodes
+	static void buildRecursive(std::vector<Node> & nodes, const int node_idx, std::vector<BuildObject> & objs,
+		const int begin, const int end, const int num_threads, const int depth = 1)
+	{
+		vec3r box_min = real_inf, box_max = -real_inf;
+		vec3r centroid_min = real_inf, centroid_max = -real_inf;
+		for (int i = begin; i < end; ++i)
+			for (int a = 0; a < 3; ++a)
+			{
+				box_min.e[a] = std::min(box_min.e[a], objs[i].box_min.e[a]);
+				box_max.e[a] = std::max(box_max.e[a], objs[i].box_max.e[a]);
+				centroid_min.e[a] = std::min(centroid_min.e[a], objs[i].centroid.e[a]);
+				centroid_max.e[a] = std::max(centroid_max.e[a], objs[i].centroid.e[a]);
+			}
+
+		nodes[node_idx] = { box_min, box_max, begin, end - begin };
+
+		const int count = end - begin;
+		if (count <= 1 || depth >= max_depth - 1)
+			return;
+
+		const int mid = findSplit(objs, begin, end, box_min, box_max, centroid_min, centroid_max);
+		if (mid < 0)
+			return; // Making a leaf is cheaper than any split
+
+		const int children_idx = (int)nodes.size();
+		nodes[node_idx].first = children_idx;
+		nodes[node_idx].count = 0;
+		nodes.resize(children_idx + 2);
+
+		if (num_threads > 1 && count >= parallel_build_objects)
+		{
+			// Build the left subtree into a separate node list in another thread, then relocate it
+			std::vector<Node> left_nodes(1);
+			std::thread left_thread(&BVH::buildRecursive, std::ref(left_nodes), 0, std::ref(objs), begin, mid, num_threads / 2, depth + 1);
+			buildRecursive(nodes, children_idx + 1, objs, mid, end, num_threads - num_threads / 2, depth + 1);
+			left_thread.join();
+
+			// Left node i > 0 goes to offset + i - 1, the left root goes to children_idx
+			const int offset = (int)nodes.size();
+			const auto relocate = [&](Node n) { if (n.count == 0) n.first += offset - 1; return n; };
+			nodes[children_idx] = relocate(left_nodes[0]);
+			for (size_t i = 1; i < left_nodes.size(); ++i)
+				nodes.push_back(relocate(left_nodes[i]));
+		}
+		else
+		{
+			buildRecursive(nodes, children_idx,     objs, begin, mid, num_threads, depth + 1);
+			buildRecursive(nodes, children_idx + 1, objs, mid,   end, num_threads, depth + 1);
+		}
+	}
+
+	// Find the SAH split along the widest centroid axis and partition the objects,
+	// returns the index of the first object of the right half, or -1 if a leaf should be made instead
+	static int findSplit(std::vector<BuildObject> & objs, const int begin, const int end,
+		const vec3r & box_min, const vec3r & box_max, const vec3r & centroid_min, const vec3r & centroid_max)
+	{
+		const int count = end - begin;
+		const vec3r extent = centroid_max - centroid_min;
+		const int axis = (extent.x() > extent.y() && extent.x() > extent.z()) ? 0 : (extent.y() > extent.z()) ? 1 : 2;
+
+		if (extent.e[axis] <= 0)
+		{
+			// All centroids coincide so SAH can't separate them, just split in the middle if the leaf would be too big
+			return (count > max_leaf_objects) ? begin + count / 2 : -1;
+		}
+
+		const real bin_scale = num_bins / extent.e[axis];
+		const auto getBin = [&](const BuildObject & o) { return std::min(num_bins - 1, (int)((o.centroid.e[axis] - centroid_min.e[axis]) * bin_scale)); };
+
+		Bin bins[num_bins];
+		for (int i = begin; i < end; ++i)
+		{
+			Bin & b = bins[getBin(objs[i])];
+			b.count++;
+			for (int a = 0; a < 3; ++a)
+			{
+				b.box_min.e[a] = std::min(b.box_min.e[a], objs[i].box_min.e[a]);
+				b.box_max.e[a] = std::max(b.box_max.e[a], objs[i].box_max.e[a]);
+			}
+		}
+
+		// Sweep from the right to get the area and count to the right of each split plane
+		real right_area[num_bins];
+		int right_count[num_bins];
+		Bin acc;
+		for (int i = num_bins - 1; i > 0; --i)
+		{
+			acc.count += bins[i].count;
+			for (int a = 0; a < 3; ++a)
+			{
+				acc.box_min.e[a] = std::min(acc.box_min.e[a], bins[i].box_min.e[a]);
+				acc.box_max.e[a] = std::max(acc.box_max.e[a], bins[i].box_max.e[a]);
+			}
+			right_area[i] = (acc.count > 0) ? surfaceArea(acc.box_min, acc.box_max) : 0;
+			right_count[i] = acc.count;
+		}
+
+		// Sweep from the left and find the cheapest split plane
+		real best_cost = real_inf;
+		int best_split = -1;
+		acc = Bin();
+		for (int i = 1; i < num_bins; ++i)
+		{
+			acc.count += bins[i - 1].count;
+			for (int a = 0; a < 3; ++a)
+			{
+				acc.box_min.e[a] = std::min(acc.box_min.e[a], bins[i - 1].box_min.e[a]);
+				acc.box_max.e[a] = std::max(acc.box_max.e[a], bins[i - 1].box_max.e[a]);
+			}
+			if (acc.count == 0 || right_count[i] == 0)
+				continue;
+
+			const real cost = surfaceArea(acc.box_min, acc.box_max) * acc.count + right_area[i] * right_count[i];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_split = i;
+			}
+		}
+
+		const real leaf_cost = surfaceArea(box_min, box_max) * count;
+		const real split_cost = surfaceArea(box_min, box_max) * traversal_cost + best_cost;
+		if (best_split < 0 || (split_cost >= leaf_cost && count <= max_leaf_objects))
+			return -1;
+
+		const auto mid = std::partition(objs.begin() + begin, objs.begin() + end, [&](const BuildObject & o) { return getBin(o) < best_split; });
+		return (int)(mid - objs.begin());
+	}
+};
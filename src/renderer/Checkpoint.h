@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "util/MappedFile.h"
+
+#include "Renderer.h"
+
+
+
+// Binary snapshot of the accumulation buffers for a range of passes, so that an interrupted render can be resumed,
+// or partial renders of disjoint pass ranges from several nodes can be summed.
+// The file is a fixed header followed by the raw RenderOutput buffers, in native byte order since it's only meant
+// to be read back by the same build on the same kind of machine.
+namespace Checkpoint
+{
+	constexpr uint32_t magic = 0x4B435446; // "FTCK"
+	constexpr uint32_t version = 2;
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		int32_t xres, yres;
+		int32_t first_pass, end_pass; // Range of passes accumulated, rendering resumes from end_pass
+		uint64_t fingerprint; // Scene and render settings, so a checkpoint isn't resumed with a different setup
+	};
+
+
+	inline size_t bufferSize(const int xres, const int yres) noexcept
+	{
+		return (size_t)xres * yres * (3 * sizeof(vec3f) + sizeof(float) + 2 * sizeof(int));
+	}
+
+	// Write to a temporary file and then rename it over the old checkpoint, so a crash while saving never loses the previous one
+	inline bool save(const char * filename, const RenderOutput & output, const int first_pass, const int end_pass, const uint64_t fingerprint)
+	{
+		const size_t n = (size_t)output.xres * output.yres;
+		const std::string temp_filename = std::string(filename) + ".tmp";
+		{
+			MappedFile file;
+			if (!file.create(temp_filename.c_str(), sizeof(Header) + bufferSize(output.xres, output.yres)))
+				return false;
+
+			const Header header = { magic, version, output.xres, output.yres, first_pass, end_pass, fingerprint };
+			uint8_t * p = file.data;
+			memcpy(p, &header, sizeof(Header));                   p += sizeof(Header);
+			memcpy(p, &output.beauty[0], n * sizeof(vec3f));      p += n * sizeof(vec3f);
+			memcpy(p, &output.normal[0], n * sizeof(vec3f));      p += n * sizeof(vec3f);
+			memcpy(p, &output.albedo[0], n * sizeof(vec3f));      p += n * sizeof(vec3f);
+			memcpy(p, &output.beauty_lum2[0], n * sizeof(float)); p += n * sizeof(float);
+			memcpy(p, &output.pixel_passes[0], n * sizeof(int)); p += n * sizeof(int);
+			memcpy(p, &output.hit_passes[0], n * sizeof(int));
+		}
+
+#if _WIN32
+		remove(filename); // Windows rename doesn't replace existing files
+#endif
+		return rename(temp_filename.c_str(), filename) == 0;
+	}
+
+	// Load a checkpoint into output and get its pass range, returns false if it's missing or doesn't match
+	inline bool load(const char * filename, RenderOutput & output, int & first_pass_out, int & end_pass_out, const uint64_t fingerprint)
+	{
+		FILE * const f = fopen(filename, "rb");
+		if (f == nullptr)
+			return false;
+
+		Header header;
+		const size_t n = (size_t)output.xres * output.yres;
+		bool ok = fread(&header, sizeof(Header), 1, f) == 1 &&
+			header.magic == magic && header.version == version &&
+			header.xres == output.xres && header.yres == output.yres &&
+			header.fingerprint == fingerprint;
+
+		ok = ok &&
+			fread(&output.beauty[0], sizeof(vec3f), n, f) == n &&
+			fread(&output.normal[0], sizeof(vec3f), n, f) == n &&
+			fread(&output.albedo[0], sizeof(vec3f), n, f) == n &&
+			fread(&output.beauty_lum2[0], sizeof(float), n, f) == n &&
+			fread(&output.pixel_passes[0], sizeof(int), n, f) == n &&
+			fread(&output.hit_passes[0], sizeof(int), n, f) == n;
+		fclose(f);
+
+		if (!ok)
+		{
+			output.clear();
+			return false;
+		}
+
+		first_pass_out = header.first_pass;
+		end_pass_out = header.end_pass;
+		return true;
+	}
+}
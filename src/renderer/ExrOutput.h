@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "util/MappedFile.h"
+
+#include "Renderer.h"
+
+
+
+// Writes all RenderOutput channels averaged over the passes into a single uncompressed scanline OpenEXR file.
+// Channels (in the alphabetical order EXR requires):
+//  B, G, R:                      beauty                  FLOAT
+//  albedo.B, albedo.G, albedo.R: first hit albedo        FLOAT
+//  normal.X, normal.Y, normal.Z: first hit normal        FLOAT, world space in [-1, 1] and 0 where nothing was hit
+//  passes:                       passes for this pixel   UINT
+// The file is mapped into memory and the pixels are written straight from the render buffers.
+// Assumes a little-endian machine, like the EXR format itself.
+// Ref: https://openexr.com/en/latest/OpenEXRFileLayout.html
+namespace ExrOutput
+{
+	enum PixelType : int32_t { pixel_uint = 0, pixel_half = 1, pixel_float = 2 };
+
+	struct ChannelInfo
+	{
+		const char * name;
+		PixelType type;
+	};
+
+	constexpr int num_channels = 10;
+	constexpr ChannelInfo channels[num_channels] =
+	{
+		{ "B",        pixel_float },
+		{ "G",        pixel_float },
+		{ "R",        pixel_float },
+		{ "albedo.B", pixel_float },
+		{ "albedo.G", pixel_float },
+		{ "albedo.R", pixel_float },
+		{ "normal.X", pixel_float },
+		{ "normal.Y", pixel_float },
+		{ "normal.Z", pixel_float },
+		{ "passes",   pixel_uint  }
+	};
+
+
+	template <typename T>
+	inline void append(std::vector<uint8_t> & bytes, const T & v)
+	{
+		const uint8_t * const p = (const uint8_t *)&v;
+		bytes.insert(bytes.end(), p, p + sizeof(T));
+	}
+
+	inline void appendString(std::vector<uint8_t> & bytes, const char * s)
+	{
+		bytes.insert(bytes.end(), s, s + strlen(s) + 1);
+	}
+
+	inline void appendAttribute(std::vector<uint8_t> & bytes, const char * name, const char * type, const std::vector<uint8_t> & value)
+	{
+		appendString(bytes, name);
+		appendString(bytes, type);
+		append(bytes, (int32_t)value.size());
+		bytes.insert(bytes.end(), value.begin(), value.end());
+	}
+
+	inline std::vector<uint8_t> makeHeader(const int xres, const int yres)
+	{
+		std::vector<uint8_t> header;
+		append(header, (uint32_t)20000630); // Magic number
+		append(header, (uint32_t)2); // Version 2, single part scanline file
+
+		std::vector<uint8_t> chlist;
+		for (const ChannelInfo & c : channels)
+		{
+			appendString(chlist, c.name);
+			append(chlist, (int32_t)c.type);
+			append(chlist, (uint32_t)0); // pLinear and reserved bytes
+			append(chlist, (int32_t)1); // x sampling
+			append(chlist, (int32_t)1); // y sampling
+		}
+		chlist.push_back(0);
+		appendAttribute(header, "channels", "chlist", chlist);
+
+		appendAttribute(header, "compression", "compression", { 0 }); // NO_COMPRESSION
+
+		std::vector<uint8_t> window;
+		append(window, (int32_t)0);
+		append(window, (int32_t)0);
+		append(window, (int32_t)(xres - 1));
+		append(window, (int32_t)(yres - 1));
+		appendAttribute(header, "dataWindow",    "box2i", window);
+		appendAttribute(header, "displayWindow", "box2i", window);
+
+		appendAttribute(header, "lineOrder", "lineOrder", { 0 }); // INCREASING_Y
+
+		std::vector<uint8_t> aspect;
+		append(aspect, 1.0f);
+		appendAttribute(header, "pixelAspectRatio", "float", aspect);
+
+		std::vector<uint8_t> centre;
+		append(centre, 0.0f);
+		append(centre, 0.0f);
+		appendAttribute(header, "screenWindowCenter", "v2f", centre);
+
+		std::vector<uint8_t> width;
+		append(width, 1.0f);
+		appendAttribute(header, "screenWindowWidth", "float", width);
+
+		header.push_back(0); // End of header
+		return header;
+	}
+
+
+	// Returns false if the file couldn't be created
+	inline bool save(const char * filename, const RenderOutput & output)
+	{
+		const int xres = output.xres;
+		const int yres = output.yres;
+
+		const std::vector<uint8_t> header = makeHeader(xres, yres);
+		const size_t line_data_size = (size_t)xres * num_channels * 4; // All channel types are 4 bytes
+		const size_t line_block_size = 8 + line_data_size; // y coordinate and data size, then pixel data
+		const size_t offsets_start = header.size();
+		const size_t lines_start = offsets_start + 8 * (size_t)yres;
+		const size_t file_size = lines_start + line_block_size * yres;
+
+		MappedFile file;
+		if (!file.create(filename, file_size))
+			return false;
+
+		uint8_t * const data = file.data;
+		memcpy(data, header.data(), header.size());
+
+		for (int y = 0; y < yres; ++y)
+		{
+			// Line offset table entry
+			const uint64_t line_offset = lines_start + line_block_size * y;
+			memcpy(data + offsets_start + 8 * (size_t)y, &line_offset, 8);
+
+			uint8_t * const line = data + line_offset;
+			const int32_t line_y = y, data_size = (int32_t)line_data_size;
+			memcpy(line + 0, &line_y, 4);
+			memcpy(line + 4, &data_size, 4);
+
+			// Each channel is stored as a contiguous run of xres values. The header has no fixed length, so the
+			// pixel data isn't aligned and every value is copied in.
+			uint8_t * const pixels = line + 8;
+			const auto put = [&](const int channel, const int x, const auto v) { memcpy(pixels + ((size_t)channel * xres + x) * 4, &v, 4); };
+			for (int x = 0; x < xres; ++x)
+			{
+				const int pixel_idx = y * xres + x;
+				const int passes = output.pixel_passes[pixel_idx];
+				const float scale = 1.0f / std::max(1, passes);
+
+				const vec3f beauty = output.beauty[pixel_idx] * scale;
+				const vec3f albedo = output.albedo[pixel_idx] * scale;
+				const vec3f normal = output.normal[pixel_idx] * scale;
+				put(0, x, beauty.z());
+				put(1, x, beauty.y());
+				put(2, x, beauty.x());
+				put(3, x, albedo.z());
+				put(4, x, albedo.y());
+				put(5, x, albedo.x());
+				put(6, x, normal.x());
+				put(7, x, normal.y());
+				put(8, x, normal.z());
+				put(9, x, (uint32_t)passes);
+			}
+		}
+
+		return true;
+	}
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "util/stb_image_write.h"
+
+#include "Renderer.h"
+#include "Tonemap.h"
+#include "ExrOutput.h"
+#include "Checkpoint.h"
+
+
+
+// Asynchronous output stage: rendered frames are queued and then tonemapped and saved as PNGs (and optionally EXRs) by background threads,
+// so that the render threads can get on with the next frame. A fixed set of output buffers keeps memory bounded:
+// acquire() blocks while all of them are still waiting to be encoded. They're only allocated when first acquired.
+struct FrameEncoder
+{
+	bool save_normal = false;
+	bool save_albedo = false;
+	bool save_exr = false; // Also save all channels unclamped into a multichannel float EXR
+	bool save_steps_heatmap = false; // Also save camera ray march steps per pixel as a heatmap, only with ENABLE_RENDER_STATS
+
+	std::string checkpoint_filename; // Where submitted checkpoints are written, set before submitting any
+	uint64_t checkpoint_fingerprint = 0;
+
+
+	FrameEncoder(const int xres_, const int yres_, const int num_buffers_ = 2, const int num_encoders = 1) : xres(xres_), yres(yres_), num_buffers(num_buffers_)
+	{
+		encoders.resize(num_encoders);
+		for (std::thread & t : encoders) t = std::thread(&FrameEncoder::encoderFunction, this);
+	}
+
+	// Encode any remaining frames before exiting
+	~FrameEncoder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		queue_cv.notify_all();
+
+		for (std::thread & t : encoders) t.join();
+	}
+
+	FrameEncoder(const FrameEncoder &) = delete;
+	FrameEncoder & operator=(const FrameEncoder &) = delete;
+
+	// Get a free output buffer to render into, waiting for an encoder to finish with one if needed
+	RenderOutput & acquire()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (free_buffers.empty() && (int)buffers.size() < num_buffers)
+		{
+			buffers.push_back(std::make_unique<RenderOutput>(xres, yres));
+			free_buffers.push_back(buffers.back().get());
+		}
+		free_cv.wait(lock, [&]() { return !free_buffers.empty(); });
+
+		RenderOutput * const output = free_buffers.back();
+		free_buffers.pop_back();
+		return *output;
+	}
+
+	// Queue an acquired buffer for encoding, it's returned to the free list once saved.
+	// With checkpoint set the buffers are also saved to the checkpoint file, to resume from the given number of passes.
+	void submit(RenderOutput & output, const int frame, const int passes, const bool checkpoint = false)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back({ &output, frame, passes, checkpoint });
+		}
+		queue_cv.notify_one();
+	}
+
+	// Wait until all submitted frames have been saved
+	void flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		free_cv.wait(lock, [&]() { return queue.empty() && num_encoding == 0; });
+	}
+
+private:
+	struct Job
+	{
+		RenderOutput * output;
+		int frame, passes;
+		bool checkpoint;
+	};
+
+	void encoderFunction()
+	{
+		std::vector<sRGBPixel> image_LDR;
+		std::vector<vec3f> normal_display;
+		while (true)
+		{
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queue_cv.wait(lock, [&]() { return quit || !queue.empty(); });
+				if (queue.empty())
+					return; // Only quit once the queue is drained
+
+				job = queue.front();
+				queue.pop_front();
+				num_encoding++;
+			}
+
+			const RenderOutput & output = *job.output;
+			image_LDR.resize(output.xres * output.yres);
+			saveTonemapped(image_LDR, "beauty", job, output.beauty);
+			if (save_normal) saveTonemapped(image_LDR, "normal", job, displayNormals(output, normal_display));
+			if (save_albedo) saveTonemapped(image_LDR, "albedo", job, output.albedo);
+			if (save_exr) saveEXR(job);
+#if ENABLE_RENDER_STATS
+			if (save_steps_heatmap) saveHeatmap(image_LDR, job);
+#endif
+			if (job.checkpoint) saveCheckpoint(job);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				free_buffers.push_back(job.output);
+				num_encoding--;
+			}
+			free_cv.notify_all();
+		}
+	}
+
+	// Map the summed normals to colours with Y and Z swapped, as 0.5 * n + 0.5 for each pass that hit and black for the rest
+	static const std::vector<vec3f> & displayNormals(const RenderOutput & output, std::vector<vec3f> & out)
+	{
+		out.resize(output.normal.size());
+		for (size_t i = 0; i < out.size(); ++i)
+		{
+			const vec3f n = output.normal[i];
+			out[i] = vec3f{ n.x(), n.z(), n.y() } * 0.5f + (float)output.hit_passes[i] * 0.5f;
+		}
+		return out;
+	}
+
+	static void saveTonemapped(std::vector<sRGBPixel> & image_LDR, const char * channel_name, const Job & job, const std::vector<vec3f> & buffer)
+	{
+		const RenderOutput & output = *job.output;
+
+		// Tonemap and convert to LDR sRGB
+		tonemap(image_LDR, buffer, output.pixel_passes, output.xres, output.yres);
+
+		// Save frame
+		char filename[128];
+		snprintf(filename, 128, "%s_frame_%08d.png", channel_name, job.frame);
+		stbi_write_png(filename, output.xres, output.yres, 3, &image_LDR[0], output.xres * 3);
+		printf("Saved %s with %d passes\n", filename, job.passes);
+	}
+
+#if ENABLE_RENDER_STATS
+	static void saveHeatmap(std::vector<sRGBPixel> & image_LDR, const Job & job)
+	{
+		const RenderOutput & output = *job.output;
+		heatmap(image_LDR, output.march_steps, output.pixel_passes, output.xres, output.yres);
+
+		char filename[128];
+		snprintf(filename, 128, "steps_frame_%08d.png", job.frame);
+		stbi_write_png(filename, output.xres, output.yres, 3, &image_LDR[0], output.xres * 3);
+		printf("Saved %s with %d passes\n", filename, job.passes);
+	}
+#endif
+
+	static void saveEXR(const Job & job)
+	{
+		char filename[128];
+		snprintf(filename, 128, "frame_%08d.exr", job.frame);
+		if (ExrOutput::save(filename, *job.output))
+			printf("Saved %s with %d passes\n", filename, job.passes);
+		else
+			printf("Failed to save %s\n", filename);
+	}
+
+	void saveCheckpoint(const Job & job) const
+	{
+		if (Checkpoint::save(checkpoint_filename.c_str(), *job.output, 0, job.passes, checkpoint_fingerprint))
+			printf("Saved checkpoint %s at %d passes\n", checkpoint_filename.c_str(), job.passes);
+		else
+			printf("Failed to save checkpoint %s\n", checkpoint_filename.c_str());
+	}
+
+	const int xres, yres, num_buffers;
+	std::vector<std::unique_ptr<RenderOutput>> buffers;
+	std::vector<RenderOutput *> free_buffers;
+	std::deque<Job> queue;
+	std::vector<std::thread> encoders;
+
+	std::mutex mutex;
+	std::condition_variable queue_cv;
+	std::condition_variable free_cv;
+	int num_encoding = 0;
+	bool quit = false;
+};
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "maths/vec.h"
+#include "scene_objects/SimpleObjects.h"
+#include "Sampler.h"
+
+
+
+inline float luminance(const vec3f & c) noexcept
+{
+	return c.x() * 0.2126f + c.y() * 0.7152f + c.z() * 0.0722f;
+}
+
+
+struct PointLight
+{
+	vec3r position = { 8, 12, -6 };
+	vec3f intensity = 720;
+};
+
+
+// Walker's alias method for picking one of n items in proportion to their weights in constant time, see
+// https://www.keithschwarz.com/darts-dice-coins/
+struct AliasTable
+{
+	std::vector<float> pdf; // Probability of picking each item
+	std::vector<float> keep; // Probability of keeping the item in each slot instead of its alias
+	std::vector<int> alias;
+
+
+	void build(const std::vector<float> & weights)
+	{
+		const int n = (int)weights.size();
+		pdf.resize(n);
+		keep.resize(n);
+		alias.resize(n);
+
+		double total = 0;
+		for (const float w : weights)
+			total += w;
+
+		// Split the slots into those with less and more than the average weight, and top up the small ones from the large ones
+		std::vector<double> scaled(n);
+		std::vector<int> small, large;
+		for (int i = 0; i < n; ++i)
+		{
+			pdf[i] = (float)(weights[i] / total);
+			scaled[i] = weights[i] / total * n;
+			(scaled[i] < 1 ? small : large).push_back(i);
+		}
+
+		while (!small.empty() && !large.empty())
+		{
+			const int s = small.back(), l = large.back();
+			small.pop_back();
+			keep[s] = (float)scaled[s];
+			alias[s] = l;
+
+			scaled[l] -= 1 - scaled[s];
+			if (scaled[l] < 1)
+			{
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+
+		// Whatever is left is full up to rounding
+		for (const int i : small) { keep[i] = 1; alias[i] = i; }
+		for (const int i : large) { keep[i] = 1; alias[i] = i; }
+	}
+
+	// Pick an item with a single uniform number, whose fraction after choosing the slot decides between it and its alias
+	int sample(const real u) const noexcept
+	{
+		const int n = (int)keep.size();
+		const real x = u * n;
+		const int i = std::min((int)x, n - 1);
+		return (x - i < keep[i]) ? i : alias[i];
+	}
+};
+
+
+// Direction towards a light for a shadow ray, and how much light arrives along it
+struct LightSample
+{
+	vec3r dir; // Unit vector towards the light
+	real dist; // Distance to the light along dir, for the shadow ray
+	vec3f incident; // Divided by the sampling pdf and pi, so that a diffuse surface reflects albedo * cos * incident
+	real pdf; // Solid angle pdf including picking the light, 0 for point lights which can't be hit by BSDF sampling
+};
+
+
+// All lights that direct lighting samples: the scene's point light and every emissive sphere. One light is picked per
+// shading point in proportion to its power. Spheres are sampled uniformly over the cone of directions they subtend,
+// and since bounces can also hit them, both strategies are weighted with multiple importance sampling.
+// Emissive objects of other shapes are only found by bounces.
+struct LightList
+{
+	struct SphereLight
+	{
+		vec3r centre;
+		real radius;
+		vec3f emission;
+	};
+
+	PointLight point_light;
+	bool use_point_light = false; // First in the alias table if set
+	std::vector<SphereLight> spheres;
+	AliasTable table;
+	std::unordered_map<const SceneObject *, int> sphere_indices; // For looking up the pdf of lights hit by bounces
+
+
+	void build(const PointLight & light, const std::vector<SceneObject *> & objects)
+	{
+		point_light = light;
+		use_point_light = luminance(light.intensity) > 0;
+		spheres.clear();
+		sphere_indices.clear();
+		table = AliasTable();
+
+		// The point light's intensity is divided by pi like a diffuse surface's reflection, so it's pi times that in radiometric units
+		std::vector<float> powers;
+		if (use_point_light)
+			powers.push_back((float)(4 * pi * pi) * luminance(light.intensity));
+
+		for (const SceneObject * const o : objects)
+		{
+			const Sphere * const s = dynamic_cast<const Sphere *>(o);
+			if (s == nullptr || luminance(o->mat.emission) <= 0)
+				continue;
+
+			sphere_indices[o] = (int)spheres.size();
+			spheres.push_back({ s->centre, s->radius, o->mat.emission });
+			powers.push_back((float)(4 * pi * pi * s->radius * s->radius) * luminance(o->mat.emission));
+		}
+
+		if (!powers.empty())
+			table.build(powers);
+	}
+
+	int numLights() const noexcept { return (int)table.pdf.size(); }
+
+	// Pick a light and a direction towards it from p, returns false if there's nothing to sample
+	bool sample(const vec3r & p, PixelSampler & sampler, LightSample & out) const noexcept
+	{
+		const int n = numLights();
+		if (n == 0)
+			return false;
+
+		// Only spend a sample dimension on picking when there's a choice
+		const int idx = (n > 1) ? table.sample(sampler.next()) : 0;
+		const float pick_pdf = table.pdf[idx];
+
+		if (use_point_light && idx == 0)
+		{
+			const vec3r light_vec = point_light.position - p;
+			const real light_ln2 = dot(light_vec, light_vec);
+			out.dist = std::sqrt(light_ln2);
+			out.dir = light_vec * (1 / out.dist);
+			out.incident = point_light.intensity * (1 / ((float)light_ln2 * pick_pdf));
+			out.pdf = 0;
+			return true;
+		}
+
+		const SphereLight & s = spheres[idx - use_point_light];
+		const vec3r to_centre = s.centre - p;
+		const real d2 = dot(to_centre, to_centre);
+		const real r2 = s.radius * s.radius;
+		if (d2 <= r2)
+			return false;
+
+		// Uniform direction in the cone around the centre
+		const real d = std::sqrt(d2);
+		const vec3r w = to_centre * (1 / d);
+		const real cos_max = std::sqrt(std::max((real)0, 1 - r2 / d2));
+		const real one_minus_cos_max = (r2 / d2) / (1 + cos_max); // Without cancellation for small or distant lights
+		const real cos_t = 1 - sampler.next() * one_minus_cos_max;
+		const real sin_t = std::sqrt(std::max((real)0, 1 - cos_t * cos_t));
+		const real phi = two_pi * sampler.next();
+
+		const vec3r u = normalise(cross((std::fabs(w.x()) > 0.1f) ? vec3r{ 0, 1, 0 } : vec3r{ 1, 0, 0 }, w));
+		const vec3r v = cross(w, u);
+		out.dir = u * (std::cos(phi) * sin_t) + v * (std::sin(phi) * sin_t) + w * cos_t;
+
+		// Nearest intersection with the sphere, the direction is inside the cone so it only misses by rounding.
+		// The shadow ray stops just short of it, so that it doesn't hit the light itself.
+		const real b = dot(to_centre, out.dir);
+		out.dist = (b - std::sqrt(std::max((real)0, b * b - (d2 - r2)))) * (1 - 1e-4f);
+
+		out.pdf = pick_pdf / (two_pi * one_minus_cos_max);
+		out.incident = s.emission * (float)(1 / (pi * out.pdf));
+		return true;
+	}
+
+	// Solid angle pdf of sample() picking the direction from p that hit an object, 0 if it's not a sampled light
+	real pdf(const SceneObject * const hit_obj, const vec3r & p) const noexcept
+	{
+		const auto it = sphere_indices.find(hit_obj);
+		if (it == sphere_indices.end())
+			return 0;
+
+		const SphereLight & s = spheres[it->second];
+		const vec3r to_centre = s.centre - p;
+		const real d2 = dot(to_centre, to_centre);
+		const real r2 = s.radius * s.radius;
+		if (d2 <= r2)
+			return 0;
+
+		const real cos_max = std::sqrt(std::max((real)0, 1 - r2 / d2));
+		const real one_minus_cos_max = (r2 / d2) / (1 + cos_max);
+		return table.pdf[it->second + use_point_light] / (two_pi * one_minus_cos_max);
+	}
+};
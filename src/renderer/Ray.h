@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+
 #include "../maths/real.h"
 #include "../maths/vec.h"
 
@@ -13,9 +15,34 @@ constexpr static real ray_epsilon = 3e-4f;
 constexpr static real DE_thresh = 2e-5f;
 #endif
 
+constexpr static real float_DE_thresh = 2e-5f; // Below this distance estimate, DE objects marching in float switch to full precision
+
+
+// Threshold on DE * step_scale for DE objects to hit a ray whose footprint has the given radius at the current point.
+// The DE itself is compared with the footprint, since its overestimation is already made up for by scaling the steps.
+// Marching to precision finer than the footprint doesn't add any visible detail, it only costs steps and aliases.
+inline real hitThreshold(const real footprint, const real step_scale) noexcept
+{
+	return std::max(DE_thresh, footprint * step_scale);
+}
+
 
 struct Ray
 {
 	vec3r o; // Origin
 	vec3r d; // Direction normalised
+	real cone_spread = 0; // Footprint radius per unit distance along the ray, 0 for exact intersections
+};
+
+
+constexpr static int packet_size = 8; // Number of coherent rays traced together by packet intersection
+
+// Packet of camera rays from neighbouring pixels, intersected in lockstep
+struct RayPacket
+{
+	vec3r o[packet_size];
+	vec3r d[packet_size];
+	real t_start[packet_size]; // Each ray is known to be clear of DE object surfaces up to here, usually 0
+	real cone_spread[packet_size]; // See Ray
+	int num_rays; // Number of valid rays, can be less than packet_size at the end of a span
 };
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+
+#include "Ray.h"
+
+// Compile-time switch for the render counters, which cost a few percent of render time when enabled.
+// The counting functions below compile to nothing when it's off.
+#ifndef ENABLE_RENDER_STATS
+#define ENABLE_RENDER_STATS 0
+#endif
+
+
+
+// Counters for finding out why a frame is slow, accumulated per render thread and summed over each renderPasses call
+struct RenderStats
+{
+	constexpr static int max_depth = 8; // Rays at deeper bounces are counted in the last bin
+	constexpr static int num_step_bins = 16; // Bin 0 is rays with no steps, bin i > 0 has [2^(i-1), 2^i) steps, the last bin has the rest
+
+	enum Stage { stage_intersect, stage_shadow, num_stages };
+
+	uint64_t rays_per_depth[max_depth]; // Nearest hit queries by bounce, depth 0 is camera rays
+	uint64_t shadow_rays;
+	uint64_t marched_rays; // Rays marched against DE objects, a ray is counted once per object
+	uint64_t march_steps;
+	uint64_t march_step_histogram[num_step_bins]; // Marched rays by number of steps
+	uint64_t de_evals; // All DE evaluations, including normals and distance bounds
+	uint64_t iterations; // Formula iterations over all DE evaluations of hybrids
+	uint64_t max_iter_evals; // Hybrid DE evaluations that used all max_iters iterations
+	uint64_t zero_de_stalls; // DE evaluations that returned 0 because the derivatives were no longer finite
+	double stage_seconds[num_stages]; // Thread time spent in intersection and shadow queries
+	double thread_seconds; // Total thread time spent rendering, the rest is ray generation and shading
+
+	// Camera ray steps for each ray of the last packet marched on this thread, for the steps per pixel heatmap
+	uint32_t packet_steps[packet_size];
+
+
+	RenderStats() noexcept { clear(); }
+
+	void clear() noexcept { memset((void *)this, 0, sizeof(RenderStats)); }
+
+	void add(const RenderStats & s) noexcept
+	{
+		for (int i = 0; i < max_depth; ++i) rays_per_depth[i] += s.rays_per_depth[i];
+		shadow_rays  += s.shadow_rays;
+		marched_rays += s.marched_rays;
+		march_steps  += s.march_steps;
+		for (int i = 0; i < num_step_bins; ++i) march_step_histogram[i] += s.march_step_histogram[i];
+		de_evals   += s.de_evals;
+		iterations += s.iterations;
+		max_iter_evals += s.max_iter_evals;
+		zero_de_stalls += s.zero_de_stalls;
+		for (int i = 0; i < num_stages; ++i) stage_seconds[i] += s.stage_seconds[i];
+		thread_seconds += s.thread_seconds;
+	}
+
+	void print() const
+	{
+		printf("  Rays by depth:");
+		for (int i = 0; i < max_depth; ++i)
+			printf(" %llu", (unsigned long long)rays_per_depth[i]);
+		printf(", shadow %llu\n", (unsigned long long)shadow_rays);
+
+		printf("  Marched rays %llu, %.1f steps per ray, steps histogram:", (unsigned long long)marched_rays, march_steps / (double)std::max<uint64_t>(1, marched_rays));
+		for (int i = 0; i < num_step_bins; ++i)
+			printf(" %llu", (unsigned long long)march_step_histogram[i]);
+		printf("\n");
+
+		printf("  DE evaluations %llu, %.1f iterations per DE evaluation, %llu hit max iterations, %llu zero DE stalls\n",
+			(unsigned long long)de_evals, iterations / (double)std::max<uint64_t>(1, de_evals), (unsigned long long)max_iter_evals, (unsigned long long)zero_de_stalls);
+
+		const double shade_seconds = thread_seconds - stage_seconds[stage_intersect] - stage_seconds[stage_shadow];
+		printf("  Thread time %.2f s: intersection %.1f%%, shadow %.1f%%, generation and shading %.1f%%\n", thread_seconds,
+			100 * stage_seconds[stage_intersect] / thread_seconds, 100 * stage_seconds[stage_shadow] / thread_seconds, 100 * shade_seconds / thread_seconds);
+	}
+};
+
+
+#if ENABLE_RENDER_STATS
+inline thread_local RenderStats thread_stats; // Counters of the current thread
+#endif
+
+
+inline void statsCountRay(const int depth) noexcept
+{
+#if ENABLE_RENDER_STATS
+	thread_stats.rays_per_depth[std::min(depth, RenderStats::max_depth - 1)]++;
+#else
+	(void) depth;
+#endif
+}
+
+inline void statsCountShadowRay() noexcept
+{
+#if ENABLE_RENDER_STATS
+	thread_stats.shadow_rays++;
+#endif
+}
+
+// Record a finished march, ray_idx is the index in its packet or -1 for single rays
+inline void statsCountMarch(const int steps, const int ray_idx) noexcept
+{
+#if ENABLE_RENDER_STATS
+	int bin = 0;
+	while (bin < RenderStats::num_step_bins - 1 && (steps >> bin) != 0)
+		bin++;
+
+	thread_stats.marched_rays++;
+	thread_stats.march_steps += steps;
+	thread_stats.march_step_histogram[bin]++;
+	if (ray_idx >= 0)
+		thread_stats.packet_steps[ray_idx] += steps;
+#else
+	(void) steps;
+	(void) ray_idx;
+#endif
+}
+
+inline void statsClearPacketSteps() noexcept
+{
+#if ENABLE_RENDER_STATS
+	memset(thread_stats.packet_steps, 0, sizeof(thread_stats.packet_steps));
+#endif
+}
+
+inline void statsCountDE() noexcept
+{
+#if ENABLE_RENDER_STATS
+	thread_stats.de_evals++;
+#endif
+}
+
+inline void statsCountIterations(const int iterations, const int max_iters) noexcept
+{
+#if ENABLE_RENDER_STATS
+	thread_stats.iterations += iterations;
+	thread_stats.max_iter_evals += (iterations >= max_iters);
+#else
+	(void) iterations;
+	(void) max_iters;
+#endif
+}
+
+inline void statsCountZeroDE() noexcept
+{
+#if ENABLE_RENDER_STATS
+	thread_stats.zero_de_stalls++;
+#endif
+}
+
+
+// Adds the time until it goes out of scope to a stage, or to the total thread time with num_stages
+struct StatsTimer
+{
+#if ENABLE_RENDER_STATS
+	const RenderStats::Stage stage;
+	const std::chrono::steady_clock::time_point start;
+
+
+	StatsTimer(const RenderStats::Stage stage_) noexcept : stage(stage_), start(std::chrono::steady_clock::now()) { }
+
+	~StatsTimer()
+	{
+		const double t = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start).count();
+		if (stage == RenderStats::num_stages)
+			thread_stats.thread_seconds += t;
+		else
+			thread_stats.stage_seconds[stage] += t;
+	}
+#else
+	StatsTimer(const RenderStats::Stage) noexcept { }
+#endif
+};
@@ -1,28 +1,56 @@
 #pragma once
 
-#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "Scene.h"
+#include "TileScheduler.h"
+#include "Sampler.h"
+#include "RenderStats.h"
 
 
 
 struct RenderOutput
 {
-	const int xres, yres;
+	const int xres, yres; // Resolution of the buffers
+	const int image_xres, image_yres; // Resolution of the whole image, the buffers can be a window of it
+	const int x0, y0; // Position of the window in the image
 	int passes = 0;
 
 	std::vector<vec3f> beauty;
-	std::vector<vec3f> normal;
+	std::vector<vec3f> normal; // Sum of first hit world space unit normals, zero where the camera ray missed
 	std::vector<vec3f> albedo;
 
+	std::vector<float> beauty_lum2; // Sum of squared beauty luminance, for estimating per-pixel variance
+	std::vector<float> depth; // Sum of camera ray distances to the first hit, for reprojecting to another camera; not checkpointed
+	std::vector<int> pixel_passes; // Number of passes per pixel, which varies with adaptive sampling
+	std::vector<int> hit_passes; // Number of those passes whose camera ray hit something, for displaying the normals
+#if ENABLE_RENDER_STATS
+	std::vector<float> march_steps; // Sum of camera ray march steps, for the steps per pixel heatmap
+#endif
+
+
+	RenderOutput(int xres_, int yres_) : RenderOutput(xres_, yres_, xres_, yres_, 0, 0) {}
 
-	RenderOutput(int xres_, int yres_) : xres(xres_), yres(yres_)
+	RenderOutput(int xres_, int yres_, int image_xres_, int image_yres_, int x0_, int y0_) :
+		xres(xres_), yres(yres_), image_xres(image_xres_), image_yres(image_yres_), x0(x0_), y0(y0_)
 	{
 		beauty.resize(xres * yres);
 		normal.resize(xres * yres);
 		albedo.resize(xres * yres);
+		beauty_lum2.resize(xres * yres);
+		depth.resize(xres * yres);
+		pixel_passes.resize(xres * yres);
+		hit_passes.resize(xres * yres);
+#if ENABLE_RENDER_STATS
+		march_steps.resize(xres * yres);
+#endif
 	}
 
 	void clear()
@@ -31,15 +59,124 @@ struct RenderOutput
 		memset((void *)&beauty[0], 0, sizeof(vec3f) * xres * yres);
 		memset((void *)&normal[0], 0, sizeof(vec3f) * xres * yres);
 		memset((void *)&albedo[0], 0, sizeof(vec3f) * xres * yres);
+		memset((void *)&beauty_lum2[0], 0, sizeof(float) * xres * yres);
+		memset((void *)&depth[0], 0, sizeof(float) * xres * yres);
+		memset((void *)&pixel_passes[0], 0, sizeof(int) * xres * yres);
+		memset((void *)&hit_passes[0], 0, sizeof(int) * xres * yres);
+#if ENABLE_RENDER_STATS
+		memset((void *)&march_steps[0], 0, sizeof(float) * xres * yres);
+#endif
+	}
+
+	// Copy all buffers from another output of the same resolution
+	void copyFrom(const RenderOutput & o)
+	{
+		passes = o.passes;
+		beauty = o.beauty;
+		normal = o.normal;
+		albedo = o.albedo;
+		beauty_lum2 = o.beauty_lum2;
+		depth = o.depth;
+		pixel_passes = o.pixel_passes;
+		hit_passes = o.hit_passes;
+#if ENABLE_RENDER_STATS
+		march_steps = o.march_steps;
+#endif
+	}
+
+	// Sum in the buffers of another output of the same resolution, e.g. one rendered over a different range of passes
+	void accumulate(const RenderOutput & o)
+	{
+		passes += o.passes;
+		for (int i = 0; i < xres * yres; ++i)
+		{
+			beauty[i] += o.beauty[i];
+			normal[i] += o.normal[i];
+			albedo[i] += o.albedo[i];
+			beauty_lum2[i]  += o.beauty_lum2[i];
+			depth[i]        += o.depth[i];
+			pixel_passes[i] += o.pixel_passes[i];
+			hit_passes[i]   += o.hit_passes[i];
+#if ENABLE_RENDER_STATS
+			march_steps[i] += o.march_steps[i];
+#endif
+		}
 	}
 };
 
 
+// Bucket-sized accumulation buffer with the channels of each pixel interleaved.
+// A render thread accumulates all passes of a bucket into its own tile and then merges it into the output with a single write,
+// so no two threads ever write to the same pixels and the summation order doesn't depend on the thread timing.
+struct RenderTile
+{
+	struct Pixel
+	{
+		vec3f beauty = 0;
+		vec3f normal = 0;
+		vec3f albedo = 0;
+		float beauty_lum2 = 0;
+		float depth = 0;
+		int passes = 0;
+		int hit_passes = 0;
+#if ENABLE_RENDER_STATS
+		float march_steps = 0;
+#endif
+	};
+
+	int xres, yres; // Resolution of the whole image
+	int x0, y0, x1, y1; // Pixel range of the tile in the image
+	std::vector<Pixel> pixels;
+
+
+	void reset(const int xres_, const int yres_, const int x0_, const int y0_, const int x1_, const int y1_)
+	{
+		xres = xres_; yres = yres_;
+		x0 = x0_; y0 = y0_; x1 = x1_; y1 = y1_;
+		pixels.assign((x1 - x0) * (y1 - y0), Pixel());
+	}
+
+	int pixelIndex(const int x, const int y) const noexcept { return (y - y0) * (x1 - x0) + (x - x0); }
+
+	void mergeInto(RenderOutput & output) const noexcept
+	{
+		for (int y = y0; y < y1; ++y)
+		for (int x = x0; x < x1; ++x)
+		{
+			const Pixel & p = pixels[pixelIndex(x, y)];
+			const int pixel_idx = (y - output.y0) * output.xres + (x - output.x0);
+			output.beauty[pixel_idx] += p.beauty;
+			output.normal[pixel_idx] += p.normal;
+			output.albedo[pixel_idx] += p.albedo;
+			output.beauty_lum2[pixel_idx] += p.beauty_lum2;
+			output.depth[pixel_idx] += p.depth;
+			output.pixel_passes[pixel_idx] += p.passes;
+			output.hit_passes[pixel_idx] += p.hit_passes;
+#if ENABLE_RENDER_STATS
+			output.march_steps[pixel_idx] += p.march_steps;
+#endif
+		}
+	}
+};
+
+
+struct PrimaryStartTable;
+
+constexpr int default_max_bounces = 5;
+
 struct ThreadControl
 {
 	const int num_passes;
+	const bool use_wavefront; // Use the wavefront integrator instead of tracing one path at a time
 
-	std::atomic<int> next_bucket = 0;
+	TileScheduler * const scheduler;
+	const SampleTable * const samples; // Sequence values for each pass
+	PrimaryStartTable * const primary_start; // Start distances for camera rays, or null
+	const real lod_footprint; // Camera ray footprint radius in pixels for the hit threshold, 0 for exact intersections
+	const int max_bounces; // Path length limit after the camera ray
+	const std::atomic<bool> * const cancel; // Set from any thread to abandon the render as soon as possible, or null
+
+	bool cancelled() const noexcept { return cancel != nullptr && cancel->load(std::memory_order_relaxed); }
 };
 
 
@@ -55,26 +192,6 @@ inline uint32_t hash(uint32_t x)
 }
 
 
-// From PBRT
-double RadicalInverse(int a, int base) noexcept
-{
-	const double invBase = 1.0 / base;
-
-	int reversedDigits = 0;
-	double invBaseN = 1;
-	while (a)
-	{
-		const int next  = a / base;
-		const int digit = a - base * next;
-		reversedDigits = reversedDigits * base + digit;
-		invBaseN *= invBase;
-		a = next;
-	}
-
-	return std::min(reversedDigits * invBaseN, DoubleOneMinusEpsilon);
-}
-
-
 inline real uintToUnitReal(uint32_t v)
 {
 #if USE_DOUBLE
@@ -93,16 +210,6 @@ inline real uintToUnitReal(uint32_t v)
 }
 
 
-inline real wrap1r(real u, real v) { return (u + v < 1) ? u + v : u + v - 1; }
-
-inline int wrap6i(int & v)
-{
-	const int o = v;
-	const int u = o + 1;
-	v = (u < 6) ? u : 0;
-	return o;
-}
-
 inline real sign(real v) { return (v >= 0) ? (real)1 : (real)-1; }
 
 // Convert uniform distribution into triangle-shaped distribution
@@ -117,242 +224,939 @@ inline real triDist(real v)
 	return v;
 }
 
-inline void render(const int x, const int y, const int frame, const int pass, const int frames, Scene & scene, RenderOutput & output) noexcept
+
+inline PixelSampler getPixelSampler(const int x, const int y, const int frame, const int xres, const int yres, const PassSamples & pass_samples) noexcept
 {
-	constexpr int max_bounces = 5;
-	constexpr int num_primes = 6;
-	constexpr static int primes[num_primes] = { 2, 3, 5, 7, 11, 13 };
-	const int xres = output.xres;
-	const int yres = output.yres;
 	const int pixel_idx = y * xres + x;
+	return { pass_samples, 0, uintToUnitReal(hash(frame * xres * yres + pixel_idx)) }; // Use pixel idx to randomise the sequence
+}
+
+
+// Camera at a given time, with everything needed to generate rays for any pixel
+struct Camera
+{
+	vec3r pos;
+	vec3r forward, right, up;
+	vec3r pixel_x, pixel_y; // Step per pixel on the image plane at unit distance along forward
+	real focal_dist;
+	real lens_radius;
+	int xres, yres;
+
 
+	// Vector from the lens centre through sub-pixel position (x + sample_x, y + sample_y), not normalised
+	vec3r pixelVector(const int x, const int y, const real sample_x, const real sample_y) const noexcept
+	{
+		return forward +
+			(pixel_x * (x - xres * 0.5f + sample_x + 0.5f)) +
+			(pixel_y * (y - yres * 0.5f + sample_y + 0.5f));
+	}
+};
+
+
+// Camera at the given animation time, which goes from 0 to 2 pi over one orbit
+inline Camera getCamera(const CameraDesc & desc, const real time, const int xres, const int yres) noexcept
+{
 	const real aspect_ratio = xres / (real)yres;
-	const real fov_deg = 80.f;
-	const real fov_rad = fov_deg * two_pi / 360; // Convert from degrees to radians
+	const real fov_rad = desc.fov_deg * two_pi / 360; // Convert from degrees to radians
 	const real sensor_width  = 2 * std::tan(fov_rad / 2);
 	const real sensor_height = sensor_width / aspect_ratio;
 
-	int dim = 0;
-	const real hash_random    = uintToUnitReal(hash(frame * xres * yres + pixel_idx)); // Use pixel idx to randomise Halton sequence
-	const real pixel_sample_x = triDist(wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random));
-	const real pixel_sample_y = triDist(wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random));
-
-	const real time  = (frames <= 0) ? 0 : two_pi * (frame + triDist(wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random))) / frames;
 	const real cos_t = std::cos(time);
 	const real sin_t = std::sin(time);
 
-	const vec3r cam_lookat = { 0, -0.125f, 0 };
+	const vec3r cam_lookat = desc.lookat;
 	const vec3r world_up = { 0, 1, 0 };
-	const vec3r cam_pos = vec3r{ 4 * cos_t + 10 * sin_t, 5, -10 * cos_t + 4 * sin_t } * 0.2f;
+	const vec3r & p = desc.position;
+	const vec3r cam_pos = { p.x() * cos_t - p.z() * sin_t, p.y(), p.x() * sin_t + p.z() * cos_t };
 	const vec3r cam_forward = normalise(cam_lookat - cam_pos);
 	const vec3r cam_right = cross(world_up, cam_forward);
 	const vec3r cam_up = cross(cam_forward, cam_right);
 
-	const vec3r pixel_x = cam_right * (sensor_width / xres);
-	const vec3r pixel_y = cam_up * -(sensor_height / yres);
-	const vec3r pixel_v = cam_forward +
-		(pixel_x * (x - xres * 0.5f + pixel_sample_x + 0.5f)) +
-		(pixel_y * (y - yres * 0.5f + pixel_sample_y + 0.5f));
+	Camera cam;
+	cam.pos = cam_pos;
+	cam.forward = cam_forward;
+	cam.right = cam_right;
+	cam.up = cam_up;
+	cam.pixel_x = cam_right * (sensor_width / xres);
+	cam.pixel_y = cam_up * -(sensor_height / yres);
+	cam.focal_dist = length(cam_pos - cam_lookat) * desc.focus;
+	cam.lens_radius = desc.lens_radius;
+	cam.xres = xres;
+	cam.yres = yres;
+	return cam;
+}
+
 
-	vec3r ray_p = cam_pos;
-	vec3r ray_d = normalise(pixel_v);
-#if 1 // Depth of field
-	const real focal_dist = length(cam_pos - cam_lookat) * 0.65f;
-	const real lens_radius = 0.0125f;
+// With lod_footprint the ray gets a cone with that radius in pixels, which is foreshortened away from the image centre
+inline Ray generateCameraRay(const CameraDesc & camera_desc, const int x, const int y, const int frame, const int frames, const int xres, const int yres,
+	PixelSampler & sampler, const real lod_footprint = 0) noexcept
+{
+	const real pixel_sample_x = triDist(sampler.next());
+	const real pixel_sample_y = triDist(sampler.next());
 
+	const real time = (frames <= 0) ? 0 : two_pi * (frame + triDist(sampler.next())) / frames;
+	const Camera cam = getCamera(camera_desc, time, xres, yres);
+
+	vec3r ray_p = cam.pos;
+	vec3r ray_d = normalise(cam.pixelVector(x, y, pixel_sample_x, pixel_sample_y));
+	const real cos_forward = dot(ray_d, cam.forward);
+	const real cone_spread = lod_footprint * length(cam.pixel_x) * cos_forward * cos_forward;
+#if 1 // Depth of field
 	// Random point on disc
-	const real lens_r = std::sqrt(wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random)) * lens_radius;
-	const real lens_a = two_pi *  wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-	const vec3r focal_point = ray_p + ray_d * (focal_dist / dot(ray_d, cam_forward));
+	const real lens_r = std::sqrt(sampler.next()) * cam.lens_radius;
+	const real lens_a = two_pi * sampler.next();
+	const vec3r focal_point = ray_p + ray_d * (cam.focal_dist / dot(ray_d, cam.forward));
 
-	ray_p += cam_right * (std::cos(lens_a) * lens_r) + cam_up * (std::sin(lens_a) * lens_r);
+	ray_p += cam.right * (std::cos(lens_a) * lens_r) + cam.up * (std::sin(lens_a) * lens_r);
 	ray_d = normalise(focal_point - ray_p);
 #endif
 
+	return { ray_p, ray_d, cone_spread };
+}
+
+
+// Conservative start distances for camera rays in each block of pixels, found by cone marching a cone that contains
+// all of the block's camera rays against the DE objects. Later passes then skip the empty space in front of their hits.
+// Only valid while the camera doesn't move, so it's only used for stills.
+struct PrimaryStartTable
+{
+	constexpr static int block_size = 4; // Tiles are multiples of this, so each block is filled by a single thread
+
+	int xres = 0, yres = 0; // Resolution of the whole image
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0; // Window of the image that the table covers, aligned to blocks
+	int blocks_x = 0;
+	std::vector<real> t_start; // Negative where it hasn't been computed yet
+
+
+	void reset(const int xres_, const int yres_) { reset(xres_, yres_, 0, 0, xres_, yres_); }
+
+	void reset(const int xres_, const int yres_, const int x0_, const int y0_, const int x1_, const int y1_)
+	{
+		xres = xres_; yres = yres_;
+		x0 = x0_; y0 = y0_; x1 = x1_; y1 = y1_;
+		blocks_x = (x1 - x0 + block_size - 1) / block_size;
+		t_start.assign(blocks_x * ((y1 - y0 + block_size - 1) / block_size), -1);
+	}
+
+	// Whether the table was set up for the window of an output
+	bool covers(const RenderOutput & output) const noexcept
+	{
+		return xres == output.image_xres && yres == output.image_yres && x0 == output.x0 && y0 == output.y0 &&
+			x1 == output.x0 + output.xres && y1 == output.y0 + output.yres;
+	}
+
+	real get(const int x, const int y) const noexcept { return t_start[((y - y0) / block_size) * blocks_x + (x - x0) / block_size]; }
+
+	// Fill in the blocks of a rectangle of pixels that aren't known yet
+	void computeRect(const int rect_x0, const int rect_y0, const int rect_x1, const int rect_y1, const Scene & scene) noexcept
+	{
+		const Camera cam = getCamera(scene.camera, 0, xres, yres);
+		for (int by = (rect_y0 - y0) / block_size; y0 + by * block_size < rect_y1; ++by)
+		for (int bx = (rect_x0 - x0) / block_size; x0 + bx * block_size < rect_x1; ++bx)
+		{
+			real & t = t_start[by * blocks_x + bx];
+			if (t < 0)
+				t = coneMarch(cam, x0 + bx * block_size, y0 + by * block_size, scene);
+		}
+	}
+
+private:
+	// March the cone around the ray through the block centre, and return how far all rays in the block are clear
+	static real coneMarch(const Camera & cam, const int x, const int y, const Scene & scene) noexcept
+	{
+		// Sub-pixel samples are within a pixel of the pixel centre with the triangle filter, and the normalised direction
+		// differs by at most twice the image plane offset since the pixel vectors have length at least 1.
+		// Depth of field rays from the lens meet their pixel's ray at the focal plane, so they're within lens_radius of it
+		// scaled by how far from the focal plane they are, which gives a double cone around the block.
+		const real block_centre = block_size * (real)0.5 - (real)0.5;
+		const vec3r axis_d = normalise(cam.pixelVector(x, y, block_centre, block_centre));
+		const real max_pixel_offset = (block_size * (real)0.5 + 1) * (real)1.4142135623730951;
+		const real spread = 2 * max_pixel_offset * std::max(length(cam.pixel_x), length(cam.pixel_y));
+		const real focal_t = cam.focal_dist / dot(axis_d, cam.forward);
+		const real lens_slope = cam.lens_radius / cam.focal_dist;
+
+		constexpr int max_steps = 64;
+		real t = 0;
+		for (int i = 0; i < max_steps; ++i)
+		{
+			const vec3r p = cam.pos + axis_d * t;
+			real bound = real_inf;
+			for (const SceneObject * const o : scene.objects)
+				bound = std::min(bound, o->getDistanceBound(p));
+
+			// Stop when nothing uses the start distance, or the cone gets close to a surface
+			const real r = cam.lens_radius * std::max(1 - t / focal_t, t / cam.focal_dist - 1) + t * spread;
+			if (bound == real_inf || bound < r * (real)1.25)
+				break;
+
+			// Points on any ray within the cone up to here are within r + (step * (1 + spread + lens_slope)) of p
+			t += (bound - r) / (1 + spread + lens_slope);
+		}
+
+		return t;
+	}
+};
+
+
+// State of a path being traced, so that it can be advanced one stage at a time
+struct PathState
+{
+	Ray ray;
+	vec3f contribution;
+	vec3f throughput;
+	vec3f normal_out;
+	vec3f albedo_out;
+	float depth_out; // Camera ray distance to the first hit, or miss_depth
+	int bounce;
+	int max_bounces;
+	int pixel_idx;
+	PixelSampler sampler;
+	real t_start; // Start distance for DE objects, only for camera rays from the PrimaryStartTable
+	real bsdf_pdf; // Solid angle pdf of the bounce that started the ray, for weighting the emission it hits, 0 for camera rays and mirrors
+};
+
+constexpr float miss_depth = 1e4f; // Depth of camera rays that don't hit anything, far enough to reproject like the sky
+
+
+// Shadow ray towards the light, whose contribution is added to the path if it's unoccluded
+struct ShadowRay
+{
+	Ray ray;
+	real max_t;
+	vec3f contribution;
+};
+
+
+inline PathState startPath(const Ray & camera_ray, const int pixel_idx, const PixelSampler & sampler, const real t_start, const int max_bounces) noexcept
+{
+	return { camera_ray, 0, 1, 0, 0, 0, 0, max_bounces, pixel_idx, sampler, t_start, 0 };
+}
+
+
+// Path didn't hit anything, add skylight colour
+inline void shadeMiss(PathState & path) noexcept
+{
+	const vec3f sky_up = vec3f{ 53, 112, 128 } * (1.0f / 255) * 0.75f;
+	const vec3f sky_hz = vec3f{ 182, 175, 157 } * (1.0f / 255) * 0.8f;
+	const float height = 1 - std::max(0.0f, (float)path.ray.d.y());
+	const float height2 = height * height;
+	const vec3f sky = sky_up + (sky_hz - sky_up) * height2 * height2;
+	path.contribution += path.throughput * sky;
+
+	if (path.bounce == 0)
+		path.depth_out = miss_depth;
+}
+
+
+// Shade a path vertex and scatter the path into a new direction.
+// Returns true if the path continues; if a shadow ray needs to be traced, has_shadow_ray is set.
+inline bool shadeHit(PathState & path, const SceneObject * const hit_obj, const real hit_t, const LightList & lights,
+	ShadowRay & shadow_ray_out, bool & has_shadow_ray) noexcept
+{
+	const Ray & ray = path.ray;
+	has_shadow_ray = false;
+
+	// Compute intersection position using returned nearest ray distance
+	const vec3r hit_p = ray.o + ray.d * hit_t;
+	if (path.bounce == 0)
+		path.depth_out = (float)hit_t;
+
+	// Get the normal at the intersction point from the surface we hit
+	const vec3r normal = hit_obj->getNormal(hit_p);
+
+	const Material & mat = hit_obj->mat;
+
+	// Pdf of the lights sampling this direction from the ray origin, to weight emission against. Only emissive objects
+	// after a diffuse bounce need it.
+	const real light_pdf = (path.bsdf_pdf > 0 && luminance(mat.emission) > 0) ? lights.pdf(hit_obj, ray.o) : 0;
+
+	// Output render channels
+	if (path.bounce == 0)
+	{
+		path.normal_out = vec3f{ (float)normal.x(), (float)normal.y(), (float)normal.z() };
+		path.albedo_out = mat.albedo;
+	}
+
+	// Add emission, with the power heuristic weight for lights that the previous vertex could also have sampled
+	if (light_pdf > 0 && path.bsdf_pdf > 0)
+		path.contribution += path.throughput * mat.emission * (float)(sqr(path.bsdf_pdf) / (sqr(path.bsdf_pdf) + sqr(light_pdf)));
+	else
+		path.contribution += path.throughput * mat.emission;
+
+	// Add some shininess using Schlick Frensel approximation
+	bool sample_specular;
+	vec3f albedo;
+	if (mat.use_fresnel)
+	{
+		const real r0 = mat.r0;
+		const real p1 = 1 - std::fabs(dot(normal, ray.d));
+		const real p2 = p1 * p1;
+		const real fresnel = r0 + (1 - r0) * p2 * p2 * p1;
+
+		const real mat_u = path.sampler.next();
+		sample_specular = mat_u < fresnel;
+		albedo = (sample_specular) ? 0.95f : mat.albedo;
+	}
+	else
+	{
+		sample_specular = false;
+		albedo = mat.albedo;
+	}
+
+	// Widen the ray cone by the roughness of the bounce: mirror reflections keep the footprint, diffuse bounces blur away detail.
+	// The full diffuse lobe angle would put the hit threshold above the DE near the ray origin, so a diffuse bounce is a fixed factor.
+	constexpr real diffuse_cone_widening = 4;
+	const real bounce_cone_spread = ray.cone_spread * (sample_specular ? 1 : diffuse_cone_widening);
+
+	// Do direct lighting from one of the lights
+	LightSample light;
+	if (!sample_specular && lights.sample(hit_p, path.sampler, light))
+	{
+		// Compute reflected light (simple diffuse / Lambertian)
+		const real n_dot_l = dot(normal, light.dir);
+		if (n_dot_l > 0)
+		{
+			// Area lights can also be hit by the next bounce, unless this is the last one
+			const real bsdf_pdf = n_dot_l * (1 / pi);
+			const bool last_bounce = path.bounce + 1 > path.max_bounces;
+			const float weight = (light.pdf > 0 && !last_bounce) ? (float)(sqr(light.pdf) / (sqr(light.pdf) + sqr(bsdf_pdf))) : 1;
+
+			const vec3f refl_colour = albedo * (float)n_dot_l * light.incident * weight;
+
+			// Trace shadow ray from the hit point towards the light
+			shadow_ray_out = { { hit_p, light.dir, bounce_cone_spread }, light.dist, path.throughput * refl_colour };
+			has_shadow_ray = true;
+		}
+	}
+
+	if (++path.bounce > path.max_bounces)
+		return false;
+
+	// Terminate the path unconditionally if the albedo is super low or zero
+	const float max_albedo = std::max(std::max(albedo.x(), albedo.y()), albedo.z());
+	if (max_albedo < 1e-8f)
+		return false;
+
+	// Use Russian roulette on albedo to possibly terminate the path after 2 bounces
+	if (path.bounce > 2)
+	{
+		const float rr_u = (float)path.sampler.next();
+		const float rr_thresh = std::max(0.0f, std::min(1.0f, max_albedo));
+		if (rr_u > rr_thresh)
+			return false;
+		path.throughput *= (1.0f / rr_thresh);
+	}
+
+	vec3r new_dir;
+	real new_bsdf_pdf;
+	if (sample_specular)
+	{
+		new_dir = ray.d - normal * (2 * dot(normal, ray.d));
+		new_bsdf_pdf = 0;
+	}
+	else
+	{
+		const real refl_sample_x = path.sampler.next();
+		const real refl_sample_y = path.sampler.next();
+
+		// Generate uniform point on sphere, see https://mathworld.wolfram.com/SpherePointPicking.html
+		const real a = refl_sample_x * two_pi;
+		const real s = 2 * std::sqrt(std::max(static_cast<real>(0), refl_sample_y * (1 - refl_sample_y)));
+		const vec3r sphere =
+		{
+			std::cos(a) * s,
+			std::sin(a) * s,
+			1 - 2 * refl_sample_y
+		};
+
+		// Generate new cosine-weighted exitant direction
+		new_dir = normalise(normal + sphere);
+		new_bsdf_pdf = std::max((real)0, dot(normal, new_dir)) * (1 / pi);
+	}
+
+	// Multiply the throughput by the surface reflection
+	path.throughput *= albedo;
+
+	// Start next bounce from the hit position in the scattered ray direction
+	path.ray = { hit_p, new_dir, bounce_cone_spread };
+	path.t_start = 0;
+	path.bsdf_pdf = new_bsdf_pdf;
+	return true;
+}
+
+
+// If we didn't hit anything (null hit obj or length >= length from hit point to light),
+//  add the directly reflected light to the path contribution
+inline void shadeShadow(PathState & path, const ShadowRay & shadow_ray, const bool occluded) noexcept
+{
+	if (!occluded)
+		path.contribution += shadow_ray.contribution;
+}
+
+
+// Accumulate a finished path into its pixel, path.pixel_idx is the index within the tile
+inline void writePath(const PathState & path, RenderTile & tile) noexcept
+{
+	const float lum = luminance(path.contribution);
+
+	RenderTile::Pixel & p = tile.pixels[path.pixel_idx];
+	p.beauty += path.contribution;
+	p.normal += path.normal_out;
+	p.albedo += path.albedo_out;
+	p.beauty_lum2 += lum * lum;
+	p.depth += path.depth_out;
+	p.passes++;
+	p.hit_passes += (dot(path.normal_out, path.normal_out) > 0) ? 1 : 0; // First hit normals have unit length, misses leave it zero
+}
+
+
+// Trace a path starting with a camera ray, whose nearest intersection has already been computed
+inline void tracePath(const Ray & camera_ray, const std::pair<const SceneObject *, real> & camera_hit,
+	const int pixel_idx, const PixelSampler & sampler, const int max_bounces, const Scene & scene, RenderTile & tile) noexcept
+{
 	// Useful for debugging
-	//if (x == xres/2 && y == yres/2)
+	//if (pixel_idx == tile.pixelIndex(tile.xres / 2, tile.yres / 2))
 	//	int a = 9;
 
-	Ray ray = { ray_p, ray_d };
-	vec3f contribution = 0;
-	vec3f throughput = 1;
-	vec3f normal_out = 0;
-	vec3f albedo_out = 0;
-	int bounce = 0;
+	PathState path = startPath(camera_ray, pixel_idx, sampler, 0, max_bounces);
+	std::pair<const SceneObject *, real> hit = camera_hit;
 	while (true)
 	{
-		// Do intersection test
-		const auto [nearest_hit_obj, nearest_hit_t] = scene.nearestIntersection(ray);
+		statsCountRay(path.bounce);
 
 		// Did we hit anything? If not, return skylight colour
-		if (nearest_hit_obj == nullptr)
+		if (hit.first == nullptr)
 		{
-			const vec3f sky_up = vec3f{ 53, 112, 128 } * (1.0f / 255) * 0.75f;
-			const vec3f sky_hz = vec3f{ 182, 175, 157 } * (1.0f / 255) * 0.8f;
-			const float height = 1 - std::max(0.0f, (float)ray.d.y());
-			const float height2 = height * height;
-			const vec3f sky = sky_up + (sky_hz - sky_up) * height2 * height2;
-			contribution += throughput * sky;
+			shadeMiss(path);
 			break;
 		}
 
-		// Compute intersection position using returned nearest ray distance
-		const vec3r hit_p = ray.o + ray.d * nearest_hit_t;
-
-		// Get the normal at the intersction point from the surface we hit
-		const vec3r normal = nearest_hit_obj->getNormal(hit_p);
+		ShadowRay shadow_ray;
+		bool has_shadow_ray;
+		const bool path_continues = shadeHit(path, hit.first, hit.second, scene.lights, shadow_ray, has_shadow_ray);
 
-		const Material & mat = nearest_hit_obj->mat;
-
-		// Output render channels
-		if (bounce == 0)
+		if (has_shadow_ray)
 		{
-			normal_out = vec3f{ (float)normal.x(), (float)normal.z(), (float)normal.y() } * 0.5f + 0.5f; // Swap Y and Z
-			albedo_out = mat.albedo;
+			StatsTimer timer(RenderStats::stage_shadow);
+			statsCountShadowRay();
+			shadeShadow(path, shadow_ray, scene.occluded(shadow_ray.ray, shadow_ray.max_t));
 		}
 
-		// Add emission
-		contribution += throughput * mat.emission;
+		if (!path_continues)
+			break;
+
+		// Do intersection test for the next bounce
+		StatsTimer timer(RenderStats::stage_intersect);
+		hit = scene.nearestIntersection(path.ray);
+	}
+
+	writePath(path, tile);
+}
+
 
-		// Add some shininess using Schlick Frensel approximation
-		bool sample_specular;
-		vec3f albedo;
-		if (mat.use_fresnel)
+// Render a horizontal span of pixels, tracing the coherent camera rays as packets, optionally starting them from the cone prepass distances
+inline void renderSpan(const int x0, const int x1, const int y, const int frame, const PassSamples & pass_samples, const int frames,
+	const PrimaryStartTable * const primary_start, const real lod_footprint, const int max_bounces, const Scene & scene, RenderTile & tile) noexcept
+{
+	const int xres = tile.xres;
+	const int yres = tile.yres;
+
+	for (int x = x0; x < x1; x += packet_size)
+	{
+		RayPacket packet;
+		PixelSampler samplers[packet_size];
+		packet.num_rays = std::min(packet_size, x1 - x);
+		for (int i = 0; i < packet.num_rays; ++i)
 		{
-			const real r0 = mat.r0;
-			const real p1 = 1 - std::fabs(dot(normal, ray.d));
-			const real p2 = p1 * p1;
-			const real fresnel = r0 + (1 - r0) * p2 * p2 * p1;
-
-			const real mat_u = wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-			sample_specular = mat_u < fresnel;
-			albedo = (sample_specular) ? 0.95f : mat.albedo;
+			samplers[i] = getPixelSampler(x + i, y, frame, xres, yres, pass_samples);
+			const Ray r = generateCameraRay(scene.camera, x + i, y, frame, frames, xres, yres, samplers[i], lod_footprint);
+			packet.o[i] = r.o;
+			packet.d[i] = r.d;
+			packet.t_start[i] = (primary_start != nullptr) ? primary_start->get(x + i, y) : 0;
+			packet.cone_spread[i] = r.cone_spread;
 		}
-		else
+
+		std::pair<const SceneObject *, real> hits[packet_size];
 		{
-			sample_specular = false;
-			albedo = mat.albedo;
+			StatsTimer timer(RenderStats::stage_intersect);
+			statsClearPacketSteps();
+			scene.nearestIntersectionPacket(packet, hits);
 		}
+#if ENABLE_RENDER_STATS
+		for (int i = 0; i < packet.num_rays; ++i)
+			tile.pixels[tile.pixelIndex(x + i, y)].march_steps += (float)thread_stats.packet_steps[i];
+#endif
 
-		// Do direct lighting from a fixed point light
-		if (!sample_specular)
-		{
-			// Compute vector from intersection point to light
-			const vec3r light_pos = { 8, 12, -6 };
-			const vec3r light_vec = light_pos - hit_p;
+		for (int i = 0; i < packet.num_rays; ++i)
+			tracePath({ packet.o[i], packet.d[i], packet.cone_spread[i] }, hits[i], tile.pixelIndex(x + i, y), samplers[i], max_bounces, scene, tile);
+	}
+}
 
-			// Compute reflected light (simple diffuse / Lambertian) with 1/distance^2 falloff
-			const real n_dot_l = dot(normal, light_vec);
-			if (n_dot_l > 0)
-			{
-				const real  light_ln2 = dot(light_vec, light_vec);
-				const real  light_len = std::sqrt(light_ln2);
-				const vec3r light_dir = light_vec * (1 / light_len);
+// Queue of rays in structure-of-arrays layout, each tagged with the index of the path it belongs to
+struct RayQueue
+{
+	std::vector<vec3r> o;
+	std::vector<vec3r> d;
+	std::vector<real> t_start;
+	std::vector<real> cone_spread;
+	std::vector<int> path_idx;
 
-				const vec3f refl_colour = albedo * (float)n_dot_l / (float)(light_ln2 * light_len) * 720; // 420;
 
-				// Trace shadow ray from the hit point towards the light
-				const Ray shadow_ray = { hit_p, light_dir };
-				const auto [shadow_nearest_hit_obj, shadow_nearest_hit_t] = scene.nearestIntersection(shadow_ray);
+	int size() const noexcept { return (int)path_idx.size(); }
 
-				// If we didn't hit anything (null hit obj or length >= length from hit point to light),
-				//  add the directly reflected light to the path contribution
-				if (shadow_nearest_hit_obj == nullptr || shadow_nearest_hit_t >= light_len)
-					contribution += throughput * refl_colour;
-			}
+	void clear() noexcept
+	{
+		o.clear();
+		d.clear();
+		t_start.clear();
+		cone_spread.clear();
+		path_idx.clear();
+	}
+
+	void push(const Ray & r, const int idx, const real t_start_ = 0)
+	{
+		o.push_back(r.o);
+		d.push_back(r.d);
+		t_start.push_back(t_start_);
+		cone_spread.push_back(r.cone_spread);
+		path_idx.push_back(idx);
+	}
+};
+
+
+// Intersect all rays in a queue, batched into packets.
+// With render stats the march steps of each ray are written to march_steps_out if it's given.
+inline void intersectQueue(const RayQueue & queue, const Scene & scene, std::vector<std::pair<const SceneObject *, real>> & hits_out,
+	std::vector<uint32_t> * const march_steps_out = nullptr)
+{
+	StatsTimer timer(RenderStats::stage_intersect);
+	const int num_rays = queue.size();
+	hits_out.resize(num_rays);
+	if (march_steps_out != nullptr)
+		march_steps_out->resize(num_rays);
+
+	for (int i = 0; i < num_rays; i += packet_size)
+	{
+		RayPacket packet;
+		packet.num_rays = std::min(packet_size, num_rays - i);
+		for (int j = 0; j < packet.num_rays; ++j)
+		{
+			packet.o[j] = queue.o[i + j];
+			packet.d[j] = queue.d[i + j];
+			packet.t_start[j] = queue.t_start[i + j];
+			packet.cone_spread[j] = queue.cone_spread[i + j];
 		}
 
-		if (++bounce > max_bounces)
-			break;
+		statsClearPacketSteps();
+		scene.nearestIntersectionPacket(packet, &hits_out[i]);
+#if ENABLE_RENDER_STATS
+		if (march_steps_out != nullptr)
+			std::copy(thread_stats.packet_steps, thread_stats.packet_steps + packet.num_rays, &(*march_steps_out)[i]);
+#endif
+	}
+}
 
-		// Terminate the path unconditionally if the albedo is super low or zero
-		const float max_albedo = std::max(std::max(albedo.x(), albedo.y()), albedo.z());
-		if (max_albedo < 1e-8f)
-			break;
 
-		// Use Russian roulette on albedo to possibly terminate the path after 2 bounces
-		if (bounce > 2)
+// Test all shadow rays in a queue for occlusion before their max_t, batched into packets
+inline void occludedQueue(const RayQueue & queue, const std::vector<ShadowRay> & shadow_rays, const Scene & scene, std::vector<char> & occluded_out)
+{
+	StatsTimer timer(RenderStats::stage_shadow);
+	const int num_rays = queue.size();
+	occluded_out.resize(num_rays);
+
+	for (int i = 0; i < num_rays; i += packet_size)
+	{
+		RayPacket packet;
+		real max_t[packet_size];
+		packet.num_rays = std::min(packet_size, num_rays - i);
+		for (int j = 0; j < packet.num_rays; ++j)
 		{
-			const float rr_u = (float)wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-			const float rr_thresh = std::max(0.0f, std::min(1.0f, max_albedo));
-			if (rr_u > rr_thresh)
-				break;
-			throughput *= (1.0f / rr_thresh);
+			packet.o[j] = queue.o[i + j];
+			packet.d[j] = queue.d[i + j];
+			packet.t_start[j] = 0;
+			packet.cone_spread[j] = queue.cone_spread[i + j];
+			max_t[j] = shadow_rays[i + j].max_t;
+			statsCountShadowRay();
 		}
 
-		vec3r new_dir;
-		if (sample_specular)
+		bool occluded[packet_size];
+		scene.occludedPacket(packet, max_t, occluded);
+		for (int j = 0; j < packet.num_rays; ++j)
+			occluded_out[i + j] = occluded[j];
+	}
+}
+
+
+// Per-thread buffers for the wavefront integrator, kept between buckets to avoid reallocation
+struct WavefrontState
+{
+	std::vector<PathState> paths;
+	std::vector<int> active_paths;
+	std::vector<int> next_active_paths;
+
+	RayQueue ray_queue;
+	RayQueue shadow_queue;
+	std::vector<ShadowRay> shadow_rays;
+
+	std::vector<std::pair<const SceneObject *, real>> hits;
+	std::vector<char> shadow_occluded;
+	std::vector<uint32_t> march_steps; // Of the camera rays, only with render stats
+};
+
+
+// Wavefront integrator: instead of tracing each path to completion, all paths of a bucket are advanced together
+//  one stage at a time (intersection, shading, shadow rays), with terminated paths compacted away after each bounce.
+// Each path goes through exactly the same stages as in tracePath, so the result is identical.
+inline void renderBucketWavefront(const int x0, const int x1, const int y0, const int y1,
+	const int frame, const PassSamples & pass_samples, const int frames, const PrimaryStartTable * const primary_start, const real lod_footprint,
+	const int max_bounces, const Scene & scene, RenderTile & tile, WavefrontState & state)
+{
+	const int xres = tile.xres;
+	const int yres = tile.yres;
+
+	// Generate camera rays for all pixels in the bucket
+	state.paths.clear();
+	state.active_paths.clear();
+	for (int y = y0; y < y1; ++y)
+	for (int x = x0; x < x1; ++x)
+	{
+		PixelSampler sampler = getPixelSampler(x, y, frame, xres, yres, pass_samples);
+		const Ray camera_ray = generateCameraRay(scene.camera, x, y, frame, frames, xres, yres, sampler, lod_footprint);
+
+		state.active_paths.push_back((int)state.paths.size());
+		const real t_start = (primary_start != nullptr) ? primary_start->get(x, y) : 0;
+		state.paths.push_back(startPath(camera_ray, tile.pixelIndex(x, y), sampler, t_start, max_bounces));
+	}
+
+	bool camera_rays = true;
+	while (!state.active_paths.empty())
+	{
+		// Intersect all active paths
+		state.ray_queue.clear();
+		for (const int path_idx : state.active_paths)
 		{
-			new_dir = ray.d - normal * (2 * dot(normal, ray.d));
+			state.ray_queue.push(state.paths[path_idx].ray, path_idx, state.paths[path_idx].t_start);
+			statsCountRay(state.paths[path_idx].bounce);
 		}
-		else
+		intersectQueue(state.ray_queue, scene, state.hits, (ENABLE_RENDER_STATS && camera_rays) ? &state.march_steps : nullptr);
+#if ENABLE_RENDER_STATS
+		if (camera_rays)
+			for (int i = 0; i < state.ray_queue.size(); ++i)
+				tile.pixels[state.paths[state.ray_queue.path_idx[i]].pixel_idx].march_steps += (float)state.march_steps[i];
+#endif
+		camera_rays = false;
+
+		// Shade hits and misses, queueing shadow rays and surviving paths
+		state.shadow_queue.clear();
+		state.shadow_rays.clear();
+		state.next_active_paths.clear();
+		for (int i = 0; i < state.ray_queue.size(); ++i)
 		{
-			const real refl_sample_x = wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-			const real refl_sample_y = wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
+			const int path_idx = state.ray_queue.path_idx[i];
+			PathState & path = state.paths[path_idx];
 
-			// Generate uniform point on sphere, see https://mathworld.wolfram.com/SpherePointPicking.html
-			const real a = refl_sample_x * two_pi;
-			const real s = 2 * std::sqrt(std::max(static_cast<real>(0), refl_sample_y * (1 - refl_sample_y)));
-			const vec3r sphere =
+			if (state.hits[i].first == nullptr)
 			{
-				std::cos(a) * s,
-				std::sin(a) * s,
-				1 - 2 * refl_sample_y
-			};
+				shadeMiss(path);
+				continue;
+			}
+
+			ShadowRay shadow_ray;
+			bool has_shadow_ray;
+			if (shadeHit(path, state.hits[i].first, state.hits[i].second, scene.lights, shadow_ray, has_shadow_ray))
+				state.next_active_paths.push_back(path_idx);
 
-			// Generate new cosine-weighted exitant direction
-			new_dir = normalise(normal + sphere);
+			if (has_shadow_ray)
+			{
+				state.shadow_queue.push(shadow_ray.ray, path_idx);
+				state.shadow_rays.push_back(shadow_ray);
+			}
 		}
 
-		// Multiply the throughput by the surface reflection
-		throughput *= albedo;
+		// Trace all shadow rays with batched any-hit queries
+		occludedQueue(state.shadow_queue, state.shadow_rays, scene, state.shadow_occluded);
+		for (int i = 0; i < state.shadow_queue.size(); ++i)
+			shadeShadow(state.paths[state.shadow_queue.path_idx[i]], state.shadow_rays[i], state.shadow_occluded[i] != 0);
 
-		// Start next bounce from the hit position in the scattered ray direction
-		ray.o = hit_p;
-		ray.d = new_dir;
+		// Compact terminated paths
+		std::swap(state.active_paths, state.next_active_paths);
 	}
 
-	output.beauty[pixel_idx] += contribution;
-	output.normal[pixel_idx] += normal_out;
-	output.albedo[pixel_idx] += albedo_out;
+	for (const PathState & path : state.paths)
+		writePath(path, tile);
 }
 
 
 void renderThreadFunction(
 	ThreadControl * const thread_control,
+	const int worker,
 	RenderOutput * const output,
-	const int frame, const int base_pass, const int frames, const Scene * const scene_) noexcept
+	const int frame, const int frames, const Scene & scene) noexcept
 {
-	const int xres = output->xres;
-	const int yres = output->yres;
+	const int xres = output->image_xres;
+	const int yres = output->image_yres;
+	const int num_passes = thread_control->num_passes;
+	TileScheduler & scheduler = *thread_control->scheduler;
+	const SampleTable & samples = *thread_control->samples;
+	PrimaryStartTable * const primary_start = thread_control->primary_start;
+	const real lod_footprint = thread_control->lod_footprint;
+	const int max_bounces = thread_control->max_bounces;
+
+	WavefrontState wavefront_state;
+	RenderTile tile;
+	while (!thread_control->cancelled())
+	{
+		// Get the next tile, possibly stolen from another thread, and exit if we're done
+		const int tile_idx = scheduler.getTile(worker);
+		if (tile_idx < 0)
+			break;
 
-	// Make a local copy of the world for this thread, needed because it will get modified during init
-	Scene scene(*scene_);
+		const auto t1 = std::chrono::steady_clock::now();
+		StatsTimer timer(RenderStats::num_stages);
+
+		// Render all passes of this tile locally, then write it out once.
+		// Tiles are scheduled over the output's buffers, which can be a window of the image.
+		const Tile & bucket = scheduler.getTileInfo(tile_idx);
+		const Tile t = { bucket.x0 + output->x0, bucket.y0 + output->y0, bucket.x1 + output->x0, bucket.y1 + output->y0, bucket.bucket };
+		tile.reset(xres, yres, t.x0, t.y0, t.x1, t.y1);
+		if (primary_start != nullptr)
+			primary_start->computeRect(t.x0, t.y0, t.x1, t.y1, scene);
+		for (int sub_pass = 0; sub_pass < num_passes && !thread_control->cancelled(); ++sub_pass)
+		{
+			if (thread_control->use_wavefront)
+			{
+				renderBucketWavefront(t.x0, t.x1, t.y0, t.y1, frame, samples.getPass(sub_pass), frames, primary_start, lod_footprint, max_bounces, scene, tile, wavefront_state);
+			}
+			else
+			{
+				for (int y = t.y0; y < t.y1 && !thread_control->cancelled(); ++y)
+					renderSpan(t.x0, t.x1, y, frame, samples.getPass(sub_pass), frames, primary_start, lod_footprint, max_bounces, scene, tile);
+			}
+		}
 
-	// Get rounded up number of buckets in x and y
-	constexpr int bucket_size = 32;
-	const int x_buckets = (xres + bucket_size - 1) / bucket_size;
-	const int y_buckets = (yres + bucket_size - 1) / bucket_size;
-	const int num_buckets = x_buckets * y_buckets;
-	const int num_passes = thread_control->num_passes;
+		// A cancelled tile is thrown away, so the output only ever gets whole passes of a tile
+		if (thread_control->cancelled())
+			break;
+		tile.mergeInto(*output);
 
-	while (true)
+		const auto t2 = std::chrono::steady_clock::now();
+		scheduler.reportCost(tile_idx, std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count());
+	}
+}
+
+
+// Adaptive sampling: estimates the noise of each bucket from the per-pixel variance,
+// so that buckets which have converged can be left out of further passes
+struct AdaptiveSampler
+{
+	float error_threshold = 0.01f; // Relative standard error of the mean below which a bucket is converged
+	int min_passes = 16; // Don't trust the variance estimate before this many passes
+
+	std::vector<int> active_buckets; // Buckets that still need more passes, noisiest first
+
+
+	AdaptiveSampler(const int xres, const int yres) :
+		x_buckets((xres + bucket_size - 1) / bucket_size),
+		y_buckets((yres + bucket_size - 1) / bucket_size)
 	{
-		// Get the next bucket index atomically and exit if we're done
-		const int bucket = thread_control->next_bucket.fetch_add(1);
-		if (bucket >= num_buckets * num_passes)
-			break;
+		reset();
+	}
 
-		// Get sub-pass and pixel ranges for current bucket
-		const int sub_pass  = bucket / num_buckets;
-		const int bucket_p  = bucket - num_buckets * sub_pass;
-		const int bucket_y  = bucket_p / x_buckets;
-		const int bucket_x  = bucket_p - x_buckets * bucket_y;
-		const int bucket_x0 = bucket_x * bucket_size, bucket_x1 = std::min(bucket_x0 + bucket_size, xres);
-		const int bucket_y0 = bucket_y * bucket_size, bucket_y1 = std::min(bucket_y0 + bucket_size, yres);
+	void reset()
+	{
+		active_buckets.resize(x_buckets * y_buckets);
+		for (int i = 0; i < x_buckets * y_buckets; ++i)
+			active_buckets[i] = i;
+	}
+
+	bool converged() const noexcept { return active_buckets.empty(); }
 
+	// Remove converged buckets and sort the remaining ones by decreasing error
+	void update(const RenderOutput & output)
+	{
+		std::vector<std::pair<float, int>> bucket_errors;
+		for (const int bucket : active_buckets)
+		{
+			const float error = bucketError(output, bucket);
+			if (error >= error_threshold)
+				bucket_errors.push_back({ error, bucket });
+		}
+
+		std::stable_sort(bucket_errors.begin(), bucket_errors.end(), [](const auto & a, const auto & b) { return a.first > b.first; });
+
+		active_buckets.clear();
+		for (const auto & e : bucket_errors)
+			active_buckets.push_back(e.second);
+	}
+
+private:
+	const int x_buckets, y_buckets;
+
+	// Average relative error of the pixels in a bucket, or infinity if there aren't enough passes yet
+	float bucketError(const RenderOutput & output, const int bucket) const noexcept
+	{
+		const int bucket_y  = bucket / x_buckets;
+		const int bucket_x  = bucket - x_buckets * bucket_y;
+		const int bucket_x0 = bucket_x * bucket_size, bucket_x1 = std::min(bucket_x0 + bucket_size, output.xres);
+		const int bucket_y0 = bucket_y * bucket_size, bucket_y1 = std::min(bucket_y0 + bucket_size, output.yres);
+
+		float error_sum = 0;
 		for (int y = bucket_y0; y < bucket_y1; ++y)
 		for (int x = bucket_x0; x < bucket_x1; ++x)
-			render(x, y, frame, base_pass + sub_pass, frames, scene, *output);
+		{
+			const int pixel_idx = y * output.xres + x;
+			const int n = output.pixel_passes[pixel_idx];
+			if (n < min_passes)
+				return std::numeric_limits<float>::infinity();
+
+			// Unbiased sample variance from the sums of luminance and squared luminance
+			const float mean = luminance(output.beauty[pixel_idx]) / n;
+			const float variance = std::max(0.0f, (output.beauty_lum2[pixel_idx] - mean * mean * n) / (n - 1));
+
+			// Relative to the pixel brightness, with an offset so that near-black pixels don't need a huge number of passes
+			error_sum += std::sqrt(variance / n) / (mean + 0.01f);
+		}
+
+		return error_sum / ((bucket_x1 - bucket_x0) * (bucket_y1 - bucket_y0));
 	}
-}
+};
+
+
+// Long-lived pool of render threads, which keeps the threads alive across passes and frames,
+// so that short progressive passes don't pay for startup. The scene is immutable and shared by all threads while rendering,
+// but it can be swapped for another one between renderPasses calls, e.g. to render a batch of scenes.
+struct RenderThreadPool
+{
+	bool use_wavefront = false; // Render buckets with the wavefront integrator
+	bool use_cone_prepass = false; // Start camera rays past the empty space found by cone marching each block of pixels once
+	real lod_footprint = 0; // Hit DE objects within this many pixels' footprint instead of DE_thresh, at a matching level of detail
+	int max_bounces = default_max_bounces; // Path length limit after the camera ray, e.g. 1 for a fast preview
+
+	const Sampler * sampler = &halton_sampler; // Sequence used for all pixels, can be replaced before rendering
+
+	RenderStats stats; // Counters summed over all threads for the last renderPasses call, only counted with ENABLE_RENDER_STATS
+
+
+	RenderThreadPool(const int num_threads, const Scene & scene_) : scene(&scene_), scheduler(num_threads)
+	{
+		threads.resize(num_threads);
+		for (int i = 0; i < num_threads; ++i)
+			threads[i] = std::thread(&RenderThreadPool::workerFunction, this, i);
+	}
+
+	~RenderThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		start_cv.notify_all();
+
+		for (std::thread & t : threads) t.join();
+	}
+
+	RenderThreadPool(const RenderThreadPool &) = delete;
+	RenderThreadPool & operator=(const RenderThreadPool &) = delete;
+
+	int numThreads() const noexcept { return (int)threads.size(); }
+
+	// Render a different scene from the next renderPasses call on, the start distances of the old one are thrown away
+	void setScene(const Scene & scene_) noexcept
+	{
+		scene = &scene_;
+		primary_start.reset(0, 0);
+	}
+
+	// Time between the first and the last thread running out of work in the last renderPasses call
+	double tailLatency() const noexcept { return scheduler.tail_latency; }
+
+	// Submit a range of passes to all threads and wait for them to complete, optionally only rendering the given buckets.
+	// Setting cancel from another thread stops the render early, with only some of the tiles merged into the output;
+	// returns false if that happened.
+	bool renderPasses(RenderOutput & output, const int frame, const int base_pass, const int num_passes, const int frames,
+		const std::vector<int> * const buckets = nullptr, const std::atomic<bool> * const cancel = nullptr) noexcept
+	{
+		sample_table.build(*sampler, base_pass, num_passes);
+		// The camera only stays put for stills
+		const bool use_primary_start = use_cone_prepass && frames <= 0;
+		if (use_primary_start && !primary_start.covers(output))
+			primary_start.reset(output.image_xres, output.image_yres, output.x0, output.y0, output.x0 + output.xres, output.y0 + output.yres);
+
+		ThreadControl thread_control = { num_passes, use_wavefront, &scheduler, &sample_table, use_primary_start ? &primary_start : nullptr, lod_footprint,
+			max_bounces, cancel };
+		scheduler.prepare(output.xres, output.yres, buckets);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		stats.clear();
+		job = { &thread_control, &output, frame, frames };
+		num_running = (int)threads.size();
+		job_generation++;
+		start_cv.notify_all();
+
+		// Barrier: wait until every thread has run out of buckets
+		done_cv.wait(lock, [&]() { return num_running == 0; });
+
+		// The timings of a cancelled render are incomplete, keep the previous bucket costs
+		if (thread_control.cancelled())
+			return false;
+
+		scheduler.finish(num_passes);
+		return true;
+	}
+
+private:
+	struct Job
+	{
+		ThreadControl * thread_control;
+		RenderOutput * output;
+		int frame, frames;
+	};
+
+	void workerFunction(const int worker) noexcept
+	{
+		uint64_t last_generation = 0;
+		while (true)
+		{
+			Job current_job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_cv.wait(lock, [&]() { return quit || job_generation != last_generation; });
+				if (quit)
+					return;
+
+				last_generation = job_generation;
+				current_job = job;
+			}
+
+#if ENABLE_RENDER_STATS
+			thread_stats.clear();
+#endif
+			renderThreadFunction(current_job.thread_control, worker, current_job.output,
+				current_job.frame, current_job.frames, *scene);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+#if ENABLE_RENDER_STATS
+				stats.add(thread_stats);
+#endif
+				if (--num_running == 0)
+					done_cv.notify_one();
+			}
+		}
+	}
+
+	const Scene * scene;
+	std::vector<std::thread> threads;
+	TileScheduler scheduler;
+	HaltonSampler halton_sampler;
+	SampleTable sample_table;
+	PrimaryStartTable primary_start;
+
+	std::mutex mutex;
+	std::condition_variable start_cv;
+	std::condition_variable done_cv;
+	Job job = { };
+	uint64_t job_generation = 0;
+	int num_running = 0;
+	bool quit = false;
+};
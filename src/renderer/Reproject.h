@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include "maths/vec.h"
+#include "Renderer.h"
+
+
+
+// Warp a finished render to a new camera by scattering every pixel to its first hit position and projecting that into the
+// new view, keeping the nearest pixel where several land on the same one. Each reprojected pixel is scaled down to at most
+// max_passes worth of samples, so that a fresh render accumulated on top quickly replaces it. Pixels that nothing lands on
+// are left with zero passes and show up as holes until they're rendered.
+inline void reproject(const RenderOutput & prev, const Camera & prev_cam, const Camera & cam, const int max_passes, RenderOutput & out) noexcept
+{
+	out.clear();
+
+	const int xres = out.xres, yres = out.yres;
+	const real inv_pixel_x2 = 1 / dot(cam.pixel_x, cam.pixel_x);
+	const real inv_pixel_y2 = 1 / dot(cam.pixel_y, cam.pixel_y);
+	std::vector<float> z_buffer(xres * yres, std::numeric_limits<float>::infinity());
+
+	for (int y = 0; y < prev.yres; ++y)
+	for (int x = 0; x < prev.xres; ++x)
+	{
+		const int prev_idx = y * prev.xres + x;
+		const int passes = prev.pixel_passes[prev_idx];
+		if (passes <= 0)
+			continue;
+
+		// First hit position along the ray through the pixel centre, ignoring the lens
+		const float depth = prev.depth[prev_idx] / passes;
+		const vec3r hit_p = prev_cam.pos + normalise(prev_cam.pixelVector(x, y, 0, 0)) * depth;
+
+		// Project onto the new image plane at unit distance along forward
+		const vec3r v = hit_p - cam.pos;
+		const real v_forward = dot(v, cam.forward);
+		if (v_forward <= 0)
+			continue;
+
+		const vec3r q = v / v_forward;
+		const int new_x = (int)std::floor(dot(q, cam.pixel_x) * inv_pixel_x2 + xres * 0.5f);
+		const int new_y = (int)std::floor(dot(q, cam.pixel_y) * inv_pixel_y2 + yres * 0.5f);
+		if (new_x < 0 || new_x >= xres || new_y < 0 || new_y >= yres)
+			continue;
+
+		const int pixel_idx = new_y * xres + new_x;
+		const float new_depth = (float)length(v);
+		if (new_depth >= z_buffer[pixel_idx])
+			continue;
+		z_buffer[pixel_idx] = new_depth;
+
+		const int new_passes = std::min(passes, max_passes);
+		const float scale = new_passes / (float)passes;
+		out.beauty[pixel_idx] = prev.beauty[prev_idx] * scale;
+		out.normal[pixel_idx] = prev.normal[prev_idx] * scale;
+		out.albedo[pixel_idx] = prev.albedo[prev_idx] * scale;
+		out.beauty_lum2[pixel_idx] = prev.beauty_lum2[prev_idx] * scale;
+		out.depth[pixel_idx] = new_depth * new_passes;
+		out.pixel_passes[pixel_idx] = new_passes;
+		out.hit_passes[pixel_idx] = (int)(prev.hit_passes[prev_idx] * scale + 0.5f);
+	}
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "maths/real.h"
+
+
+
+// From PBRT
+inline double RadicalInverse(int a, int base) noexcept
+{
+	const double invBase = 1.0 / base;
+
+	int reversedDigits = 0;
+	double invBaseN = 1;
+	while (a)
+	{
+		const int next  = a / base;
+		const int digit = a - base * next;
+		reversedDigits = reversedDigits * base + digit;
+		invBaseN *= invBase;
+		a = next;
+	}
+
+	return std::min(reversedDigits * invBaseN, DoubleOneMinusEpsilon);
+}
+
+
+// Base 2 radical inverse by reversing the bits, which gives exactly the same result as the general version
+inline double RadicalInverseBase2(const int a) noexcept
+{
+	uint32_t v = (uint32_t)a;
+	v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+	v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+	v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+	v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+	v = (v >> 16) | (v << 16);
+
+	return v * (1.0 / 4294967296.0);
+}
+
+
+inline real wrap1r(real u, real v) { return (u + v < 1) ? u + v : u + v - 1; }
+
+
+// Source of the low-discrepancy sequence that all pixels share for each pass, decorrelated per pixel by a random offset.
+// The values don't depend on the pixel, so they're computed once per pass into a SampleTable.
+struct Sampler
+{
+	virtual ~Sampler() { }
+
+	// Number of dimensions before the sequence wraps around and reuses them
+	virtual int getNumDimensions() const noexcept = 0;
+
+	// Write the value of every dimension for a pass, each in [0, 1)
+	virtual void getPassSamples(const int pass, real * samples_out) const noexcept = 0;
+};
+
+
+// Halton sequence over the first few primes
+struct HaltonSampler final : public Sampler
+{
+	int getNumDimensions() const noexcept override { return num_primes; }
+
+	void getPassSamples(const int pass, real * samples_out) const noexcept override
+	{
+		samples_out[0] = (real)RadicalInverseBase2(pass);
+		for (int d = 1; d < num_primes; ++d)
+			samples_out[d] = (real)RadicalInverse(pass, primes[d]);
+	}
+
+private:
+	constexpr static int num_primes = 6;
+	constexpr static int primes[num_primes] = { 2, 3, 5, 7, 11, 13 };
+};
+
+
+// Sequence values for one pass
+struct PassSamples
+{
+	const real * values;
+	int num_dims;
+};
+
+
+// Sequence values for a range of passes, computed before rendering and then read by all render threads
+struct SampleTable
+{
+	int num_dims = 0;
+	std::vector<real> values; // num_dims values per pass
+
+
+	void build(const Sampler & sampler, const int base_pass, const int num_passes)
+	{
+		num_dims = sampler.getNumDimensions();
+		values.resize((size_t)num_dims * num_passes);
+		for (int i = 0; i < num_passes; ++i)
+			sampler.getPassSamples(base_pass + i, &values[(size_t)num_dims * i]);
+	}
+
+	PassSamples getPass(const int sub_pass) const noexcept { return { &values[(size_t)num_dims * sub_pass], num_dims }; }
+};
+
+
+// Per-pixel state of the random sequence, shared by camera ray generation and path tracing
+struct PixelSampler
+{
+	PassSamples pass_samples;
+	int dim;
+	real hash_random;
+
+
+	// Get the next dimension of the sequence with this pixel's offset
+	real next() noexcept
+	{
+		const real u = pass_samples.values[dim];
+		dim = (dim + 1 < pass_samples.num_dims) ? dim + 1 : 0;
+		return wrap1r(u, hash_random);
+	}
+};
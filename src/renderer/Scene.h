@@ -1,25 +1,49 @@
 #pragma once
 
 #include <vector>
+#include <stdint.h>
+#include <string.h>
 
 #include "scene_objects/SceneObject.h"
+#include "BVH.h"
+#include "Lights.h"
 
 
 
+// Camera aimed at a point, animations orbit the position around the vertical axis through the origin
+struct CameraDesc
+{
+	vec3r position = vec3r{ 4, 5, -10 } * 0.2f;
+	vec3r lookat = { 0, -0.125f, 0 };
+	real fov_deg = 80; // Horizontal field of view
+	real focus = 0.65f; // Focal distance as a fraction of the distance to lookat
+	real lens_radius = 0.0125f;
+};
+
+
 struct Scene
 {
 	std::vector<SceneObject *> objects;
+	CameraDesc camera;
+	PointLight light;
+
+	BVH bvh; // Call buildBVH() after adding objects and setting the light, and before rendering
+	LightList lights; // Built along with the BVH
 
 
 	Scene() = default;
 
 	// Copy constructor
-	Scene(const Scene & s)
+	Scene(const Scene & s) : camera(s.camera), light(s.light)
 	{
 		objects.resize(s.objects.size());
 
 		for (size_t i = 0; i < s.objects.size(); ++i)
 			objects[i] = s.objects[i]->clone();
+
+		// The BVH refers to the objects, so it can't be copied
+		if (!s.bvh.nodes.empty())
+			buildBVH();
 	}
 
 	// Scene owns all the object pointers, so delete them
@@ -29,21 +53,63 @@ struct Scene
 			delete o;
 	}
 
-	std::pair<SceneObject *, real> nearestIntersection(const Ray & r) noexcept
+	void buildBVH(const int num_threads = 1)
 	{
-		SceneObject * nearest_obj = nullptr;
-		real nearest_t = real_inf;
+		bvh.build(objects, num_threads);
+		lights.build(light, objects);
+	}
 
-		for (SceneObject * const o : objects)
+	// Hash of the camera, light, object bounds and materials, to detect when saved render state belongs to a different scene.
+	// Formula parameters aren't visible through SceneObject, so this won't catch every change.
+	uint64_t fingerprint() const noexcept
+	{
+		uint64_t h = 14695981039346656037ull; // FNV-1a
+		const auto hashBytes = [&](const void * data, const size_t size)
+		{
+			for (size_t i = 0; i < size; ++i)
+				h = (h ^ ((const uint8_t *)data)[i]) * 1099511628211ull;
+		};
+
+		const real camera_values[9] = { camera.position.x(), camera.position.y(), camera.position.z(), camera.lookat.x(), camera.lookat.y(), camera.lookat.z(),
+			camera.fov_deg, camera.focus, camera.lens_radius };
+		const real light_values[6] = { light.position.x(), light.position.y(), light.position.z(), light.intensity.x(), light.intensity.y(), light.intensity.z() };
+		hashBytes(camera_values, sizeof(camera_values));
+		hashBytes(light_values, sizeof(light_values));
+
+		const uint64_t num_objects = objects.size();
+		hashBytes(&num_objects, sizeof(num_objects));
+		for (const SceneObject * const o : objects)
 		{
-			const real hit_t = o->intersect(r);
-			if (hit_t > ray_epsilon && hit_t < nearest_t)
-			{
-				nearest_obj = o;
-				nearest_t = hit_t;
-			}
+			vec3r centre;
+			real radius;
+			o->getBoundingSphere(centre, radius);
+			const Material & m = o->mat;
+			const real bounds[4] = { centre.x(), centre.y(), centre.z(), radius };
+			const float material[8] = { m.albedo.x(), m.albedo.y(), m.albedo.z(), m.emission.x(), m.emission.y(), m.emission.z(), m.r0, (float)m.use_fresnel };
+			hashBytes(bounds, sizeof(bounds));
+			hashBytes(material, sizeof(material));
 		}
+		return h;
+	}
+
+	std::pair<const SceneObject *, real> nearestIntersection(const Ray & r) const noexcept
+	{
+		return bvh.nearestIntersection(r);
+	}
 
-		return { nearest_obj, nearest_t };
+	// Returns true if there's any intersection closer than max_t, e.g. for shadow rays
+	bool occluded(const Ray & r, const real max_t) const noexcept
+	{
+		return bvh.occluded(r, max_t);
+	}
+
+	void occludedPacket(const RayPacket & packet, const real * max_t, bool * occluded_out) const noexcept
+	{
+		bvh.occludedPacket(packet, max_t, occluded_out);
+	}
+
+	void nearestIntersectionPacket(const RayPacket & packet, std::pair<const SceneObject *, real> * hits_out) const noexcept
+	{
+		bvh.nearestIntersectionPacket(packet, hits_out);
 	}
 };
@@ -0,0 +1,574 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+#include "Scene.h"
+
+#include "scene_objects/SimpleObjects.h"
+#include "scene_objects/DualDEObject.h"
+
+#include "formulas/Mandelbulb.h"
+#include "formulas/MengerSponge.h"
+#include "formulas/MengerSpongeC.h"
+#include "formulas/Cubicbulb.h"
+#include "formulas/Amazingbox.h"
+#include "formulas/Octopus.h"
+#include "formulas/PseudoKleinian.h"
+#include "formulas/MandalayKIFS.h"
+#include "formulas/BenesiPine2.h"
+#include "formulas/RiemannSphere.h"
+#include "formulas/SphereTree.h"
+
+
+
+// Loads scenes from text files, so that changing the scene or sweeping a parameter doesn't need a recompile.
+// Each line is a keyword followed by its numbers, # starts a comment. A line with just one of these keywords starts a block,
+// and the lines after it set the block's parameters:
+//
+//   camera  position, lookat, fov, focus, lens_radius, see CameraDesc
+//   light   position, intensity
+//   sphere  centre, radius and the material parameters albedo, emission, fresnel, r0
+//   hybrid  GeneralDualDE with max_iters, radius, step_scale, over_relaxation, adaptive_step_scale, directional_march,
+//           adaptive_precision and the material parameters. The iteration functions are lines of
+//           "formula <name> <parameter> <values> ...", and "sequence <indices>" gives their order, which defaults to all in turn.
+//           A de_cache line builds a DE cache, which is reused by later loads of a hybrid with the same formulas.
+//
+// Any value can also be $name, to be replaced by the words of a variable. Variables are set with "set <name> <words>" lines,
+// but the ones given in SceneLoader::variables take precedence, so a batch of renders can vary them without editing the file.
+// The demo scene with the sponge bulb as a GeneralDualDE:
+//
+//   sphere
+//       centre 0 -129.5 0
+//       radius 128
+//       albedo 0.8 0.2 0.05
+//       fresnel 1
+//   hybrid
+//       radius 1.5
+//       step_scale 0.25
+//       albedo 0.1 0.3 0.7
+//       fresnel 1
+//       formula Mandelbulb
+//       formula MengerSpongeC scale 3 scale_centre 1 1 1
+//       sequence 0 1
+struct SceneLoader
+{
+	int num_threads = 1; // For building BVHs and DE caches
+	std::map<std::string, std::string> variables; // Replace $name in the scene file, overriding its own set lines
+	std::string error; // What went wrong when load() fails, with the line number
+
+
+	// Add the objects, camera and light from a scene file to the scene and build its BVH, returns false on error
+	bool load(const char * filename, Scene & scene)
+	{
+		error.clear();
+		std::vector<Block> blocks;
+		if (!parse(filename, blocks))
+			return false;
+
+		for (Block & b : blocks)
+		{
+			if (b.type == "camera")
+			{
+				getVec3r(b, "position", scene.camera.position);
+				getVec3r(b, "lookat", scene.camera.lookat);
+				getReal(b, "fov", scene.camera.fov_deg);
+				getReal(b, "focus", scene.camera.focus);
+				getReal(b, "lens_radius", scene.camera.lens_radius);
+			}
+			else if (b.type == "light")
+			{
+				getVec3r(b, "position", scene.light.position);
+				getVec3f(b, "intensity", scene.light.intensity);
+			}
+			else if (b.type == "sphere")
+			{
+				Sphere s;
+				getVec3r(b, "centre", s.centre);
+				getReal(b, "radius", s.radius);
+				getMaterial(b, s.mat);
+				scene.objects.push_back(s.clone());
+			}
+			else // hybrid
+			{
+				SceneObject * const hybrid = makeHybrid(b);
+				if (hybrid == nullptr)
+					return false;
+				scene.objects.push_back(hybrid);
+			}
+
+			if (!error.empty() || !checkAllUsed(b.settings))
+				return false;
+		}
+
+		scene.buildBVH(num_threads);
+		return true;
+	}
+
+private:
+	struct Setting
+	{
+		std::string name;
+		std::vector<real> values;
+		int line;
+		bool used;
+	};
+
+	struct Formula
+	{
+		std::string name;
+		std::vector<Setting> settings;
+		int line;
+	};
+
+	struct Block
+	{
+		std::string type;
+		std::vector<Setting> settings;
+		std::vector<Formula> formulas;
+		int line;
+	};
+
+	std::map<uint64_t, std::shared_ptr<const DECache>> de_caches; // From earlier loads, by hash of the hybrid's DE parameters
+
+
+	bool fail(const int line, const std::string & message)
+	{
+		error = "line " + std::to_string(line) + ": " + message;
+		return false;
+	}
+
+	static bool isBlockType(const std::string & word)
+	{
+		return word == "camera" || word == "light" || word == "sphere" || word == "hybrid";
+	}
+
+	static bool parseNumber(const std::string & word, real & value_out)
+	{
+		char * end;
+		value_out = (real)strtod(word.c_str(), &end);
+		return !word.empty() && *end == 0;
+	}
+
+	static std::vector<std::string> splitWords(const std::string & s)
+	{
+		std::vector<std::string> words;
+		size_t i = 0;
+		while (true)
+		{
+			while (i < s.size() && isspace((unsigned char)s[i])) ++i;
+			if (i == s.size())
+				return words;
+
+			const size_t start = i;
+			while (i < s.size() && !isspace((unsigned char)s[i])) ++i;
+			words.push_back(s.substr(start, i - start));
+		}
+	}
+
+	// Read the file into blocks of settings, substituting the variables
+	bool parse(const char * filename, std::vector<Block> & blocks_out)
+	{
+		FILE * const f = fopen(filename, "rb");
+		if (f == nullptr)
+		{
+			error = std::string("couldn't open ") + filename;
+			return false;
+		}
+
+		std::vector<std::string> lines(1);
+		for (int c = fgetc(f); c != EOF; c = fgetc(f))
+		{
+			if (c == '\n')
+				lines.emplace_back();
+			else
+				lines.back() += (char)c;
+		}
+		fclose(f);
+
+		std::map<std::string, std::string> file_variables;
+		for (int i = 0; i < (int)lines.size(); ++i)
+		{
+			const int line = i + 1;
+			const std::string & text = lines[i];
+			const std::vector<std::string> raw_words = splitWords(text.substr(0, text.find('#')));
+			if (raw_words.empty())
+				continue;
+
+			if (raw_words[0] == "set")
+			{
+				if (raw_words.size() < 3)
+					return fail(line, "set needs a name and a value");
+				std::string value;
+				for (size_t w = 2; w < raw_words.size(); ++w)
+					value += raw_words[w] + " ";
+				file_variables[raw_words[1]] = value;
+				continue;
+			}
+
+			// Substitute variables, which can expand to several words
+			std::vector<std::string> words;
+			for (const std::string & w : raw_words)
+			{
+				if (w[0] != '$')
+				{
+					words.push_back(w);
+					continue;
+				}
+
+				const std::string name = w.substr(1);
+				const auto v = variables.find(name);
+				const auto fv = file_variables.find(name);
+				if (v == variables.end() && fv == file_variables.end())
+					return fail(line, "undefined variable " + name);
+
+				for (const std::string & vw : splitWords((v != variables.end()) ? v->second : fv->second))
+					words.push_back(vw);
+			}
+
+			if (words.empty())
+				continue;
+			if (words.size() == 1 && isBlockType(words[0]))
+			{
+				blocks_out.push_back({ words[0], {}, {}, line });
+				continue;
+			}
+			if (blocks_out.empty())
+				return fail(line, "expected camera, light, sphere or hybrid before " + words[0]);
+
+			Block & block = blocks_out.back();
+			if (words[0] == "formula" && block.type == "hybrid")
+			{
+				if (words.size() < 2)
+					return fail(line, "formula needs a name");
+
+				// Parameters are a name followed by its numbers
+				Formula formula = { words[1], {}, line };
+				for (size_t w = 2; w < words.size(); ++w)
+				{
+					real value;
+					if (parseNumber(words[w], value))
+					{
+						if (formula.settings.empty())
+							return fail(line, "expected a parameter name before " + words[w]);
+						formula.settings.back().values.push_back(value);
+					}
+					else
+						formula.settings.push_back({ words[w], {}, line, false });
+				}
+				block.formulas.push_back(formula);
+				continue;
+			}
+
+			Setting setting = { words[0], {}, line, false };
+			for (size_t w = 1; w < words.size(); ++w)
+			{
+				real value;
+				if (!parseNumber(words[w], value))
+					return fail(line, "expected a number instead of " + words[w]);
+				setting.values.push_back(value);
+			}
+			block.settings.push_back(setting);
+		}
+
+		return true;
+	}
+
+	bool checkAllUsed(const std::vector<Setting> & settings)
+	{
+		for (const Setting & s : settings)
+			if (!s.used)
+				return fail(s.line, "unknown parameter " + s.name);
+		return true;
+	}
+
+	// Find the last setting of a parameter and check its number of values, returns null if it's not set
+	const Setting * find(std::vector<Setting> & settings, const char * name, const int min_values, const int max_values)
+	{
+		Setting * found = nullptr;
+		for (Setting & s : settings)
+			if (s.name == name)
+			{
+				s.used = true;
+				found = &s;
+			}
+
+		if (found != nullptr && ((int)found->values.size() < min_values || (int)found->values.size() > max_values))
+		{
+			fail(found->line, std::string(name) + " needs " + ((min_values == max_values) ? std::to_string(min_values) :
+				std::to_string(min_values) + " to " + std::to_string(max_values)) + ((max_values == 1) ? " value" : " values"));
+			return nullptr;
+		}
+		return found;
+	}
+
+	void getReal(std::vector<Setting> & settings, const char * name, real & value) { const Setting * s = find(settings, name, 1, 1); if (s) value = s->values[0]; }
+	void getFloat(std::vector<Setting> & settings, const char * name, float & value) { const Setting * s = find(settings, name, 1, 1); if (s) value = (float)s->values[0]; }
+	void getInt(std::vector<Setting> & settings, const char * name, int & value) { const Setting * s = find(settings, name, 1, 1); if (s) value = (int)s->values[0]; }
+	void getBool(std::vector<Setting> & settings, const char * name, bool & value) { const Setting * s = find(settings, name, 0, 1); if (s) value = s->values.empty() || s->values[0] != 0; }
+
+	// Vectors can also be given as a single value for all components
+	void getVec3r(std::vector<Setting> & settings, const char * name, vec3r & value)
+	{
+		const Setting * s = find(settings, name, 1, 3);
+		if (s == nullptr)
+			return;
+		if (s->values.size() == 2)
+			fail(s->line, std::string(name) + " needs 1 or 3 values");
+		else
+			value = (s->values.size() == 1) ? vec3r(s->values[0]) : vec3r(s->values[0], s->values[1], s->values[2]);
+	}
+
+	void getVec3f(std::vector<Setting> & settings, const char * name, vec3f & value)
+	{
+		vec3r v = { value.x(), value.y(), value.z() };
+		getVec3r(settings, name, v);
+		value = { (float)v.x(), (float)v.y(), (float)v.z() };
+	}
+
+	template <int n>
+	void getArray(std::vector<Setting> & settings, const char * name, real (&values)[n])
+	{
+		const Setting * s = find(settings, name, n, n);
+		if (s != nullptr)
+			for (int i = 0; i < n; ++i)
+				values[i] = s->values[i];
+	}
+
+	void getReal(Block & b, const char * name, real & value) { getReal(b.settings, name, value); }
+	void getVec3r(Block & b, const char * name, vec3r & value) { getVec3r(b.settings, name, value); }
+	void getVec3f(Block & b, const char * name, vec3f & value) { getVec3f(b.settings, name, value); }
+
+	void getMaterial(Block & b, Material & mat)
+	{
+		getVec3f(b.settings, "albedo", mat.albedo);
+		getVec3f(b.settings, "emission", mat.emission);
+		getBool(b.settings, "fresnel", mat.use_fresnel);
+		getFloat(b.settings, "r0", mat.r0);
+	}
+
+	// Create an iteration function by the same name as in the benchmark and set its parameters, returns null if it's unknown
+	IterationFunction * makeFormula(Formula & f)
+	{
+		std::vector<Setting> & s = f.settings;
+		IterationFunction * func = nullptr;
+		if (f.name == "Mandelbulb")
+			func = new DualMandelbulbIteration();
+		else if (f.name == "TriplexMandelbulb")
+			func = new DualTriplexMandelbulbIteration();
+		else if (f.name == "MengerSponge")
+			func = new DualMengerSpongeIteration();
+		else if (f.name == "MengerSpongeC")
+		{
+			DualMengerSpongeCIteration it;
+			getReal(s, "scale", it.scale);
+			getVec3r(s, "scale_centre", it.scale_centre);
+			func = it.clone();
+		}
+		else if (f.name == "Cubicbulb")
+		{
+			DualCubicbulbIteration it;
+			getReal(s, "y_mul", it.y_mul);
+			getReal(s, "z_mul", it.z_mul);
+			getReal(s, "aux_mul", it.aux_mul);
+			getVec3r(s, "c", it.c);
+			getBool(s, "julia_mode", it.julia_mode);
+			func = it.clone();
+		}
+		else if (f.name == "Amazingbox")
+		{
+			DualAmazingboxIteration it;
+			getReal(s, "scale", it.scale);
+			getReal(s, "min_r2", it.min_r2);
+			getReal(s, "fix_r2", it.fix_r2);
+			getReal(s, "fold_limit", it.fold_limit);
+			getVec3r(s, "c", it.c);
+			getBool(s, "julia_mode", it.julia_mode);
+			func = it.clone();
+		}
+		else if (f.name == "Octopus")
+		{
+			DualOctopusIteration it;
+			getReal(s, "xz_mul", it.xz_mul);
+			getReal(s, "sq_mul", it.sq_mul);
+			getVec3r(s, "c", it.c);
+			getBool(s, "julia_mode", it.julia_mode);
+			func = it.clone();
+		}
+		else if (f.name == "PseudoKleinian")
+		{
+			DualPseudoKleinianIteration it;
+			getArray(s, "mins", it.mins);
+			getArray(s, "maxs", it.maxs);
+			func = it.clone();
+		}
+		else if (f.name == "MandalayKIFS")
+		{
+			DualMandalayKIFSIteration it;
+			getReal(s, "scale", it.scale);
+			getReal(s, "min_r2", it.min_r2);
+			getReal(s, "fix_r2", it.fix_r2);
+			getReal(s, "fold", it.fold);
+			getReal(s, "xy_tower", it.xy_tower);
+			getReal(s, "z_tower", it.z_tower);
+			getVec3r(s, "rot_m1", it.rot_m1);
+			getVec3r(s, "rot_m2", it.rot_m2);
+			getVec3r(s, "rot_m3", it.rot_m3);
+			getVec3r(s, "c", it.c);
+			getBool(s, "julia_mode", it.julia_mode);
+			func = it.clone();
+		}
+		else if (f.name == "BenesiPine2")
+		{
+			DualBenesiPine2Iteration it;
+			getReal(s, "scale", it.scale);
+			getReal(s, "offset", it.offset);
+			getVec3r(s, "c", it.c);
+			getBool(s, "julia_mode", it.julia_mode);
+			func = it.clone();
+		}
+		else if (f.name == "RiemannSphere")
+		{
+			DualRiemannSphereIteration it;
+			getReal(s, "scale", it.scale);
+			getReal(s, "s_shift", it.s_shift);
+			getReal(s, "t_shift", it.t_shift);
+			getReal(s, "x_shift", it.x_shift);
+			getReal(s, "r_shift", it.r_shift);
+			getReal(s, "r_pow", it.r_pow);
+			getVec3r(s, "c", it.c);
+			getVec3r(s, "rot_m1", it.rot_m1);
+			getVec3r(s, "rot_m2", it.rot_m2);
+			getVec3r(s, "rot_m3", it.rot_m3);
+			func = it.clone();
+		}
+		else if (f.name == "SphereTree")
+			func = new DualSphereTreeIteration();
+		else
+		{
+			fail(f.line, "unknown formula " + f.name);
+			return nullptr;
+		}
+
+		if (!error.empty() || !checkAllUsed(s))
+		{
+			delete func;
+			return nullptr;
+		}
+		return func;
+	}
+
+	// Hash of everything that changes the distance estimate, to reuse DE caches
+	static uint64_t hashDE(const Block & b)
+	{
+		uint64_t h = 14695981039346656037ull; // FNV-1a
+		const auto hashBytes = [&](const void * data, const size_t size)
+		{
+			for (size_t i = 0; i < size; ++i)
+				h = (h ^ ((const uint8_t *)data)[i]) * 1099511628211ull;
+		};
+		const auto hashSettings = [&](const std::vector<Setting> & settings)
+		{
+			for (const Setting & s : settings)
+			{
+				if (s.name == "albedo" || s.name == "emission" || s.name == "fresnel" || s.name == "r0" || s.name == "de_cache")
+					continue;
+				hashBytes(s.name.c_str(), s.name.size() + 1);
+				hashBytes(s.values.data(), sizeof(real) * s.values.size());
+			}
+		};
+
+		hashSettings(b.settings);
+		for (const Formula & f : b.formulas)
+		{
+			hashBytes(f.name.c_str(), f.name.size() + 1);
+			hashSettings(f.settings);
+		}
+		return h;
+	}
+
+	SceneObject * makeHybrid(Block & b)
+	{
+		if (b.formulas.empty())
+		{
+			fail(b.line, "hybrid needs at least one formula");
+			return nullptr;
+		}
+
+		std::vector<IterationFunction *> funcs;
+		for (Formula & f : b.formulas)
+		{
+			IterationFunction * const func = makeFormula(f);
+			if (func == nullptr)
+			{
+				for (IterationFunction * const fn : funcs)
+					delete fn;
+				return nullptr;
+			}
+			funcs.push_back(func);
+		}
+
+		std::vector<char> sequence;
+		const Setting * const seq = find(b.settings, "sequence", 1, 1 << 10);
+		if (seq != nullptr)
+		{
+			for (const real v : seq->values)
+			{
+				if (v < 0 || v >= (real)funcs.size() || v != (int)v)
+					fail(seq->line, "sequence index " + std::to_string((int)v) + " isn't a formula");
+				sequence.push_back((char)v);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < funcs.size(); ++i)
+				sequence.push_back((char)i);
+		}
+
+		int max_iters = 64;
+		getInt(b.settings, "max_iters", max_iters);
+		if (max_iters < 1)
+			fail(b.line, "max_iters needs to be at least 1");
+		if (!error.empty())
+		{
+			for (IterationFunction * const fn : funcs)
+				delete fn;
+			return nullptr;
+		}
+
+		GeneralDualDE * const hybrid = new GeneralDualDE(max_iters, funcs, sequence);
+		getReal(b.settings, "radius", hybrid->radius);
+		getReal(b.settings, "step_scale", hybrid->step_scale);
+		getReal(b.settings, "over_relaxation", hybrid->over_relaxation);
+		getBool(b.settings, "adaptive_step_scale", hybrid->adaptive_step_scale);
+		getBool(b.settings, "directional_march", hybrid->directional_march);
+		getBool(b.settings, "adaptive_precision", hybrid->adaptive_precision);
+		getMaterial(b, hybrid->mat);
+
+		bool use_de_cache = false;
+		getBool(b.settings, "de_cache", use_de_cache);
+		if (!error.empty())
+		{
+			delete hybrid;
+			return nullptr;
+		}
+
+		if (use_de_cache)
+		{
+			std::shared_ptr<const DECache> & cache = de_caches[hashDE(b)];
+			if (cache == nullptr)
+			{
+				hybrid->buildDECache(num_threads);
+				cache = hybrid->de_cache;
+			}
+			hybrid->de_cache = cache;
+		}
+		return hybrid;
+	}
+};
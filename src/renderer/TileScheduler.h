@@ -0,0 +1,210 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+
+
+
+constexpr int bucket_size = 32; // Buckets are square tiles of the image, the unit of cost estimation and adaptive sampling
+constexpr int min_tile_size = 8; // Expensive buckets are subdivided into tiles down to this size
+
+
+// Rectangle of pixels handed to a render thread, always lying within a single bucket
+struct Tile
+{
+	int x0, y0, x1, y1;
+	int bucket;
+};
+
+
+// Index of cell (x, y) along the Hilbert curve filling an n x n grid, where n is a power of two
+// Ref: https://en.wikipedia.org/wiki/Hilbert_curve
+inline int hilbertIndex(const int n, int x, int y) noexcept
+{
+	int d = 0;
+	for (int s = n / 2; s > 0; s /= 2)
+	{
+		const int rx = (x & s) > 0;
+		const int ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		// Rotate the quadrant
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+
+// Hands out tiles to the render threads. Buckets are visited along a Hilbert curve so that consecutive tiles are
+// spatially coherent, and each thread gets its own contiguous stretch of the curve with about the same estimated cost.
+// Threads that run out of work steal tiles from the far end of another thread's stretch.
+// The cost of each bucket is measured while rendering, and buckets that turned out expensive are split into smaller tiles next time.
+struct TileScheduler
+{
+	std::vector<double> bucket_costs; // Measured time per pass for each bucket in seconds, or 0 if unknown
+
+	double tail_latency = 0; // Time between the first and last thread running out of tiles in the last call
+
+
+	TileScheduler(const int num_workers) : work_ranges(num_workers), finish_times(num_workers) { }
+
+	// Set up the tiles for a render call, covering either the given buckets or all of them
+	void prepare(const int xres, const int yres, const std::vector<int> * const buckets)
+	{
+		const int x_buckets = (xres + bucket_size - 1) / bucket_size;
+		const int y_buckets = (yres + bucket_size - 1) / bucket_size;
+		const int num_buckets = x_buckets * y_buckets;
+		if ((int)bucket_costs.size() != num_buckets)
+			bucket_costs.assign(num_buckets, 0.0);
+
+		// Order the buckets along the Hilbert curve
+		int curve_size = 1;
+		while (curve_size < std::max(x_buckets, y_buckets))
+			curve_size *= 2;
+
+		std::vector<std::pair<int, int>> ordered_buckets; // Hilbert index, bucket
+		if (buckets != nullptr)
+		{
+			for (const int b : *buckets)
+				ordered_buckets.push_back({ hilbertIndex(curve_size, b % x_buckets, b / x_buckets), b });
+		}
+		else
+		{
+			for (int b = 0; b < num_buckets; ++b)
+				ordered_buckets.push_back({ hilbertIndex(curve_size, b % x_buckets, b / x_buckets), b });
+		}
+		std::sort(ordered_buckets.begin(), ordered_buckets.end());
+
+		// Buckets much more expensive than average get split into more tiles
+		double total_cost = 0;
+		int num_known = 0;
+		for (const auto & ob : ordered_buckets)
+		{
+			total_cost += bucket_costs[ob.second];
+			num_known += bucket_costs[ob.second] > 0;
+		}
+		const double mean_cost = (num_known > 0) ? total_cost / num_known : 0;
+
+		tiles.clear();
+		tile_cost_estimates.clear();
+		for (const auto & ob : ordered_buckets)
+		{
+			const int b = ob.second;
+			const int bucket_x0 = (b % x_buckets) * bucket_size, bucket_x1 = std::min(bucket_x0 + bucket_size, xres);
+			const int bucket_y0 = (b / x_buckets) * bucket_size, bucket_y1 = std::min(bucket_y0 + bucket_size, yres);
+
+			int tile_size = bucket_size;
+			while (tile_size > min_tile_size && mean_cost > 0 && bucket_costs[b] * (tile_size * tile_size) > 2 * mean_cost * (bucket_size * bucket_size))
+				tile_size /= 2;
+
+			const int num_sub_tiles = ((bucket_x1 - bucket_x0 + tile_size - 1) / tile_size) * ((bucket_y1 - bucket_y0 + tile_size - 1) / tile_size);
+			for (int y = bucket_y0; y < bucket_y1; y += tile_size)
+			for (int x = bucket_x0; x < bucket_x1; x += tile_size)
+			{
+				tiles.push_back({ x, y, std::min(x + tile_size, bucket_x1), std::min(y + tile_size, bucket_y1), b });
+				tile_cost_estimates.push_back((bucket_costs[b] > 0) ? bucket_costs[b] / num_sub_tiles : std::max(mean_cost, 1.0) / num_sub_tiles);
+			}
+		}
+		tile_costs.assign(tiles.size(), 0.0);
+
+		// Split the curve into one contiguous range per worker with about the same estimated cost
+		double total_estimate = 0;
+		for (const double c : tile_cost_estimates)
+			total_estimate += c;
+
+		const int num_workers = (int)work_ranges.size();
+		double acc = 0;
+		int tile = 0;
+		for (int w = 0; w < num_workers; ++w)
+		{
+			WorkRange & range = work_ranges[w];
+			range.begin = tile;
+			const double target = total_estimate * (w + 1) / num_workers;
+			while (tile < (int)tiles.size() && (w == num_workers - 1 || acc + tile_cost_estimates[tile] * 0.5 < target))
+				acc += tile_cost_estimates[tile++];
+			range.end = tile;
+		}
+	}
+
+	// Get the next tile for a worker from its own range, or steal one from the back of the biggest remaining range.
+	// Returns the tile index or -1 when there's no work left.
+	int getTile(const int worker) noexcept
+	{
+		{
+			WorkRange & own = work_ranges[worker];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (own.begin < own.end)
+				return own.begin++;
+		}
+
+		while (true)
+		{
+			int victim = -1, victim_size = 0;
+			for (int w = 0; w < (int)work_ranges.size(); ++w)
+			{
+				std::lock_guard<std::mutex> lock(work_ranges[w].mutex);
+				const int size = work_ranges[w].end - work_ranges[w].begin;
+				if (size > victim_size)
+				{
+					victim = w;
+					victim_size = size;
+				}
+			}
+
+			if (victim < 0)
+			{
+				finish_times[worker] = std::chrono::steady_clock::now();
+				return -1;
+			}
+
+			WorkRange & range = work_ranges[victim];
+			std::lock_guard<std::mutex> lock(range.mutex);
+			if (range.begin < range.end)
+				return --range.end;
+		}
+	}
+
+	const Tile & getTileInfo(const int tile) const noexcept { return tiles[tile]; }
+
+	// Record the render time of a tile, each tile is only rendered by one thread so this needs no locking
+	void reportCost(const int tile, const double seconds) noexcept { tile_costs[tile] = seconds; }
+
+	// Update the bucket costs with the times measured in the last call, and compute the tail latency
+	void finish(const int num_passes)
+	{
+		std::vector<double> new_costs(bucket_costs.size(), 0.0);
+		for (size_t i = 0; i < tiles.size(); ++i)
+			new_costs[tiles[i].bucket] += tile_costs[i] / std::max(1, num_passes);
+
+		for (size_t i = 0; i < tiles.size(); ++i)
+			bucket_costs[tiles[i].bucket] = new_costs[tiles[i].bucket];
+
+		const auto first_finish = *std::min_element(finish_times.begin(), finish_times.end());
+		const auto last_finish  = *std::max_element(finish_times.begin(), finish_times.end());
+		tail_latency = std::chrono::duration_cast<std::chrono::duration<double>>(last_finish - first_finish).count();
+	}
+
+private:
+	struct WorkRange
+	{
+		std::mutex mutex;
+		int begin = 0, end = 0;
+	};
+
+	std::vector<Tile> tiles; // In Hilbert curve order
+	std::vector<double> tile_cost_estimates;
+	std::vector<double> tile_costs;
+
+	std::vector<WorkRange> work_ranges; // One per worker
+	std::vector<std::chrono::steady_clock::time_point> finish_times;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include "maths/vec.h"
+
+
+
+struct sRGBPixel
+{
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+};
+
+
+// Tonemap with the number of passes per pixel, since adaptive sampling can render a different number for each
+inline void tonemap(std::vector<sRGBPixel> & image_LDR, const std::vector<vec3f> & image_HDR, const std::vector<int> & pixel_passes, const int xres, const int yres) noexcept
+{
+	const auto sRGB = [](float u) -> float { return (u <= 0.0031308f) ? 12.92f * u : 1.055f * std::pow(u, 0.416667f) - 0.055f; };
+
+	#pragma omp parallel for
+	for (int y = 0; y < yres; y++)
+	for (int x = 0; x < xres; x++)
+	{
+		const int pixel_idx = y * xres + x;
+		const vec3f pixel_colour = image_HDR[pixel_idx];
+		const float scale = 1.0f / std::max(1, pixel_passes[pixel_idx]);
+
+		image_LDR[pixel_idx] =
+		{
+			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.x() * scale) * 256)),
+			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.y() * scale) * 256)),
+			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.z() * scale) * 256))
+		};
+	}
+}
+
+
+// False colour image of a per-pixel cost averaged over the passes, e.g. march steps, on a log scale
+// going from black at the cheapest pixel through red and yellow to white at the most expensive one
+inline void heatmap(std::vector<sRGBPixel> & image_LDR, const std::vector<float> & values, const std::vector<int> & pixel_passes, const int xres, const int yres) noexcept
+{
+	const auto logValue = [&](const int i) { return std::log2(1 + values[i] / std::max(1, pixel_passes[i])); };
+
+	float min_log = std::numeric_limits<float>::infinity(), max_log = 0;
+	for (int i = 0; i < xres * yres; ++i)
+	{
+		min_log = std::min(min_log, logValue(i));
+		max_log = std::max(max_log, logValue(i));
+	}
+
+	const float scale = (max_log > min_log) ? 3 / (max_log - min_log) : 0;
+	for (int i = 0; i < xres * yres; ++i)
+	{
+		const float u = (logValue(i) - min_log) * scale;
+		image_LDR[i] =
+		{
+			(uint8_t)(std::max(0.0f, std::min(1.0f, u))     * 255),
+			(uint8_t)(std::max(0.0f, std::min(1.0f, u - 1)) * 255),
+			(uint8_t)(std::max(0.0f, std::min(1.0f, u - 2)) * 255)
+		};
+	}
+}
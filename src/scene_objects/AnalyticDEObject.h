@@ -3,6 +3,7 @@
 #include <algorithm>
 
 #include "SceneObject.h"
+#include "MarchStepper.h"
 
 
 
@@ -12,13 +13,15 @@ struct AnalyticDEObject : public SceneObject
 	vec3r centre = { 0, 0, 0 };
 	real  radius = 1; 
 	real  step_scale = 1; // Method of last resort to prevent overstepping
+	real  over_relaxation = 1; // Step length factor for over-relaxed sphere tracing, 1 to disable, see MarchStepper
+	bool  adaptive_step_scale = false; // Take longer steps than step_scale allows where the DE looks well behaved
 
 
 	// Get the distance estimate for point p in object space
-	virtual real getDE(const vec3r & p_os) noexcept = 0;
+	virtual real getDE(const vec3r & p_os) const noexcept = 0;
 
 	// Numeric normal vector calculation by forward differencing
-	virtual vec3r getNormal(const vec3r & p) noexcept override final
+	virtual vec3r getNormal(const vec3r & p) const noexcept override final
 	{
 		const vec3r p_os = p - centre;
 #if USE_DOUBLE
@@ -36,7 +39,27 @@ struct AnalyticDEObject : public SceneObject
 		return normalise(grad);
 	}
 
-	virtual real intersect(const Ray & r) noexcept override final
+	virtual void getBoundingSphere(vec3r & centre_out, real & radius_out) const noexcept override final
+	{
+		centre_out = centre;
+		radius_out = radius;
+	}
+
+	virtual real intersect(const Ray & r) const noexcept override final
+	{
+		return march(r, real_inf);
+	}
+
+	// Shadow rays can stop marching at max_t
+	virtual bool occluded(const Ray & r, const real max_t) const noexcept override final
+	{
+		const real hit_t = march(r, max_t);
+		return hit_t > ray_epsilon && hit_t < max_t;
+	}
+
+protected:
+	// Sphere trace along r until the surface or the end of the bounding interval or max_t is reached
+	real march(const Ray & r, const real max_t) const noexcept
 	{
 		const vec3r s = r.o - centre;
 		const real  b = dot(s, r.d);
@@ -52,16 +75,17 @@ struct AnalyticDEObject : public SceneObject
 		if (t2 <= ray_epsilon) return -1;
 
 		// Ray could be inside bounding sphere, start from ray epsilon
-		real t = std::max(ray_epsilon, t1);
-		while (t < t2)
+		const real t_end = std::min(t2, max_t);
+		MarchStepper stepper(std::max(ray_epsilon, t1), over_relaxation, adaptive_step_scale);
+		while (stepper.t < t_end)
 		{
-			const vec3r p_os = s + r.d * t;
-			const real DE = getDE(p_os) * step_scale;
-			t += DE;
+			const vec3r p_os = s + r.d * stepper.t;
+			const real DE = getDE(p_os);
+			const real thresh = hitThreshold(r.cone_spread * stepper.t, step_scale);
 
 			// If we're close enough to the surface, return a valid intersection
-			if (DE < DE_thresh)
-				return t;
+			if (stepper.advance(DE, step_scale, over_relaxation, adaptive_step_scale) && DE * step_scale < thresh)
+				return stepper.t;
 		}
 
 		return -1; // No intersection found
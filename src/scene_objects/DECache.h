@@ -0,0 +1,227 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "maths/vec.h"
+
+
+
+// Sparse cache of distance bounds over the cube around a static DE object's bounding sphere, for skipping empty space.
+// A coarse grid stores a bound for each cell, and cells near the surface get a brick of finer cells with their own bounds.
+// Each cell's bound is the smallest (scaled) DE at its corners minus its diagonal, which is a lower bound on the distance anywhere
+// in the cell if the scaled DE is 1-Lipschitz. Fractal DEs don't strictly guarantee that, but it's the same assumption sphere tracing
+// relies on, and unlike extrapolating from the cell centre it never stepped further than the exact DE in testing.
+// Close to the surface the bounds run out and the exact DE is needed.
+struct DECache
+{
+	constexpr static int top_res   = 16; // Coarse cells along each axis
+	constexpr static int brick_res = 8;  // Fine cells along each axis per brick
+	constexpr static int brick_cells = brick_res * brick_res * brick_res;
+
+	real half_size = 0; // Cube covers [-half_size, half_size]^3 in object space
+	real step_scale = 1; // Applied to the stored values, only kept to validate loaded caches
+
+	std::vector<float>   top_values; // Distance bound for each coarse cell
+	std::vector<int32_t> top_bricks; // Index of each coarse cell's brick, or -1 if it doesn't have one
+	std::vector<float>   brick_values; // brick_cells distance bounds per brick, x fastest
+
+
+	bool empty() const noexcept { return top_values.empty(); }
+
+	// Smallest step worth taking from the cache, below this the exact DE makes more progress
+	real minStep() const noexcept { return 2 * half_size / (top_res * brick_res); }
+
+	// Evaluate de(p) at all cell corners in parallel and compute the cell bounds, step_scale is applied to the DE like when marching
+	template <typename DEFunction>
+	void build(const real half_size_, const real step_scale_, const int num_threads, const DEFunction & de)
+	{
+		half_size = half_size_;
+		step_scale = step_scale_;
+		const real top_size = 2 * half_size / top_res;
+
+		// Coarse cells from a lattice of DE values at their corners
+		std::vector<real> top_corners;
+		evalCellCorners(top_corners, vec3r(-half_size), top_size, top_res, num_threads, de);
+		top_values.resize(top_res * top_res * top_res);
+		cellBounds(&top_values[0], top_corners, top_size, top_res);
+
+		// Cells where the coarse bound isn't useful are near the surface and get a brick
+		std::vector<int> brick_cells_top;
+		top_bricks.resize(top_values.size());
+		for (int i = 0; i < (int)top_values.size(); ++i)
+		{
+			top_bricks[i] = (top_values[i] < minStep()) ? (int32_t)brick_cells_top.size() : -1;
+			if (top_bricks[i] >= 0)
+				brick_cells_top.push_back(i);
+		}
+
+		brick_values.resize(brick_cells_top.size() * brick_cells);
+		parallelFor((int)brick_cells_top.size(), num_threads, [&](const int b)
+		{
+			const int i = brick_cells_top[b];
+			const vec3r top_min = vec3r(i % top_res, (i / top_res) % top_res, i / (top_res * top_res)) * top_size - half_size;
+
+			std::vector<real> brick_corners;
+			evalCellCorners(brick_corners, top_min, top_size / brick_res, brick_res, 1, de);
+			cellBounds(&brick_values[(size_t)b * brick_cells], brick_corners, top_size / brick_res, brick_res);
+		});
+
+		// Drop the bricks where no fine cell has a useful bound either, which is most of them right at the surface
+		int num_kept = 0;
+		for (int b = 0; b < (int)brick_cells_top.size(); ++b)
+		{
+			const float * const values = &brick_values[(size_t)b * brick_cells];
+			if (*std::max_element(values, values + brick_cells) < minStep())
+			{
+				top_bricks[brick_cells_top[b]] = -1;
+				continue;
+			}
+
+			std::copy(values, values + brick_cells, &brick_values[(size_t)num_kept * brick_cells]);
+			top_bricks[brick_cells_top[b]] = num_kept++;
+		}
+		brick_values.resize((size_t)num_kept * brick_cells);
+	}
+
+	// Lower bound on the distance to the surface from object space point p, or 0 outside the cache
+	real lowerBound(const vec3r & p) const noexcept
+	{
+		const real fine_res = (real)(top_res * brick_res);
+		const real scale = fine_res / (2 * half_size);
+		const real u = (p.x() + half_size) * scale;
+		const real v = (p.y() + half_size) * scale;
+		const real w = (p.z() + half_size) * scale;
+		if (!(u >= 0 && v >= 0 && w >= 0 && u < fine_res && v < fine_res && w < fine_res))
+			return 0;
+
+		const int fx = (int)u, fy = (int)v, fz = (int)w;
+		const int tx = fx / brick_res, ty = fy / brick_res, tz = fz / brick_res;
+		const int top = (tz * top_res + ty) * top_res + tx;
+		const int32_t brick = top_bricks[top];
+		if (brick < 0)
+			return top_values[top];
+
+		const int bx = fx - tx * brick_res, by = fy - ty * brick_res, bz = fz - tz * brick_res;
+		return brick_values[(size_t)brick * brick_cells + (bz * brick_res + by) * brick_res + bx];
+	}
+
+	// Save to a file for reuse, the cache doesn't know the formula parameters so the caller is responsible for matching them
+	bool save(const char * filename) const
+	{
+		FILE * const f = fopen(filename, "wb");
+		if (f == nullptr)
+			return false;
+
+		const Header header = { magic, top_res, brick_res, (double)half_size, (double)step_scale, (int32_t)(brick_values.size() / brick_cells) };
+		bool ok = fwrite(&header, sizeof(Header), 1, f) == 1;
+		ok = ok && fwrite(top_values.data(),   sizeof(float),   top_values.size(),   f) == top_values.size();
+		ok = ok && fwrite(top_bricks.data(),   sizeof(int32_t), top_bricks.size(),   f) == top_bricks.size();
+		ok = ok && fwrite(brick_values.data(), sizeof(float),   brick_values.size(), f) == brick_values.size();
+		fclose(f);
+		return ok;
+	}
+
+	// Load a saved cache, returns false if it's missing or was built with a different size or step scale
+	bool load(const char * filename, const real expected_half_size, const real expected_step_scale)
+	{
+		FILE * const f = fopen(filename, "rb");
+		if (f == nullptr)
+			return false;
+
+		Header header;
+		bool ok = fread(&header, sizeof(Header), 1, f) == 1 &&
+			header.magic == magic && header.top_res == top_res && header.brick_res == brick_res &&
+			header.half_size == (double)expected_half_size && header.step_scale == (double)expected_step_scale &&
+			header.num_bricks >= 0;
+
+		if (ok)
+		{
+			top_values.resize(top_res * top_res * top_res);
+			top_bricks.resize(top_res * top_res * top_res);
+			brick_values.resize((size_t)header.num_bricks * brick_cells);
+			ok = fread(top_values.data(),   sizeof(float),   top_values.size(),   f) == top_values.size() &&
+				 fread(top_bricks.data(),   sizeof(int32_t), top_bricks.size(),   f) == top_bricks.size() &&
+				 fread(brick_values.data(), sizeof(float),   brick_values.size(), f) == brick_values.size();
+
+			for (const int32_t b : top_bricks)
+				ok = ok && b < header.num_bricks;
+		}
+		fclose(f);
+
+		if (!ok)
+		{
+			top_values.clear();
+			top_bricks.clear();
+			brick_values.clear();
+			return false;
+		}
+
+		half_size = expected_half_size;
+		step_scale = expected_step_scale;
+		return true;
+	}
+
+private:
+	constexpr static uint32_t magic = 0x43454446; // "FDEC"
+
+	struct Header
+	{
+		uint32_t magic;
+		int32_t top_res, brick_res;
+		double half_size, step_scale;
+		int32_t num_bricks;
+	};
+
+	// Evaluate the scaled DE on the (res + 1)^3 corners of a grid of res^3 cells starting at grid_min
+	template <typename DEFunction>
+	void evalCellCorners(std::vector<real> & corners_out, const vec3r & grid_min, const real cell_size, const int res,
+		const int num_threads, const DEFunction & de) const
+	{
+		const int n = res + 1;
+		corners_out.resize(n * n * n);
+		parallelFor(n * n * n, num_threads, [&](const int i)
+		{
+			const vec3r p = grid_min + vec3r(i % n, (i / n) % n, i / (n * n)) * cell_size;
+			corners_out[i] = de(p) * step_scale;
+		});
+	}
+
+	// Bound for each cell from the smallest DE at its corners minus the distance across it
+	static void cellBounds(float * bounds_out, const std::vector<real> & corners, const real cell_size, const int res) noexcept
+	{
+		const int n = res + 1;
+		const real diagonal = cell_size * (real)1.7320508075688772;
+		for (int z = 0; z < res; ++z)
+		for (int y = 0; y < res; ++y)
+		for (int x = 0; x < res; ++x)
+		{
+			real min_de = real_inf;
+			for (int c = 0; c < 8; ++c)
+				min_de = std::min(min_de, corners[((z + (c >> 2)) * n + y + ((c >> 1) & 1)) * n + x + (c & 1)]);
+
+			bounds_out[(z * res + y) * res + x] = (float)(min_de - diagonal);
+		}
+	}
+
+	// Run f(i) for i in [0, n) over several threads, handing out indices one at a time since DE costs vary a lot
+	template <typename Function>
+	static void parallelFor(const int n, const int num_threads, const Function & f)
+	{
+		std::atomic<int> next(0);
+		const auto worker = [&]()
+		{
+			for (int i = next++; i < n; i = next++)
+				f(i);
+		};
+
+		std::vector<std::thread> threads(std::max(1, num_threads) - 1);
+		for (std::thread & t : threads) t = std::thread(worker);
+		worker();
+		for (std::thread & t : threads) t.join();
+	}
+};
@@ -1,8 +1,13 @@
 #pragma once
 
 #include <algorithm>
+#include <memory>
+
+#include "renderer/RenderStats.h"
 
 #include "SceneObject.h"
+#include "MarchStepper.h"
+#include "DECache.h"
 
 
 
@@ -13,6 +18,12 @@ struct DualDEObject : public SceneObject
 	real  radius = 1;
 	real  bailout_radius2 = 65536;
 	real  step_scale = 1; // Method of last resort to prevent overstepping, interpreted as a Lipschitz constant
+	real  over_relaxation = 1; // Step length factor for over-relaxed sphere tracing, 1 to disable, see MarchStepper
+	bool  adaptive_step_scale = false; // Take longer steps than step_scale allows where the DE looks well behaved
+	bool  directional_march = false; // March with derivatives along the ray only, the full Jacobian is only computed for the normal
+	bool  adaptive_precision = false; // March in float while far from the surface, switching to full precision close to it
+
+	std::shared_ptr<const DECache> de_cache; // Optional distance bounds for skipping empty space, shared between clones since it's immutable
 
 
 	real getLinearDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept
@@ -55,6 +66,7 @@ struct DualDEObject : public SceneObject
 			// and then further operations on them yield NaN.
 			// Assuming m is finite it might as well return 0 here.
 			normal_os_out = vec3r{ 0,0,0 };
+			statsCountZeroDE();
 			return 0;
 		}
 	}
@@ -123,6 +135,7 @@ struct DualDEObject : public SceneObject
 			// and then further operations on them yield NaN.
 			// Assuming m is finite it might as well return 0 here.
 			normal_os_out = vec3r{ 0,0,0 };
+			statsCountZeroDE();
 			return 0;
 		}
 #endif
@@ -192,6 +205,7 @@ struct DualDEObject : public SceneObject
 			// and then further operations on them yield NaN.
 			// Assuming m is finite it might as well return 0 here.
 			normal_os_out = 0;
+			statsCountZeroDE();
 			return 0;
 		}
 	}
@@ -202,7 +216,8 @@ struct DualDEObject : public SceneObject
 	// pmax:          Product of formulas' powers for all iterations;
 	// w:             Current pos & Jacobian;
 	// normal_os_out: Normal vector to output.
-	real getHybridDEKnighty(const real p, const real max_pow, const DualVec3r & w, vec3r & normal_os_out) const noexcept
+	template <typename dual_real>
+	real getHybridDEKnighty(const real p, const real max_pow, const vec<3, Dual<dual_real, 3>> & w, vec3r & normal_os_out) const noexcept
 	{
 		// Extract the position vector and Jacobian
 		const vec3r v  = { w.x().v[0], w.y().v[0], w.z().v[0] };
@@ -238,18 +253,7 @@ struct DualDEObject : public SceneObject
 		const real len_dr = std::max(length(jx), std::max(length(jy), length(jz))); // std::sqrt(dot(jx,jx) + dot(jy,jy) + dot(jz,jz));
 #endif
 
-		// Strictly speaking the terms (1 - (bvr ^ (1 / max_pow) / r ^ (1 / p))) and (1 - p / max_pow * log(bvr) / log(r))
-		// are not absolutely required because at the limit of high iteration counts they approach 1.
-		// but they give more accurate results for low iteration count.
-		// Notice that the formula is different from the one in the document. Here the formulas were tweaked for finite/low bail out radius.
-		// Ok, it seems a little over complicated. Next, we can try to see if it can be simplified without getting visible artifacts.
-		// Notice also that when the formulas have power == 1, we use only the second formula which reduces to : k * (1 - a / len) = (len - a) / len_dr
-		const real k = len / len_dr;
-		const real de = (p > 10000)
-			// ff * r / dr * (log(r) - p / max_pow * log(bvr)) = ff * r / dr * log(r) * (1 - p / max_pow * log(bvr) / log(r));
-			? k * (std::log(len) - p / max_pow * std::log(radius))
-			// ff * r / dr * p * (1 - (bvr ^ (1 / max_pow) / r^(1 / p)));
-			: k * p * (1 - std::pow(radius , 1 / max_pow) / std::pow(len , 1 / p));
+		const real de = knightyDE(p, max_pow, len, len_dr);
 
 		if (std::isfinite(len_dr)) // TODO: this function is probably slow, find a replacement
 		{
@@ -265,17 +269,105 @@ struct DualDEObject : public SceneObject
 			// and then further operations on them yield NaN.
 			// Assuming m is finite it might as well return 0 here.
 			normal_os_out = 0;
+			statsCountZeroDE();
+			return 0;
+		}
+	}
+
+	// Knighty's hybrid DE using only the derivative along the ray direction, so there's no normal.
+	// This follows Knighty's suggestion above to evaluate dr in the direction of the ray:
+	//  for conformal-ish formulas |J.d| is close to the vector-matrix norm, at a quarter of the cost.
+	template <typename dual_real>
+	real getHybridDEKnighty(const real p, const real max_pow, const vec<3, Dual<dual_real, 1>> & w) const noexcept
+	{
+		// Extract the position vector and directional derivative
+		const vec3r v  = { w.x().v[0], w.y().v[0], w.z().v[0] };
+		const vec3r jd = { w.x().v[1], w.y().v[1], w.z().v[1] };
+
+		const real len = length(v);
+		const real len_dr = length(jd);
+
+		// See above for what to do with NaN and infinite derivatives
+		if (!std::isfinite(len_dr))
+		{
+			statsCountZeroDE();
 			return 0;
 		}
+		return knightyDE(p, max_pow, len, len_dr);
 	}
 
 	// Get the distance estimate and normal vector for point p in object space
-	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) noexcept = 0;
+	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept = 0;
+
+	// Get the distance estimate for point p in object space, with derivatives along the ray direction only.
+	// The default just does the full evaluation; objects supporting this should override it.
+	virtual real getDirectionalDE(const Dual1Vec3r & p_os) const noexcept
+	{
+		const DualVec3r p_dual(Dual3r(p_os.x().v[0], 0), Dual3r(p_os.y().v[0], 1), Dual3r(p_os.z().v[0], 2));
+
+		vec3r normal_ignored;
+		return getDE(p_dual, normal_ignored);
+	}
+
+#if USE_DOUBLE
+	// Single precision versions of the above, only used for marching far from the surface.
+	// The defaults evaluate in full precision; objects with float kernels should override them.
+	virtual real getDEFloat(const DualVec3f & p_os) const noexcept
+	{
+		DualVec3r p_dual;
+		for (int i = 0; i < 3; ++i)
+			for (int j = 0; j < 4; ++j)
+				p_dual.e[i].v[j] = p_os.e[i].v[j];
+
+		vec3r normal_ignored;
+		return getDE(p_dual, normal_ignored);
+	}
+
+	virtual real getDirectionalDEFloat(const Dual1Vec3f & p_os) const noexcept
+	{
+		Dual1Vec3r p_dir;
+		for (int i = 0; i < 3; ++i)
+			for (int j = 0; j < 2; ++j)
+				p_dir.e[i].v[j] = p_os.e[i].v[j];
+
+		return getDirectionalDE(p_dir);
+	}
+#endif
+
+	// Distance estimates for marching at a level of detail no finer than footprint, the radius of the ray's footprint at p.
+	// Objects with a variable iteration count can stop iterating early for a wide footprint, the defaults evaluate in full detail.
+	virtual real getLODDE(const DualVec3r & p_os, const real footprint) const noexcept
+	{
+		(void) footprint;
+		vec3r normal_ignored;
+		return getDE(p_os, normal_ignored);
+	}
+
+	virtual real getLODDE(const Dual1Vec3r & p_os, const real footprint) const noexcept
+	{
+		(void) footprint;
+		return getDirectionalDE(p_os);
+	}
+
+#if USE_DOUBLE
+	virtual real getLODDE(const DualVec3f & p_os, const real footprint) const noexcept
+	{
+		(void) footprint;
+		return getDEFloat(p_os);
+	}
+
+	virtual real getLODDE(const Dual1Vec3f & p_os, const real footprint) const noexcept
+	{
+		(void) footprint;
+		return getDirectionalDEFloat(p_os);
+	}
+#endif
 
 	// Dual numbers provide exact normals as part of the evaluation
-	virtual vec3r getNormal(const vec3r & p) noexcept override final
+	virtual vec3r getNormal(const vec3r & p) const noexcept override final
 	{
 		const DualVec3r p_dual(Dual3r(p.x(), 0), Dual3r(p.y(), 1), Dual3r(p.z(), 2));
+		statsCountDE();
 
 		vec3r normal_os;
 		const real de_ignored = getDE(p_dual, normal_os);
@@ -283,7 +375,79 @@ struct DualDEObject : public SceneObject
 		return normal_os;
 	}
 
-	virtual real intersect(const Ray & r) noexcept override final
+	// Precompute the DE cache for a static object, or load it from a file if given and valid and save it there otherwise.
+	// Needs rebuilding (or deleting the file) after changing the formula or its parameters.
+	void buildDECache(const int num_threads, const char * const filename = nullptr)
+	{
+		std::shared_ptr<DECache> cache = std::make_shared<DECache>();
+		if (filename == nullptr || !cache->load(filename, radius, step_scale))
+		{
+			cache->build(radius, step_scale, num_threads, [&](const vec3r & p)
+			{
+				const DualVec3r p_dual(Dual3r(p.x(), 0), Dual3r(p.y(), 1), Dual3r(p.z(), 2));
+				vec3r normal_ignored;
+				return getDE(p_dual, normal_ignored);
+			});
+
+			if (filename != nullptr)
+				cache->save(filename);
+		}
+
+		de_cache = cache;
+	}
+
+	virtual void getBoundingSphere(vec3r & centre_out, real & radius_out) const noexcept override final
+	{
+		centre_out = centre;
+		radius_out = radius;
+	}
+
+	// Distance to the bounding sphere when far from it, otherwise the DE scaled like when marching, which is often the
+	// bigger bound just outside the sphere too
+	virtual real getDistanceBound(const vec3r & p) const noexcept override final
+	{
+		const vec3r p_os = p - centre;
+		const real sphere_dist = length(p_os) - radius;
+		if (sphere_dist > radius)
+			return sphere_dist;
+
+		const DualVec3r p_dual(Dual3r(p_os.x(), 0), Dual3r(p_os.y(), 1), Dual3r(p_os.z(), 2));
+		statsCountDE();
+		vec3r normal_ignored;
+		return std::max(sphere_dist, getDE(p_dual, normal_ignored) * step_scale);
+	}
+
+	virtual real intersect(const Ray & r) const noexcept override final
+	{
+		return march(r, real_inf);
+	}
+
+	// Shadow rays can stop marching at max_t
+	virtual bool occluded(const Ray & r, const real max_t) const noexcept override final
+	{
+		const real hit_t = march(r, max_t);
+		return hit_t > ray_epsilon && hit_t < max_t;
+	}
+
+	virtual void intersectPacket(const RayPacket & packet, real * hit_t_out) const noexcept override final
+	{
+		real max_t[packet_size];
+		std::fill(max_t, max_t + packet_size, real_inf);
+		marchPacket(packet, max_t, hit_t_out);
+	}
+
+	virtual void occludedPacket(const RayPacket & packet, const real * max_t, bool * occluded_out) const noexcept override final
+	{
+		real hit_t[packet_size];
+		marchPacket(packet, max_t, hit_t);
+
+		for (int i = 0; i < packet.num_rays; ++i)
+			occluded_out[i] = hit_t[i] > ray_epsilon && hit_t[i] < max_t[i];
+	}
+
+protected:
+	// Sphere trace along r until the surface or the end of the bounding interval or max_t is reached
+	real march(const Ray & r, const real max_t) const noexcept
 	{
 		const vec3r s = r.o - centre;
 		const real  b = dot(s, r.d);
@@ -299,25 +463,346 @@ struct DualDEObject : public SceneObject
 		if (t2 <= ray_epsilon) return -1;
 
 		// Ray could be inside bounding sphere, start from ray epsilon
-		const real thresh = DE_thresh;
-		real t = std::max(ray_epsilon, t1);
-		while (t < t2)
+		const real t_end = std::min(t2, max_t);
+		MarchStepper stepper(std::max(ray_epsilon, t1), over_relaxation, adaptive_step_scale);
+		bool full_precision = !adaptive_precision;
+		int steps = 0;
+		while (stepper.t < t_end)
 		{
-			const vec3r p_os = s + r.d * t;
-			const DualVec3r p_os_dual(Dual3r(p_os.x(), 0), Dual3r(p_os.y(), 1), Dual3r(p_os.z(), 2));
-	
-			vec3r normal_ignored;
-			const real DE = getDE(p_os_dual, normal_ignored) * step_scale;
-			(void) normal_ignored;
-			t += DE;
+			const vec3r p_os = s + r.d * stepper.t;
+			steps++;
+
+			// Skip empty space with the cached bound while it's big enough
+			const real cached_step = getCachedStep(p_os);
+			if (cached_step > 0)
+			{
+				stepper.skip(cached_step);
+				continue;
+			}
+
+			const real footprint = r.cone_spread * stepper.t;
+			const real DE = getMarchDE(p_os, r.d, footprint, full_precision);
+			const real thresh = hitThreshold(footprint, step_scale);
 
 			// If we're close enough to the surface, return a valid intersection
-			if (DE < thresh)
-				return t;
+			if (stepper.advance(DE, step_scale, over_relaxation, adaptive_step_scale) && DE * step_scale < thresh)
+			{
+				statsCountMarch(steps, -1);
+				return stepper.t;
+			}
 		}
 
+		statsCountMarch(steps, -1);
 		return -1; // No intersection found
 	}
+
+	// March a packet of coherent rays in lockstep, masking off rays as they converge, leave the bounding sphere or reach their max_t
+	void marchPacket(const RayPacket & packet, const real * max_t, real * hit_t_out) const noexcept
+	{
+		vec3r s[packet_size];
+		MarchStepper stepper[packet_size];
+		real t_end[packet_size];
+		bool active[packet_size], full_precision[packet_size];
+		int steps[packet_size] = { };
+		int num_active = 0;
+
+		for (int i = 0; i < packet.num_rays; ++i)
+		{
+			s[i] = packet.o[i] - centre;
+			const real b = dot(s[i], packet.d[i]);
+			const real c = dot(s[i], s[i]) - radius * radius;
+			const real discriminant = b * b - c;
+
+			// Compute bounding interval, rays could be inside bounding sphere so start from ray epsilon
+			const real sqrt_disc = std::sqrt(std::max((real)0, discriminant));
+			stepper[i] = MarchStepper(std::max(std::max(ray_epsilon, -b - sqrt_disc), packet.t_start[i]), over_relaxation, adaptive_step_scale);
+			t_end[i] = std::min(-b + sqrt_disc, max_t[i]);
+
+			hit_t_out[i] = -1;
+			full_precision[i] = !adaptive_precision;
+			active[i] = discriminant >= 0 && t_end[i] > ray_epsilon && stepper[i].t < t_end[i];
+			num_active += active[i];
+		}
+
+		while (num_active > 0)
+		{
+			// Gather the rays that need a DE this step, so that they can be evaluated together
+			vec3r p_os[packet_size], d[packet_size];
+			real footprint[packet_size], DE[packet_size];
+			bool batch_full_precision[packet_size];
+			int batch_ray[packet_size];
+			bool needs_DE[packet_size] = { };
+			int batch_size = 0;
+
+			for (int i = 0; i < packet.num_rays; ++i)
+			{
+				if (!active[i])
+					continue;
+
+				const vec3r p = s[i] + packet.d[i] * stepper[i].t;
+				steps[i]++;
+
+				// Skip empty space with the cached bound while it's big enough
+				const real cached_step = getCachedStep(p);
+				if (cached_step > 0)
+				{
+					stepper[i].skip(cached_step);
+					continue;
+				}
+
+				p_os[batch_size] = p;
+				d[batch_size] = packet.d[i];
+				footprint[batch_size] = packet.cone_spread[i] * stepper[i].t;
+				batch_full_precision[batch_size] = full_precision[i];
+				batch_ray[batch_size] = i;
+				needs_DE[i] = true;
+				batch_size++;
+			}
+
+			getMarchDEBatch(p_os, d, footprint, batch_full_precision, DE, batch_size);
+
+			for (int b = 0; b < batch_size; ++b)
+				full_precision[batch_ray[b]] = batch_full_precision[b];
+
+			for (int i = 0, b = 0; i < packet.num_rays; ++i)
+			{
+				if (!active[i])
+					continue;
+
+				// If we're close enough to the surface, this ray has a valid intersection. Only real DE steps can count as hits,
+				// a cached skip never does, even when a large footprint threshold would exceed the cached step.
+				bool hit = false;
+				if (needs_DE[i])
+				{
+					const real thresh = hitThreshold(footprint[b], step_scale);
+					hit = stepper[i].advance(DE[b], step_scale, over_relaxation, adaptive_step_scale) && DE[b] * step_scale < thresh;
+					b++;
+				}
+
+				if (hit)
+					hit_t_out[i] = stepper[i].t;
+
+				if (hit || stepper[i].t >= t_end[i])
+				{
+					active[i] = false;
+					num_active--;
+					statsCountMarch(steps[i], i);
+				}
+			}
+		}
+	}
+
+	// Strictly speaking the terms (1 - (bvr ^ (1 / max_pow) / r ^ (1 / p))) and (1 - p / max_pow * log(bvr) / log(r))
+	// are not absolutely required because at the limit of high iteration counts they approach 1.
+	// but they give more accurate results for low iteration count.
+	// Notice that the formula is different from the one in the document. Here the formulas were tweaked for finite/low bail out radius.
+	// Ok, it seems a little over complicated. Next, we can try to see if it can be simplified without getting visible artifacts.
+	// Notice also that when the formulas have power == 1, we use only the second formula which reduces to : k * (1 - a / len) = (len - a) / len_dr
+	inline real knightyDE(const real p, const real max_pow, const real len, const real len_dr) const noexcept
+	{
+		const real k = len / len_dr;
+		return (p > 10000)
+			// ff * r / dr * (log(r) - p / max_pow * log(bvr)) = ff * r / dr * log(r) * (1 - p / max_pow * log(bvr) / log(r));
+			? k * (std::log(len) - p / max_pow * std::log(radius))
+			// ff * r / dr * p * (1 - (bvr ^ (1 / max_pow) / r^(1 / p)));
+			: k * p * (1 - std::pow(radius , 1 / max_pow) / std::pow(len , 1 / p));
+	}
+
+	// Step from the DE cache if there is one and it gives a useful bound at p_os, otherwise 0
+	inline real getCachedStep(const vec3r & p_os) const noexcept
+	{
+		if (de_cache == nullptr)
+			return 0;
+
+		const real bound = de_cache->lowerBound(p_os);
+		return (bound >= de_cache->minStep()) ? bound : 0;
+	}
+
+	// Whether further iterations of p would only add detail finer than footprint. Later iterations add features of about unit size
+	// in the iterated space, which the Jacobian J maps back to about 1 / |J| in object space; the Frobenius norm stands in for |J|.
+	template <typename dual_real, int vars>
+	inline static bool finerThanFootprint(const vec<3, Dual<dual_real, vars>> & p, const real footprint) noexcept
+	{
+		real j2 = 0;
+		for (int i = 0; i < 3; ++i)
+			for (int k = 1; k <= vars; ++k)
+				j2 += (real)p.e[i].v[k] * (real)p.e[i].v[k];
+
+		return j2 * footprint * footprint > 1;
+	}
+
+	// Distance estimate used while marching along direction d at the level of detail of footprint, see getLODDE.
+	// The normal isn't needed until we hit the surface. Once the march of a ray switches to full precision it stays there.
+	inline real getMarchDE(const vec3r & p_os, const vec3r & d, const real footprint, bool & full_precision) const noexcept
+	{
+		statsCountDE();
+#if USE_DOUBLE
+		// Float is accurate enough until the DE gets down to where float epsilon matters
+		if (!full_precision)
+		{
+			const real DE_float = getMarchDEPrecision(vec3f(p_os.x(), p_os.y(), p_os.z()), vec3f(d.x(), d.y(), d.z()), footprint);
+			if (DE_float > float_DE_thresh)
+				return DE_float;
+
+			full_precision = true;
+		}
+#else
+		(void) full_precision;
+#endif
+		return getMarchDEPrecision(p_os, d, footprint);
+	}
+
+	// getMarchDE for count positions at once, for packets. Objects that can iterate many points together override this.
+	virtual void getMarchDEBatch(const vec3r * p_os, const vec3r * d, const real * footprint, bool * full_precision, real * DE_out, const int count) const noexcept
+	{
+		for (int i = 0; i < count; ++i)
+			DE_out[i] = getMarchDE(p_os[i], d[i], footprint[i], full_precision[i]);
+	}
+
+	// Only rays with a footprint go through getLODDE, to keep the direct calls for exact intersections
+	inline real getMarchDEPrecision(const vec3r & p_os, const vec3r & d, const real footprint) const noexcept
+	{
+		if (directional_march)
+		{
+			const Dual1Vec3r p_dir = makeDirectionalDual(p_os, d);
+			return (footprint > 0) ? getLODDE(p_dir, footprint) : getDirectionalDE(p_dir);
+		}
+
+		const DualVec3r p_os_dual(Dual3r(p_os.x(), 0), Dual3r(p_os.y(), 1), Dual3r(p_os.z(), 2));
+		if (footprint > 0)
+			return getLODDE(p_os_dual, footprint);
+
+		vec3r normal_ignored;
+		return getDE(p_os_dual, normal_ignored);
+	}
+
+#if USE_DOUBLE
+	inline real getMarchDEPrecision(const vec3f & p_os, const vec3f & d, const real footprint) const noexcept
+	{
+		if (directional_march)
+		{
+			const Dual1Vec3f p_dir = makeDirectionalDual(p_os, d);
+			return (footprint > 0) ? getLODDE(p_dir, footprint) : getDirectionalDEFloat(p_dir);
+		}
+
+		const DualVec3f p_os_dual(Dual3f(p_os.x(), 0), Dual3f(p_os.y(), 1), Dual3f(p_os.z(), 2));
+		return (footprint > 0) ? getLODDE(p_os_dual, footprint) : getDEFloat(p_os_dual);
+	}
+#endif
+
+	// Make the dual vector for point p with derivatives along direction d
+	template <typename dual_real>
+	inline static vec<3, Dual<dual_real, 1>> makeDirectionalDual(const vec<3, dual_real> & p, const vec<3, dual_real> & d) noexcept
+	{
+		vec<3, Dual<dual_real, 1>> p_dir;
+		for (int i = 0; i < 3; ++i)
+		{
+			p_dir.e[i].v[0] = p.e[i];
+			p_dir.e[i].v[1] = d.e[i];
+		}
+		return p_dir;
+	}
+};
+
+
+// Small per-evaluation scratch state passed down to the iteration functions,
+// so that they don't need to store anything and can be shared between threads
+template <typename dual_type>
+struct IterationContextT
+{
+	vec<3, dual_type> p_0; // Initial point, e.g. the c value for Mandelbrot-like formulas
+	int iteration; // Index of the current iteration
+};
+
+using IterationContext = IterationContextT<Dual3r>;
+using DirectionalIterationContext = IterationContextT<Dual1r>;
+
+
+// A block of points in structure of arrays layout for batched iteration functions: e[i][c][k] is component c (the value,
+// then the derivatives) of coordinate i of the k'th point. Per-point code in a loop over k then vectorises across points,
+// as long as data dependent choices are written as selects.
+template <typename dual_type>
+struct DualVec3Block;
+
+template <typename real_type, int vars>
+struct DualVec3Block<Dual<real_type, vars>>
+{
+	using dual_vec = vec<3, Dual<real_type, vars>>;
+
+	constexpr static int size = packet_size;
+	constexpr static int comps = vars + 1;
+
+	alignas(64) real_type e[3][comps][size];
+
+
+	inline void set(const int k, const dual_vec & p) noexcept
+	{
+		for (int i = 0; i < 3; ++i)
+			for (int c = 0; c < comps; ++c)
+				e[i][c][k] = p.e[i].v[c];
+	}
+
+	inline dual_vec get(const int k) const noexcept
+	{
+		dual_vec p;
+		for (int i = 0; i < 3; ++i)
+			for (int c = 0; c < comps; ++c)
+				p.e[i].v[c] = e[i][c][k];
+		return p;
+	}
+
+	// Load count points, the remaining lanes are zeroed so that they don't compute on garbage
+	inline void load(const dual_vec * p, const int count) noexcept
+	{
+#if DUAL_SIMD
+		// Transpose whole registers 4 points at a time, which is much cheaper than moving the components one by one
+		if constexpr (vars == 3)
+		{
+			using lanes = DualLanes<real_type>;
+			for (int k = 0; k < size; k += 4)
+				for (int i = 0; i < 3; ++i)
+				{
+					typename lanes::reg r[4];
+					for (int j = 0; j < 4; ++j)
+						r[j] = (k + j < count) ? lanes::load(p[k + j].e[i].v) : lanes::set1(0);
+
+					lanes::transpose(r[0], r[1], r[2], r[3]);
+					for (int c = 0; c < 4; ++c)
+						lanes::store(&e[i][c][k], r[c]);
+				}
+			return;
+		}
+#endif
+		for (int k = 0; k < size; ++k)
+			set(k, (k < count) ? p[k] : dual_vec(0, 0, 0));
+	}
+
+	// Store the first count lanes, skipping inactive ones
+	inline void store(dual_vec * p, const bool * active, const int count) const noexcept
+	{
+#if DUAL_SIMD
+		if constexpr (vars == 3)
+		{
+			using lanes = DualLanes<real_type>;
+			for (int k = 0; k < count; k += 4)
+				for (int i = 0; i < 3; ++i)
+				{
+					typename lanes::reg r[4];
+					for (int c = 0; c < 4; ++c)
+						r[c] = lanes::load(&e[i][c][k]);
+
+					lanes::transpose(r[0], r[1], r[2], r[3]);
+					for (int j = 0; j < 4 && k + j < count; ++j)
+						if (active[k + j])
+							lanes::store(p[k + j].e[i].v, r[j]);
+				}
+			return;
+		}
+#endif
+		for (int k = 0; k < count; ++k)
+			if (active[k])
+				p[k] = get(k);
+	}
 };
 
 
@@ -325,11 +810,114 @@ struct IterationFunction
 {
 	virtual ~IterationFunction() = default;
 
-	virtual void init(const DualVec3r &) noexcept { }
-	virtual void eval(const DualVec3r & p_in, DualVec3r & p_out) const noexcept = 0;
+	virtual void eval(const IterationContext & ctx, const DualVec3r & p_in, DualVec3r & p_out) const noexcept = 0;
+	virtual void eval(const DirectionalIterationContext & ctx, const Dual1Vec3r & p_in, Dual1Vec3r & p_out) const noexcept = 0;
+#if USE_DOUBLE
+	virtual void eval(const IterationContextT<Dual3f> & ctx, const DualVec3f & p_in, DualVec3f & p_out) const noexcept = 0;
+	virtual void eval(const IterationContextT<Dual1f> & ctx, const Dual1Vec3f & p_in, Dual1Vec3f & p_out) const noexcept = 0;
+#endif
+
+	// Evaluate count points at once with one virtual call, only where active is set, the other outputs are left alone.
+	// The defaults just loop over eval.
+	virtual void evalBatch(const IterationContext * ctx, const DualVec3r * p_in, DualVec3r * p_out, const bool * active, const int count) const noexcept
+	{
+		evalBatchLoop(ctx, p_in, p_out, active, count);
+	}
+
+	virtual void evalBatch(const DirectionalIterationContext * ctx, const Dual1Vec3r * p_in, Dual1Vec3r * p_out, const bool * active, const int count) const noexcept
+	{
+		evalBatchLoop(ctx, p_in, p_out, active, count);
+	}
+
+#if USE_DOUBLE
+	virtual void evalBatch(const IterationContextT<Dual3f> * ctx, const DualVec3f * p_in, DualVec3f * p_out, const bool * active, const int count) const noexcept
+	{
+		evalBatchLoop(ctx, p_in, p_out, active, count);
+	}
+
+	virtual void evalBatch(const IterationContextT<Dual1f> * ctx, const Dual1Vec3f * p_in, Dual1Vec3f * p_out, const bool * active, const int count) const noexcept
+	{
+		evalBatchLoop(ctx, p_in, p_out, active, count);
+	}
+#endif
+
 	virtual real getPower() const noexcept = 0;
 
 	virtual IterationFunction * clone() const = 0;
+
+private:
+	template <typename dual_type>
+	inline void evalBatchLoop(const IterationContextT<dual_type> * ctx, const vec<3, dual_type> * p_in, vec<3, dual_type> * p_out, const bool * active, const int count) const noexcept
+	{
+		for (int k = 0; k < count; ++k)
+			if (active[k])
+				eval(ctx[k], p_in[k], p_out[k]);
+	}
+};
+
+
+// Implements all the IterationFunction eval variants with a single templated function in the derived class:
+//  template <typename dual> void evalT(const IterationContextT<dual> & ctx, const vec<3, dual> & p_in, vec<3, dual> & p_out) const noexcept
+// The evalBatch variants call evalBatchT, which loops over evalT unless the derived class has its own, usually working on DualVec3Blocks.
+template <typename Derived>
+struct IterationFunctionT : public IterationFunction
+{
+	template <typename dual>
+	inline void evalBatchT(const IterationContextT<dual> * ctx, const vec<3, dual> * p_in, vec<3, dual> * p_out, const bool * active, const int count) const noexcept
+	{
+		for (int k = 0; k < count; ++k)
+			if (active[k])
+				static_cast<const Derived *>(this)->evalT(ctx[k], p_in[k], p_out[k]);
+	}
+
+	virtual void eval(const IterationContext & ctx, const DualVec3r & p_in, DualVec3r & p_out) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalT(ctx, p_in, p_out);
+	}
+
+	virtual void eval(const DirectionalIterationContext & ctx, const Dual1Vec3r & p_in, Dual1Vec3r & p_out) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalT(ctx, p_in, p_out);
+	}
+
+#if USE_DOUBLE
+	virtual void eval(const IterationContextT<Dual3f> & ctx, const DualVec3f & p_in, DualVec3f & p_out) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalT(ctx, p_in, p_out);
+	}
+
+	virtual void eval(const IterationContextT<Dual1f> & ctx, const Dual1Vec3f & p_in, Dual1Vec3f & p_out) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalT(ctx, p_in, p_out);
+	}
+#endif
+
+	virtual void evalBatch(const IterationContext * ctx, const DualVec3r * p_in, DualVec3r * p_out, const bool * active, const int count) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalBatchT(ctx, p_in, p_out, active, count);
+	}
+
+	virtual void evalBatch(const DirectionalIterationContext * ctx, const Dual1Vec3r * p_in, Dual1Vec3r * p_out, const bool * active, const int count) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalBatchT(ctx, p_in, p_out, active, count);
+	}
+
+#if USE_DOUBLE
+	virtual void evalBatch(const IterationContextT<Dual3f> * ctx, const DualVec3f * p_in, DualVec3f * p_out, const bool * active, const int count) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalBatchT(ctx, p_in, p_out, active, count);
+	}
+
+	virtual void evalBatch(const IterationContextT<Dual1f> * ctx, const Dual1Vec3f * p_in, Dual1Vec3f * p_out, const bool * active, const int count) const noexcept override final
+	{
+		static_cast<const Derived *>(this)->evalBatchT(ctx, p_in, p_out, active, count);
+	}
+#endif
+
+	virtual IterationFunction * clone() const override final
+	{
+		return new Derived(static_cast<const Derived &>(*this));
+	}
 };
 
 
@@ -357,31 +945,11 @@ struct GeneralDualDE final : public DualDEObject
 			delete f;
 	}
 
-	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) noexcept override final
+	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept override final
 	{
-		DualVec3r p = p_os;
-
-		const int num_funcs = (int)funcs.size();
-		for (int i = 0; i < num_funcs; ++i)
-			funcs[i]->init(p);
-
-		int seq_idx = 0;
-		int i = 0;
-		for (; i < max_iters; i++)
-		{
-			DualVec3r p_new;
-			funcs[sequence[seq_idx]]->eval(p, p_new);
-			p = p_new;
-
-			const real r2 = length2(p);
-			if (r2 > bailout_radius2)
-				break;
-
-			seq_idx = nextSeqIdx(seq_idx);
-		}
+		const DualVec3r p = iterate(p_os);
 #if 1
-		const int max_iter = std::min(max_iters, num_funcs - 1);
-		return getHybridDEKnighty(power_products[max_iter], power_products.back(), p, normal_os_out); // TODO: bounding volume! (1st argument)
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), p, normal_os_out); // TODO: bounding volume! (1st argument)
 #else
 #if 1
 		return getHybridDEClaude(1, 8, p, normal_os_out);
@@ -391,12 +959,183 @@ struct GeneralDualDE final : public DualDEObject
 #endif
 	}
 
+	virtual real getDirectionalDE(const Dual1Vec3r & p_os) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os));
+	}
+
+#if USE_DOUBLE
+	virtual real getDEFloat(const DualVec3f & p_os) const noexcept override final
+	{
+		vec3r normal_ignored;
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os), normal_ignored);
+	}
+
+	virtual real getDirectionalDEFloat(const Dual1Vec3f & p_os) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os));
+	}
+#endif
+
+	virtual real getLODDE(const DualVec3r & p_os, const real footprint) const noexcept override final
+	{
+		vec3r normal_ignored;
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint), normal_ignored);
+	}
+
+	virtual real getLODDE(const Dual1Vec3r & p_os, const real footprint) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint));
+	}
+
+#if USE_DOUBLE
+	virtual real getLODDE(const DualVec3f & p_os, const real footprint) const noexcept override final
+	{
+		vec3r normal_ignored;
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint), normal_ignored);
+	}
+
+	virtual real getLODDE(const Dual1Vec3f & p_os, const real footprint) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint));
+	}
+#endif
+
 	virtual SceneObject * clone() const override
 	{
 		return new GeneralDualDE(*this);
 	}
 
+protected:
+	// Rays still marching in float go one at a time, the rest are iterated together to amortise the virtual calls
+	virtual void getMarchDEBatch(const vec3r * p_os, const vec3r * d, const real * footprint, bool * full_precision, real * DE_out, const int count) const noexcept override final
+	{
+		for (int i0 = 0; i0 < count; i0 += packet_size)
+		{
+			int idx[packet_size];
+			real batch_footprint[packet_size];
+			int batch_size = 0;
+			for (int i = i0; i < std::min(count, i0 + packet_size); ++i)
+			{
+#if USE_DOUBLE
+				if (!full_precision[i])
+				{
+					DE_out[i] = getMarchDE(p_os[i], d[i], footprint[i], full_precision[i]);
+					continue;
+				}
+#else
+				(void) full_precision;
+#endif
+				statsCountDE();
+				idx[batch_size] = i;
+				batch_footprint[batch_size] = footprint[i];
+				batch_size++;
+			}
+
+			if (directional_march)
+			{
+				Dual1Vec3r p[packet_size];
+				for (int b = 0; b < batch_size; ++b)
+					p[b] = makeDirectionalDual(p_os[idx[b]], d[idx[b]]);
+
+				iterateBatch(p, batch_footprint, batch_size);
+				for (int b = 0; b < batch_size; ++b)
+					DE_out[idx[b]] = getHybridDEKnighty(power_products[maxIter()], power_products.back(), p[b]);
+			}
+			else
+			{
+				DualVec3r p[packet_size];
+				for (int b = 0; b < batch_size; ++b)
+				{
+					const vec3r & q = p_os[idx[b]];
+					p[b] = DualVec3r(Dual3r(q.x(), 0), Dual3r(q.y(), 1), Dual3r(q.z(), 2));
+				}
+
+				iterateBatch(p, batch_footprint, batch_size);
+				vec3r normal_ignored;
+				for (int b = 0; b < batch_size; ++b)
+					DE_out[idx[b]] = getHybridDEKnighty(power_products[maxIter()], power_products.back(), p[b], normal_ignored);
+			}
+		}
+	}
+
 private:
+	// Apply the iteration sequence to p_os until bailout or max_iters is reached,
+	// or with a footprint until further iterations would only add detail finer than it
+	template <typename dual_type>
+	inline vec<3, dual_type> iterate(const vec<3, dual_type> & p_os, const real footprint = 0) const noexcept
+	{
+		vec<3, dual_type> p = p_os;
+		IterationContextT<dual_type> ctx = { p_os, 0 };
+
+		int seq_idx = 0;
+		for (int i = 0; i < max_iters; i++)
+		{
+			vec<3, dual_type> p_new;
+			ctx.iteration = i;
+			funcs[sequence[seq_idx]]->eval(ctx, p, p_new);
+			p = p_new;
+
+			const real r2 = length2(p);
+			if (r2 > bailout_radius2 || (footprint > 0 && finerThanFootprint(p, footprint)))
+				break;
+
+			seq_idx = nextSeqIdx(seq_idx);
+		}
+
+		statsCountIterations(ctx.iteration + 1, max_iters);
+		return p;
+	}
+
+	// iterate() for up to packet_size points at once, each with its own footprint, stopping the points individually
+	template <typename dual_type>
+	inline void iterateBatch(vec<3, dual_type> * p, const real * footprint, const int count) const noexcept
+	{
+		IterationContextT<dual_type> ctx[packet_size];
+		vec<3, dual_type> p_new[packet_size];
+		bool active[packet_size];
+		int iterations[packet_size];
+		int num_active = count;
+		for (int k = 0; k < count; ++k)
+		{
+			ctx[k] = { p[k], 0 };
+			active[k] = true;
+			iterations[k] = 0;
+		}
+
+		int seq_idx = 0;
+		for (int i = 0; i < max_iters && num_active > 0; i++)
+		{
+			for (int k = 0; k < count; ++k)
+				ctx[k].iteration = i;
+
+			funcs[sequence[seq_idx]]->evalBatch(ctx, p, p_new, active, count);
+
+			for (int k = 0; k < count; ++k)
+			{
+				if (!active[k])
+					continue;
+
+				p[k] = p_new[k];
+				iterations[k] = i + 1;
+
+				const real r2 = length2(p[k]);
+				if (r2 > bailout_radius2 || (footprint[k] > 0 && finerThanFootprint(p[k], footprint[k])))
+				{
+					active[k] = false;
+					num_active--;
+				}
+			}
+
+			seq_idx = nextSeqIdx(seq_idx);
+		}
+
+		for (int k = 0; k < count; ++k)
+			statsCountIterations(iterations[k], max_iters);
+	}
+
+	inline int maxIter() const noexcept { return std::min(max_iters, (int)funcs.size() - 1); }
+
 	// Compute max_power and set bounding volume size of the fractal
 	const std::vector<real> getPowerProducts() const
 	{
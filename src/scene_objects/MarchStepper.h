@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+#include "maths/real.h"
+
+
+
+// Step length control for sphere tracing a DE object, with two optional ways of taking bigger steps than DE * step_scale:
+//  - Over-relaxation: steps are made longer by the over_relaxation factor, see "Enhanced Sphere Tracing" by Keinert et al.
+//    Ref: https://erleuchtet.org/~cupe/permanent/enhanced_sphere_tracing.pdf
+//  - Adaptive step scale: the Lipschitz constant of the DE is estimated from the change in DE between the last two steps,
+//    and the steps are scaled by its inverse, between step_scale where the DE is badly behaved and 1 where the DE is exact.
+// Longer steps are only safe while the unbounding sphere at each step overlaps the previous one. If they don't, the
+// surface could have been stepped over, so the march goes back to the previous safe step and continues with plain
+// DE * step_scale steps from there. With the default settings this is exactly plain sphere tracing.
+struct MarchStepper
+{
+	real t; // Current distance along the ray
+	real step = 0; // Length of the last step
+	real prev_radius = 0; // Safe radius (DE * step_scale) at the start of the last step
+	real prev_DE = 0; // Unscaled DE at the start of the last step, for estimating the Lipschitz constant
+	real boost = 1; // What the last step was multiplied by on top of the safe radius
+	bool relaxed; // Whether longer steps can be taken, cleared after stepping too far
+	bool has_prev_DE = false;
+
+
+	MarchStepper() noexcept = default;
+
+	MarchStepper(const real t_start, const real over_relaxation, const bool adaptive_step_scale) noexcept :
+		t(t_start), relaxed(over_relaxation > 1 || adaptive_step_scale) { }
+
+	// Step with the DE at the current position, returns false if the last step went too far and the march went back instead.
+	// Only accepted steps can be hits.
+	bool advance(const real DE, const real step_scale, const real over_relaxation, const bool adaptive_step_scale) noexcept
+	{
+		const real radius = DE * step_scale;
+		if (boost > 1 && radius + prev_radius < step)
+		{
+			// Go back to the last safe step, this position's DE is wasted
+			t += prev_radius - step;
+			step = prev_radius;
+			boost = 1;
+			relaxed = false;
+			has_prev_DE = false;
+			return false;
+		}
+
+		real new_boost = 1;
+		if (relaxed)
+		{
+			new_boost = over_relaxation;
+			if (adaptive_step_scale && has_prev_DE && step_scale < 1)
+			{
+				// Steps are only longer than DE * step_scale where the DE looks closer to 1-Lipschitz along the ray
+				const real lipschitz = std::max((real)1, std::min(1 / step_scale, std::fabs(DE - prev_DE) / step));
+				new_boost *= 1 / (step_scale * lipschitz);
+			}
+		}
+
+		step = radius * new_boost;
+		boost = new_boost;
+		prev_radius = radius;
+		prev_DE = DE;
+		has_prev_DE = true;
+		t += step;
+		return true;
+	}
+
+	// Step by a known safe distance, e.g. from a distance bound cache, which isn't a DE so doesn't help estimating anything
+	void skip(const real safe_step) noexcept
+	{
+		t += safe_step;
+		step = safe_step;
+		prev_radius = safe_step;
+		boost = 1;
+		has_prev_DE = false;
+	}
+};
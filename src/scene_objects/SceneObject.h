@@ -9,8 +9,41 @@ struct SceneObject
 {
 	virtual ~SceneObject() = default;
 
-	virtual real  intersect(const Ray   & r) noexcept = 0;
-	virtual vec3r getNormal(const vec3r & p) noexcept = 0;
+	// Scene objects are immutable after construction, so that one instance can be shared by all render threads
+	virtual real  intersect(const Ray   & r) const noexcept = 0;
+	virtual vec3r getNormal(const vec3r & p) const noexcept = 0;
+
+	// Intersect a packet of rays, writing a hit distance for each ray; by default each ray is intersected separately
+	virtual void intersectPacket(const RayPacket & packet, real * hit_t_out) const noexcept
+	{
+		for (int i = 0; i < packet.num_rays; ++i)
+			hit_t_out[i] = intersect({ packet.o[i], packet.d[i] });
+	}
+
+	// Get a sphere enclosing the object, used to build the scene's acceleration structure
+	virtual void getBoundingSphere(vec3r & centre_out, real & radius_out) const noexcept = 0;
+
+	// Any-hit query, returns true if there's an intersection closer than max_t; by default the nearest intersection is used
+	virtual bool occluded(const Ray & r, const real max_t) const noexcept
+	{
+		const real hit_t = intersect(r);
+		return hit_t > ray_epsilon && hit_t < max_t;
+	}
+
+	// Any-hit query for a packet of rays, each with its own max_t; by default each ray is tested separately
+	virtual void occludedPacket(const RayPacket & packet, const real * max_t, bool * occluded_out) const noexcept
+	{
+		for (int i = 0; i < packet.num_rays; ++i)
+			occluded_out[i] = occluded({ packet.o[i], packet.d[i] }, max_t[i]);
+	}
+
+	// Lower bound on the distance from p to the surface, for objects that can start intersecting rays from RayPacket::t_start.
+	// Objects that ignore t_start don't constrain it and return infinity.
+	virtual real getDistanceBound(const vec3r & p) const noexcept
+	{
+		(void) p;
+		return real_inf;
+	}
 
 	virtual SceneObject * clone() const = 0;
 
@@ -10,7 +10,7 @@ struct Sphere final : public SceneObject
 	real  radius = 1; 
 
 
-	virtual real intersect(const Ray & r) noexcept override
+	virtual real intersect(const Ray & r) const noexcept override
 	{
 		const vec3r s = r.o - centre;
 		const real  b = dot(s, r.d);
@@ -26,11 +26,17 @@ struct Sphere final : public SceneObject
 		return (t1 >= 0) ? t1 : t2;
 	}
 
-	virtual vec3r getNormal(const vec3r & p) noexcept override
+	virtual vec3r getNormal(const vec3r & p) const noexcept override
 	{
 		return (p - centre) * (1 / radius);
 	}
 
+	virtual void getBoundingSphere(vec3r & centre_out, real & radius_out) const noexcept override final
+	{
+		centre_out = centre;
+		radius_out = radius;
+	}
+
 	virtual SceneObject * clone() const override final
 	{
 		Sphere * o = new Sphere;
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "DualDEObject.h"
+
+
+
+template <int... seq>
+using HybridSequence = std::integer_sequence<int, seq...>;
+
+
+// Compile-time version of GeneralDualDE, e.g.
+//  StaticHybridDE<HybridSequence<0, 1>, DualMandelbulbIteration, DualMengerSpongeCIteration>
+// The iteration sequence is unrolled and the (final) iteration functions are called directly,
+// so the compiler can inline and fuse the formula bodies instead of going through a virtual call per iteration.
+template <typename Sequence, typename... Funcs>
+struct StaticHybridDE;
+
+template <int... seq, typename... Funcs>
+struct StaticHybridDE<HybridSequence<seq...>, Funcs...> final : public DualDEObject
+{
+	static_assert(sizeof...(seq) > 0, "Hybrid sequence must not be empty");
+	static_assert(((seq >= 0 && seq < (int)sizeof...(Funcs)) && ...), "Hybrid sequence index out of range");
+
+	const int max_iters;
+
+	const std::tuple<Funcs...> funcs;
+	const std::vector<real> power_products;
+
+
+	StaticHybridDE(const int max_iters_, const Funcs &... funcs_) : max_iters(max_iters_), funcs(funcs_...), power_products(getPowerProducts()) { }
+
+	virtual real getDE(const DualVec3r & p_os, vec3r & normal_os_out) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os), normal_os_out);
+	}
+
+	virtual real getDirectionalDE(const Dual1Vec3r & p_os) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os));
+	}
+
+#if USE_DOUBLE
+	virtual real getDEFloat(const DualVec3f & p_os) const noexcept override final
+	{
+		vec3r normal_ignored;
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os), normal_ignored);
+	}
+
+	virtual real getDirectionalDEFloat(const Dual1Vec3f & p_os) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os));
+	}
+#endif
+
+	virtual real getLODDE(const DualVec3r & p_os, const real footprint) const noexcept override final
+	{
+		vec3r normal_ignored;
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint), normal_ignored);
+	}
+
+	virtual real getLODDE(const Dual1Vec3r & p_os, const real footprint) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint));
+	}
+
+#if USE_DOUBLE
+	virtual real getLODDE(const DualVec3f & p_os, const real footprint) const noexcept override final
+	{
+		vec3r normal_ignored;
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint), normal_ignored);
+	}
+
+	virtual real getLODDE(const Dual1Vec3f & p_os, const real footprint) const noexcept override final
+	{
+		return getHybridDEKnighty(power_products[maxIter()], power_products.back(), iterate(p_os, footprint));
+	}
+#endif
+
+	virtual SceneObject * clone() const override
+	{
+		return new StaticHybridDE(*this);
+	}
+
+private:
+	// With a footprint the iteration also stops once further iterations would only add detail finer than it, see GeneralDualDE
+	template <typename dual_type>
+	inline vec<3, dual_type> iterate(const vec<3, dual_type> & p_os, const real footprint = 0) const noexcept
+	{
+		vec<3, dual_type> p = p_os;
+		IterationContextT<dual_type> ctx = { p_os, 0 };
+
+		// Run through the whole sequence per loop, the fold stops at bailout or when reaching max_iters
+		while ((iterateOnce<seq>(ctx, p, footprint) && ...)) { }
+
+		statsCountIterations(ctx.iteration, max_iters);
+		return p;
+	}
+
+	// Apply a single iteration, returns false if the iteration should stop
+	template <int func_idx, typename dual_type>
+	inline bool iterateOnce(IterationContextT<dual_type> & ctx, vec<3, dual_type> & p, const real footprint) const noexcept
+	{
+		if (ctx.iteration >= max_iters)
+			return false;
+
+		vec<3, dual_type> p_new;
+		std::get<func_idx>(funcs).evalT(ctx, p, p_new);
+		p = p_new;
+		ctx.iteration++;
+
+		const real r2 = length2(p);
+		return r2 <= bailout_radius2 && !(footprint > 0 && finerThanFootprint(p, footprint));
+	}
+
+	inline int maxIter() const noexcept { return std::min(max_iters, (int)sizeof...(Funcs) - 1); }
+
+	const std::vector<real> getPowerProducts() const
+	{
+		const real powers[] = { std::get<seq>(funcs).getPower()... };
+		constexpr int seq_len = (int)sizeof...(seq);
+
+		std::vector<real> power_prod;
+		real p = 1;
+		for (int i = 0; i < max_iters; i++)
+		{
+			p *= powers[i % seq_len];
+			power_prod.push_back(p);
+		}
+
+		return power_prod;
+	}
+};
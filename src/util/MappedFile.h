@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+
+
+// File of known size mapped into memory for writing, so that large outputs can be written in place without extra copies
+struct MappedFile
+{
+	uint8_t * data = nullptr;
+	size_t size = 0;
+
+
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile & operator=(const MappedFile &) = delete;
+
+	~MappedFile() { close(); }
+
+	// Create or truncate the file to the given size and map it, returns false on failure
+	bool create(const char * filename, const size_t size_)
+	{
+		close();
+#if _WIN32
+		file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size_ >> 32), (DWORD)(size_ & 0xFFFFFFFF), nullptr);
+		if (mapping == nullptr)
+		{
+			close();
+			return false;
+		}
+
+		data = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size_);
+		if (data == nullptr)
+		{
+			close();
+			return false;
+		}
+#else
+		fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return false;
+
+		if (ftruncate(fd, (off_t)size_) != 0)
+		{
+			close();
+			return false;
+		}
+
+		void * const ptr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED)
+		{
+			close();
+			return false;
+		}
+		data = (uint8_t *)ptr;
+#endif
+		size = size_;
+		return true;
+	}
+
+	// Unmap and close, the contents are written back by the OS
+	void close()
+	{
+#if _WIN32
+		if (data != nullptr) UnmapViewOfFile(data);
+		if (mapping != nullptr) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr) munmap(data, size);
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+private:
+#if _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
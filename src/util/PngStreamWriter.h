@@ -0,0 +1,355 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+
+
+// Writes an 8-bit RGB PNG a band of rows at a time, so that images far larger than memory can be saved as they're rendered.
+// The zlib stream is compressed with a single fixed Huffman deflate block which carries on across calls, with LZ77 matches
+// able to reach back into the previous rows, and each call's compressed bytes go out as their own IDAT chunk.
+// Rows are filtered with whichever PNG filter gives the smallest sum of absolute differences, like stb_image_write.
+// Ref: https://www.w3.org/TR/png/ and https://www.rfc-editor.org/rfc/rfc1951
+struct PngStreamWriter
+{
+	PngStreamWriter() = default;
+	PngStreamWriter(const PngStreamWriter &) = delete;
+	PngStreamWriter & operator=(const PngStreamWriter &) = delete;
+
+	~PngStreamWriter() { if (file != nullptr) fclose(file); }
+
+	// Create the file and write the header, returns false on failure
+	bool open(const char * filename, const int xres_, const int yres_)
+	{
+		xres = xres_;
+		yres = yres_;
+		rows_written = 0;
+		file = fopen(filename, "wb");
+		if (file == nullptr)
+			return false;
+
+		static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+		fwrite(signature, 1, 8, file);
+
+		uint8_t ihdr[13] = { 0 };
+		putBigEndian(ihdr + 0, (uint32_t)xres);
+		putBigEndian(ihdr + 4, (uint32_t)yres);
+		ihdr[8] = 8; // Bit depth
+		ihdr[9] = 2; // Colour type RGB, compression, filter and interlace methods are all 0
+		writeChunk("IHDR", ihdr, 13);
+
+		// zlib header for deflate with a 32K window, then the start of the one block that all rows go in
+		compressed = { 0x78, 0x01 };
+		bit_buffer = 0;
+		bit_count = 0;
+		writeBits(0, 1); // Not the final block
+		writeBits(1, 2); // Fixed Huffman codes
+
+		prev_row.assign(xres * 3, 0);
+		history.clear();
+		history_base = 0;
+		head.assign(hash_size, -1);
+		prev.assign(window_size, -1);
+		adler_a = 1;
+		adler_b = 0;
+		return !ferror(file);
+	}
+
+	// Append the next num_rows rows of packed RGB pixels and write their compressed data out
+	bool writeRows(const uint8_t * const rgb, const int num_rows)
+	{
+		if (file == nullptr || rows_written + num_rows > yres)
+			return false;
+
+		// Filter all rows into the history after the bytes that matches can still refer back to
+		const int row_bytes = xres * 3;
+		const int64_t begin = history_base + (int64_t)history.size();
+		std::vector<uint8_t> filtered(row_bytes);
+		for (int y = 0; y < num_rows; ++y)
+		{
+			const uint8_t * const row = rgb + (size_t)y * row_bytes;
+			const int filter = filterRow(row, filtered);
+			history.push_back((uint8_t)filter);
+			history.insert(history.end(), filtered.begin(), filtered.end());
+			std::copy(row, row + row_bytes, prev_row.begin());
+		}
+		rows_written += num_rows;
+
+		const int64_t end = history_base + (int64_t)history.size();
+		updateAdler(&history[(size_t)(begin - history_base)], (size_t)(end - begin));
+		compress(begin, end);
+
+		// Only the last window's worth of input is needed for later matches
+		if (history.size() > (size_t)window_size)
+		{
+			const size_t drop = history.size() - window_size;
+			history.erase(history.begin(), history.begin() + drop);
+			history_base += (int64_t)drop;
+		}
+
+		flushCompressed();
+		return !ferror(file);
+	}
+
+	// End the zlib stream and the file, returns false if anything failed to write or not all rows were given
+	bool close()
+	{
+		if (file == nullptr)
+			return false;
+
+		// End of block, then an empty final block, then pad to a byte for the Adler-32 checksum
+		writeBits(0, 7);
+		writeBits(1, 1);
+		writeBits(1, 2);
+		writeBits(0, 7);
+		if (bit_count > 0)
+			writeBits(0, 8 - bit_count);
+
+		const uint32_t adler = (adler_b << 16) | adler_a;
+		for (int i = 3; i >= 0; --i)
+			compressed.push_back((uint8_t)(adler >> (i * 8)));
+		flushCompressed();
+		writeChunk("IEND", nullptr, 0);
+
+		const bool ok = !ferror(file) && rows_written == yres;
+		fclose(file);
+		file = nullptr;
+		return ok;
+	}
+
+private:
+	constexpr static int window_size = 32768;
+	constexpr static int hash_bits = 15;
+	constexpr static int hash_size = 1 << hash_bits;
+	constexpr static int max_chain = 32; // Number of earlier positions with the same hash to try for a match
+	constexpr static int min_match = 3, max_match = 258;
+
+	static void putBigEndian(uint8_t * const p, const uint32_t v) noexcept
+	{
+		p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+	}
+
+	static uint32_t crc32(uint32_t crc, const uint8_t * const data, const size_t len) noexcept
+	{
+		static const std::vector<uint32_t> table = []()
+		{
+			std::vector<uint32_t> t(256);
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; ++k)
+					c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				t[i] = c;
+			}
+			return t;
+		}();
+
+		for (size_t i = 0; i < len; ++i)
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return crc;
+	}
+
+	void writeChunk(const char * const type, const uint8_t * const data, const size_t len)
+	{
+		uint8_t header[8];
+		putBigEndian(header, (uint32_t)len);
+		std::copy(type, type + 4, header + 4);
+		fwrite(header, 1, 8, file);
+		if (len > 0)
+			fwrite(data, 1, len, file);
+
+		uint8_t crc[4];
+		putBigEndian(crc, crc32(crc32(0xFFFFFFFFu, header + 4, 4), data, len) ^ 0xFFFFFFFFu);
+		fwrite(crc, 1, 4, file);
+	}
+
+	// Write out the whole bytes compressed so far as an IDAT chunk, the partial byte stays in the bit buffer
+	void flushCompressed()
+	{
+		if (!compressed.empty())
+			writeChunk("IDAT", compressed.data(), compressed.size());
+		compressed.clear();
+	}
+
+	void updateAdler(const uint8_t * const data, const size_t len) noexcept
+	{
+		constexpr uint32_t mod = 65521;
+		for (size_t i = 0; i < len; )
+		{
+			// Sums fit in 32 bits for this many bytes before they need reducing
+			const size_t n = std::min(len - i, (size_t)5552);
+			for (size_t k = 0; k < n; ++k, ++i)
+			{
+				adler_a += data[i];
+				adler_b += adler_a;
+			}
+			adler_a %= mod;
+			adler_b %= mod;
+		}
+	}
+
+	// Choose a filter for the row and apply it, returns the filter type
+	int filterRow(const uint8_t * const row, std::vector<uint8_t> & out) const noexcept
+	{
+		const int row_bytes = xres * 3;
+		const auto paeth = [](const int a, const int b, const int c)
+		{
+			const int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+			return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+		};
+
+		int best_filter = 0, best_cost = 0x7FFFFFFF;
+		std::vector<uint8_t> & best = out;
+		std::vector<uint8_t> line(row_bytes);
+		for (int filter = 0; filter < 5; ++filter)
+		{
+			int cost = 0;
+			for (int i = 0; i < row_bytes; ++i)
+			{
+				const int a = (i >= 3) ? row[i - 3] : 0; // Left
+				const int b = prev_row[i]; // Up
+				const int c = (i >= 3) ? prev_row[i - 3] : 0; // Up left
+				const int predicted = (filter == 0) ? 0 : (filter == 1) ? a : (filter == 2) ? b : (filter == 3) ? (a + b) / 2 : paeth(a, b, c);
+				line[i] = (uint8_t)(row[i] - predicted);
+				cost += abs((int8_t)line[i]);
+			}
+
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_filter = filter;
+				best.swap(line);
+				line.resize(row_bytes);
+			}
+		}
+
+		return best_filter;
+	}
+
+	void writeBits(const uint32_t value, const int count)
+	{
+		bit_buffer |= value << bit_count;
+		bit_count += count;
+		while (bit_count >= 8)
+		{
+			compressed.push_back((uint8_t)bit_buffer);
+			bit_buffer >>= 8;
+			bit_count -= 8;
+		}
+	}
+
+	// Huffman codes are packed starting from their most significant bit
+	void writeCode(const uint32_t code, const int count)
+	{
+		uint32_t reversed = 0;
+		for (int i = 0; i < count; ++i)
+			reversed |= ((code >> i) & 1) << (count - 1 - i);
+		writeBits(reversed, count);
+	}
+
+	// Literal/length symbol with the fixed code lengths
+	void writeSymbol(const int symbol)
+	{
+		if (symbol < 144)      writeCode(0x30 + symbol, 8);
+		else if (symbol < 256) writeCode(0x190 + (symbol - 144), 9);
+		else if (symbol < 280) writeCode(symbol - 256, 7);
+		else                   writeCode(0xC0 + (symbol - 280), 8);
+	}
+
+	void writeMatch(const int len, const int dist)
+	{
+		static const int len_base[29]  = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const int len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const int dist_base[30]  = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+			4097, 6145, 8193, 12289, 16385, 24577 };
+		static const int dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		int l = 28;
+		while (len_base[l] > len) --l;
+		writeSymbol(257 + l);
+		writeBits(len - len_base[l], len_extra[l]);
+
+		int d = 29;
+		while (dist_base[d] > dist) --d;
+		writeCode(d, 5);
+		writeBits(dist - dist_base[d], dist_extra[d]);
+	}
+
+	uint8_t at(const int64_t pos) const noexcept { return history[(size_t)(pos - history_base)]; }
+
+	int hashAt(const int64_t pos) const noexcept
+	{
+		const uint32_t v = at(pos) | (at(pos + 1) << 8) | (at(pos + 2) << 16);
+		return (int)((v * 2654435761u) >> (32 - hash_bits));
+	}
+
+	void insertHash(const int64_t pos) noexcept
+	{
+		const int h = hashAt(pos);
+		prev[pos & (window_size - 1)] = head[h];
+		head[h] = pos;
+	}
+
+	// Greedy LZ77 over the history from begin to end, with matches back into the window before begin
+	void compress(const int64_t begin, const int64_t end)
+	{
+		int64_t pos = begin;
+		while (pos < end)
+		{
+			if (end - pos < min_match)
+			{
+				writeSymbol(at(pos++));
+				continue;
+			}
+
+			int best_len = 0;
+			int64_t best_pos = 0;
+			const int max_len = (int)std::min((int64_t)max_match, end - pos);
+			int64_t cand = head[hashAt(pos)];
+			for (int chain = 0; chain < max_chain && cand >= 0 && pos - cand <= window_size; ++chain)
+			{
+				int len = 0;
+				while (len < max_len && at(cand + len) == at(pos + len))
+					++len;
+				if (len > best_len)
+				{
+					best_len = len;
+					best_pos = cand;
+					if (len == max_len)
+						break;
+				}
+				cand = prev[cand & (window_size - 1)];
+			}
+
+			if (best_len >= min_match)
+			{
+				writeMatch(best_len, (int)(pos - best_pos));
+				for (int i = 0; i < best_len; ++i, ++pos)
+					if (end - pos >= min_match)
+						insertHash(pos);
+			}
+			else
+			{
+				insertHash(pos);
+				writeSymbol(at(pos++));
+			}
+		}
+	}
+
+	FILE * file = nullptr;
+	int xres = 0, yres = 0, rows_written = 0;
+	std::vector<uint8_t> prev_row; // Unfiltered previous row, zero before the first
+
+	std::vector<uint8_t> history; // Filtered input from history_base on, at least a window's worth once there's that much
+	int64_t history_base = 0;
+	std::vector<int64_t> head; // Latest position with each hash of the next 3 bytes, or -1
+	std::vector<int64_t> prev; // Earlier position with the same hash as each position in the window
+
+	std::vector<uint8_t> compressed; // Whole bytes of compressed data not written out yet
+	uint32_t bit_buffer = 0;
+	int bit_count = 0;
+	uint32_t adler_a = 1, adler_b = 0;
+};